@@ -0,0 +1,376 @@
+/*********************************************************************
+ * Name: bench.c
+ * Description:
+ *      Benchmarks for smallsh's hot paths. smallsh.c is compiled into
+ *      this file so its static functions can be driven directly:
+ *      running `true` and /bin/true, per-command latency, tokenizer and expansion
+ *      throughput, repeated lines with and without the parsed-line cache,
+ *      compiled loop iterations, glob expansion in a large directory, and
+ *      background reaping. Results are written as
+ *      JSON so runs can be compared across commits.
+ *      Usage: bench [output.json [revision]]
+ *********************************************************************/
+
+#define main smallsh_main
+#include "../smallsh.c"
+#undef main
+
+#define LOOP_COMMANDS 2000    /* `true` commands run for commands per second */
+#define LATENCY_SAMPLES 1000  /* commands timed one by one for percentiles */
+#define PARSE_LINE_WORDS 100000 /* words in each synthetic line */
+#define PARSE_ROUNDS 20       /* times each synthetic line is processed */
+#define REAP_JOBS 1000        /* background jobs started for the reaping rate */
+#define CACHED_LINES 200000   /* repeated lines parsed for the cache rates */
+#define LOOP_ITERATIONS 200000 /* words of the for loop run for the loop rate */
+#define GLOB_FILES 50000      /* files in the directory the globs expand in */
+#define GLOB_ROUNDS 20        /* times the glob line is expanded */
+
+static double Now(void);
+static int CompareDoubles(const void *a, const void *b);
+static void ResetCommand(command *cmd);
+static int RunLine(command *cmd, const char *line);
+static double BenchCommandsPerSecond(const char *line);
+static void BenchLatency(double *p50, double *p90, double *p99);
+static double BenchTokenizer(const char *line);
+static double BenchExpansion(const char *line);
+static double BenchParseLine(const char *line, bool cached);
+static double BenchLoop(void);
+static double BenchGlob(void);
+static double BenchReaping(void);
+static char *SyntheticLine(const char *word);
+
+/*******************************************************************************
+ * Main function
+ ********************************************************************************/
+int main(int argc, char *argv[]) {
+    const char *out_path = argc > 1 ? argv[1] : "bench/results.json";
+    const char *revision = argc > 2 ? argv[2] : "";
+
+    interactive = false;
+    SetupSignals();
+    setenv("BENCH_VAR", "expanded", 1);
+    const char *engine = getenv("SMALLSH_SPAWN");
+    if (engine != NULL && strcmp(engine, "fork") == 0) spawn_engine = SPAWN_ENGINE_FORK;
+
+    double commands_per_second = BenchCommandsPerSecond("true");
+    double external_per_second = BenchCommandsPerSecond("/bin/true");
+    double p50, p90, p99;
+    BenchLatency(&p50, &p90, &p99);
+
+    char *plain_line = SyntheticLine("word 'quoted word' \"double $HOME\" a\\ b ");
+    char *expand_line = SyntheticLine("$$ $? ${BENCH_VAR} pre$BENCH_VAR/post ~/dir \"$HOME x\" ");
+    if (plain_line == NULL || expand_line == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
+    double tokenizer_mb = BenchTokenizer(plain_line);
+    double expansion_mb = BenchExpansion(expand_line);
+    const char *script_line = "grep -v $PATTERN < input.txt | sort -u | head -n 10 > output.txt";
+    double hit_lines = BenchParseLine(script_line, true);
+    double miss_lines = BenchParseLine(script_line, false);
+    double loop_iterations = BenchLoop();
+    double glob_names = BenchGlob();
+    double reaped_per_second = BenchReaping();
+
+    FILE *out = fopen(out_path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "fopen() failed on \"%s\"\n", out_path);
+        exit(1);
+    }
+    fprintf(out, "{\n");
+    fprintf(out, "  \"revision\": \"%s\",\n", revision);
+    fprintf(out, "  \"spawn_engine\": \"%s\",\n", spawn_engine == SPAWN_ENGINE_FORK ? "fork" : "spawn");
+    fprintf(out, "  \"true_commands_per_second\": %.1f,\n", commands_per_second);
+    fprintf(out, "  \"external_true_commands_per_second\": %.1f,\n", external_per_second);
+    fprintf(out, "  \"command_latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f},\n",
+            p50 * 1e6, p90 * 1e6, p99 * 1e6);
+    fprintf(out, "  \"tokenizer_mb_per_second\": %.1f,\n", tokenizer_mb);
+    fprintf(out, "  \"expansion_mb_per_second\": %.1f,\n", expansion_mb);
+    fprintf(out, "  \"cached_lines_per_second\": %.1f,\n", hit_lines);
+    fprintf(out, "  \"uncached_lines_per_second\": %.1f,\n", miss_lines);
+    fprintf(out, "  \"loop_iterations_per_second\": %.1f,\n", loop_iterations);
+    fprintf(out, "  \"glob_names_per_second\": %.1f,\n", glob_names);
+    fprintf(out, "  \"background_reaped_per_second\": %.1f\n", reaped_per_second);
+    fprintf(out, "}\n");
+    fclose(out);
+
+    printf("true commands/s       %.1f\n", commands_per_second);
+    printf("/bin/true commands/s  %.1f\n", external_per_second);
+    printf("latency p50/p90/p99   %.1f / %.1f / %.1f us\n", p50 * 1e6, p90 * 1e6, p99 * 1e6);
+    printf("tokenizer             %.1f MB/s\n", tokenizer_mb);
+    printf("expansion             %.1f MB/s\n", expansion_mb);
+    printf("cached lines/s        %.1f\n", hit_lines);
+    printf("uncached lines/s      %.1f\n", miss_lines);
+    printf("loop iterations/s     %.1f\n", loop_iterations);
+    printf("glob names/s          %.1f\n", glob_names);
+    printf("background reaped/s   %.1f\n", reaped_per_second);
+    printf("results written to %s\n", out_path);
+    free(plain_line);
+    free(expand_line);
+    return 0;
+}
+
+/*********************************************************************
+ * Now
+ * @return: seconds on the monotonic clock
+ *********************************************************************/
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*********************************************************************
+ * CompareDoubles
+ * qsort comparison for ascending doubles.
+ *********************************************************************/
+static int CompareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/*********************************************************************
+ * ResetCommand
+ * Drop the last line, as the top of smallsh's main loop does.
+ * @param command* cmd
+ *********************************************************************/
+static void ResetCommand(command *cmd) {
+    ArenaReset();
+    memset(cmd, 0, sizeof *cmd);
+}
+
+/*********************************************************************
+ * RunLine
+ * Take one line through the same steps as smallsh's main loop:
+ * parse (through the parsed-line cache), expand and execute.
+ * @param command* cmd
+ * @param const char* line
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int RunLine(command *cmd, const char *line) {
+    ResetCommand(cmd);
+    char *copy = ArenaStrndup(line, strlen(line));
+    if (copy == NULL || ParseLine(cmd, copy) < 0) return -1;
+    if (cmd->program != NULL) {
+        int result = RunProgram(cmd->program);
+        ProgramRelease(cmd->program);
+        return result;
+    }
+    if (cmd->line_count == 0) return 0;
+    if (!cmd->is_literal && ExpandVariables(cmd) < 0) return -1;
+    return ExecuteCommands(cmd);
+}
+
+/*********************************************************************
+ * BenchCommandsPerSecond
+ * Run a command in the foreground over and over: the true built-in,
+ * or /bin/true to go through the launch engine.
+ * @param const char* line
+ * @return: commands per second
+ *********************************************************************/
+static double BenchCommandsPerSecond(const char *line) {
+    command cmd;
+    double start = Now();
+    for (int i = 0; i < LOOP_COMMANDS; i++) RunLine(&cmd, line);
+    return LOOP_COMMANDS / (Now() - start);
+}
+
+/*********************************************************************
+ * BenchLatency
+ * Time each command from the line being read to its child being
+ * reaped, the part of prompt-to-prompt that is the shell's.
+ * @param double* p50, p90, p99 - set to the percentiles in seconds
+ *********************************************************************/
+static void BenchLatency(double *p50, double *p90, double *p99) {
+    static double samples[LATENCY_SAMPLES];
+    command cmd;
+    for (int i = 0; i < LATENCY_SAMPLES; i++) {
+        double start = Now();
+        RunLine(&cmd, "/bin/true $HOME > /dev/null");
+        samples[i] = Now() - start;
+    }
+    qsort(samples, LATENCY_SAMPLES, sizeof samples[0], CompareDoubles);
+    *p50 = samples[LATENCY_SAMPLES * 50 / 100];
+    *p90 = samples[LATENCY_SAMPLES * 90 / 100];
+    *p99 = samples[LATENCY_SAMPLES * 99 / 100];
+}
+
+/*********************************************************************
+ * SyntheticLine
+ * Build a large line by repeating a fragment.
+ * @param const char* word - the fragment, ending in a separator
+ * @return: the line, NULL if out of memory
+ *********************************************************************/
+static char *SyntheticLine(const char *word) {
+    size_t word_len = strlen(word);
+    char *line = malloc(word_len * PARSE_LINE_WORDS + 1);
+    if (line == NULL) return NULL;
+    for (int i = 0; i < PARSE_LINE_WORDS; i++) memcpy(line + i * word_len, word, word_len);
+    line[word_len * PARSE_LINE_WORDS] = '\0';
+    return line;
+}
+
+/*********************************************************************
+ * BenchTokenizer
+ * Split a large line into words.
+ * @param const char* line
+ * @return: MB of line tokenized per second
+ *********************************************************************/
+static double BenchTokenizer(const char *line) {
+    command cmd;
+    size_t line_len = strlen(line);
+    double elapsed = 0;
+    for (int i = 0; i < PARSE_ROUNDS; i++) {
+        ResetCommand(&cmd);
+        char *copy = ArenaStrndup(line, line_len);
+        double start = Now();
+        TokenizeLine(&cmd, copy);
+        elapsed += Now() - start;
+    }
+    return line_len * PARSE_ROUNDS / elapsed / 1e6;
+}
+
+/*********************************************************************
+ * BenchExpansion
+ * Expand every word of a large, already tokenized and parsed line.
+ * @param const char* line
+ * @return: MB of line expanded per second
+ *********************************************************************/
+static double BenchExpansion(const char *line) {
+    command cmd;
+    size_t line_len = strlen(line);
+    double elapsed = 0;
+    for (int i = 0; i < PARSE_ROUNDS; i++) {
+        ResetCommand(&cmd);
+        char *copy = ArenaStrndup(line, line_len);
+        TokenizeLine(&cmd, copy);
+        ParseCommands(&cmd);
+        double start = Now();
+        ExpandVariables(&cmd);
+        elapsed += Now() - start;
+    }
+    return line_len * PARSE_ROUNDS / elapsed / 1e6;
+}
+
+/*********************************************************************
+ * BenchParseLine
+ * Parse and expand the same script line over and over, as a generated
+ * script does, with the parsed-line cache or clearing it every time.
+ * @param const char* line
+ * @param bool cached
+ * @return: lines per second
+ *********************************************************************/
+static double BenchParseLine(const char *line, bool cached) {
+    command cmd;
+    size_t line_len = strlen(line);
+    ParseCacheClear();
+    double start = Now();
+    for (int i = 0; i < CACHED_LINES; i++) {
+        if (!cached) ParseCacheClear();
+        ResetCommand(&cmd);
+        char *copy = ArenaStrndup(line, line_len);
+        ParseLine(&cmd, copy);
+        if (!cmd.is_literal) ExpandVariables(&cmd);
+    }
+    return CACHED_LINES / (Now() - start);
+}
+
+/*********************************************************************
+ * BenchLoop
+ * Run a for loop whose body expands its variable and runs a built-in,
+ * compiled once with every iteration going through the bytecode.
+ * @return: loop iterations per second
+ *********************************************************************/
+static double BenchLoop(void) {
+    command cmd;
+    const char *head = "for i in", *tail = "; do true $i; done";
+    size_t len = strlen(head) + LOOP_ITERATIONS * 2 + strlen(tail);
+    char *line = malloc(len + 1);
+    if (line == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
+    char *p = stpcpy(line, head);
+    for (int i = 0; i < LOOP_ITERATIONS; i++) p = stpcpy(p, " x");
+    strcpy(p, tail);
+
+    double start = Now();
+    RunLine(&cmd, line);
+    double elapsed = Now() - start;
+    free(line);
+    return LOOP_ITERATIONS / elapsed;
+}
+
+/*********************************************************************
+ * BenchGlob
+ * Expand a line of globs in a directory of GLOB_FILES files. The
+ * patterns share the directory, which is read once per line.
+ * @return: matching names produced per second
+ *********************************************************************/
+static double BenchGlob(void) {
+    command cmd;
+    char dir[] = "/tmp/smallsh-bench-XXXXXX";
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof cwd) == NULL || mkdtemp(dir) == NULL || chdir(dir) == -1) {
+        perror("mkdtemp()");
+        exit(1);
+    }
+    char name[32];
+    for (int i = 0; i < GLOB_FILES; i++) {
+        snprintf(name, sizeof name, "file%06d.log", i);
+        int fd = open(name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd != -1) close(fd);
+    }
+
+    long names = 0;
+    double elapsed = 0;
+    for (int i = 0; i < GLOB_ROUNDS; i++) {
+        ResetCommand(&cmd);
+        char *copy = ArenaStrndup("true *.log file01*.log file0?9999.log", 37);
+        TokenizeLine(&cmd, copy);
+        ParseCommands(&cmd);
+        double start = Now();
+        ExpandVariables(&cmd);
+        elapsed += Now() - start;
+        for (int j = 1; cmd.stages[0].argv[j] != NULL; j++) names++;
+    }
+
+    for (int i = 0; i < GLOB_FILES; i++) {
+        snprintf(name, sizeof name, "file%06d.log", i);
+        unlink(name);
+    }
+    if (chdir(cwd) == -1) perror("chdir()");
+    rmdir(dir);
+    return names / elapsed;
+}
+
+/*********************************************************************
+ * BenchReaping
+ * Start background jobs without waiting, then reap them all as the
+ * main loop does, on SIGCHLD from signal_fd.
+ * @return: background jobs started and reaped per second
+ *********************************************************************/
+static double BenchReaping(void) {
+    command cmd;
+    // Keep the done messages out of the results
+    fflush(stderr);
+    int saved_stderr = dup(STDERR_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDERR_FILENO);
+    close(null_fd);
+
+    double start = Now();
+    for (int i = 0; i < REAP_JOBS; i++) RunLine(&cmd, "/bin/true &");
+    for (;;) {
+        int live = 0;
+        for (int i = 0; i < job_table_size; i++) live += job_table[i] != NULL;
+        if (live == 0) break;
+        if (WaitForEvents(-1) & EVENT_CHILD) ManageBackgroundProcesses();
+    }
+    double elapsed = Now() - start;
+
+    fflush(stderr);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+    return REAP_JOBS / elapsed;
+}
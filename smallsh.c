@@ -3,12 +3,15 @@
  * Author: Matthew Tinnel
  * Date: 02/05/2023
  * Description:
- *      A small shell program with built-in commands: exit, and cd.
- *      Also supports non-built-in commands, input/output redirection,
- *      comments, background processes, and variable expansion.
+ *      A small shell program with built-in commands: exit, cd, hash, arena,
+ *      cache, jobs, wait, fg, bg, parallel, time, limit, echo, true, false,
+ *      :, pwd, taskset, test/[, trace, printf, export, unset, shift, ulimit,
+ *      and history. Also supports non-built-in commands, pipelines, input/output
+ *      redirection, comments, background processes, variable expansion,
+ *      command substitution, globbing, control flow and functions.
  *********************************************************************/
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,493 +20,6241 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <signal.h>
-#include <setjmp.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <sched.h>
 
-#define MAX_LINE 512 /* The maximum length command */
+#define MIN_TOKENS 64 /* Initial size of command_array, it grows as needed */
+
+extern char **environ;
+
+// Struct to hold one command of a pipeline
+typedef struct {
+    char **argv; // points into command.command_array
+    int is_input_redirection;
+    int is_output_redirection;
+    char *in_file_name;
+    char *out_file_name;
+    struct program *group; // compound command run as this stage, NULL for a simple one
+} stage;
+
+// cgroup v2 limits from the limit prefix, as written to the cgroup files
+typedef struct {
+    const char *memory_max; // NULL to leave unlimited
+    const char *cpu_max;
+    const char *pids_max;
+} job_limits;
+
+// Compiled compound command, see RunProgram
+typedef struct program program;
 
 // Struct to hold command line information
 typedef struct {
-    char *command_array[512];
+    char **command_array; // NULL terminated, allocated in the line arena
     int line_count;
+    int token_capacity;
     int is_background;
-    int is_input_redirection;
-    int is_output_redirection;
-    char in_file_name[256];
-    char out_file_name[256];
+    int is_timed; // line started with the time prefix
+    job_limits *limits; // from the limit prefix, NULL if none
+    int is_literal; // cached line with nothing to expand
+    stage *stages;
+    int stage_count;
+    program *program; // compound command to run instead, NULL for a simple one
 } command;
 
 // Global variables will store the exit status of the last foreground process
 // and the PID of the last background process
 int dollar_question = 0; // The $? parameter shall default to 0 (“0”).
-char *dollar_exclamation = ""; // The $! parameter shall default to an empty string (““) if no background process ID is available.
+char dollar_exclamation[21] = ""; // The $! parameter shall default to an empty string (““) if no background process ID is available.
 
-// Initialize SIGINT_action struct to be empty
-struct sigaction SIGINT_action = {0}, ignore_action = {0}, old_sigstp_action, old_sigint_action;
-static sigjmp_buf env;
-static volatile sig_atomic_t jump_bool = false; // make sure this can be accessed by signal handler
+// Bump allocator owning everything allocated for one command line: tokens,
+// expansions and redirection file names. Reset at the top of each loop.
+#define ARENA_BLOCK (64 * 1024) /* Default size of an arena block */
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+} arena_block;
+struct {
+    arena_block *first;
+    arena_block *current;
+    size_t in_use;   // bytes handed out since the last reset
+    size_t peak;     // most bytes ever handed out between resets
+    size_t capacity; // bytes held in all blocks
+} line_arena;
+// Point to release the arena back to, so each command of a loop reuses
+// the same memory instead of the line's arena growing every iteration
+typedef struct {
+    arena_block *block;
+    size_t used;
+    size_t in_use;
+} arena_mark;
 
-/* signal handler for SIGINT, taken from Exploration: Signal Handling API */
-void handle_SIGINT_JUMP(){
-    if (jump_bool == false) return;
-    siglongjmp(env, 1);
-}
+// Formatted $$ and $? kept between expansions until the value changes
+char dollar_dollar_str[21] = "";
+char dollar_question_str[12] = "";
+int dollar_question_cached = 0;
+
+// Scratch buffer that tokens are expanded into
+struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    bool pattern; // escape quoted and expanded *?[]\ for globbing
+} expand_buffer;
+
+// Command substitutions of the command being expanded. They are found
+// first and run at once, each in a forked subshell writing to a pipe,
+// then the words are expanded with their output.
+typedef struct {
+    const char *text; // the command between $( and ), not NUL terminated
+    size_t len;
+    pid_t pid;
+    int fd;           // read end of the child's stdout, -1 once closed
+    char *out;        // everything the child wrote, malloc'd
+    size_t out_len, out_cap;
+    int status;
+} substitution;
+struct {
+    substitution *items;
+    int count, cap;
+    int next;         // next one for ExpandWord to use
+    bool collecting;  // ExpandWord only records substitutions, for ExpandSubstitutions
+} substitutions;
+
+// Directories read while expanding the globs of one command. They live in
+// the line arena, so each is read at most once however many patterns of
+// the command share it, and its names are sorted once for all of them.
+#define GLOB_DIR_BUCKETS 256
+typedef struct {
+    char *name;
+    unsigned char type; // d_type, DT_UNKNOWN on file systems without it
+} glob_entry;
+typedef struct glob_dir {
+    struct glob_dir *next;
+    const char *path;   // "" for the current directory, otherwise ending in /
+    glob_entry *entries;
+    size_t count;
+} glob_dir;
+struct {
+    glob_dir **buckets; // NULL until the command's first glob
+} glob_cache;
+
+// Buffered source of script lines: a mmap'd file, a -c string, or a pipe
+#define SCRIPT_CHUNK (64 * 1024) /* Bytes read at a time from an unmapped script */
+#define SCRIPT_RELEASE (1024 * 1024) /* Bytes of a mapped script read before its pages are dropped */
+typedef struct {
+    int fd;         // -1 once the whole script is in buf
+    char *buf;
+    size_t len;     // bytes of buf holding script text
+    size_t pos;     // start of the next line
+    size_t cap;
+    bool is_mapped;
+    char *line;     // copy of the current line of a read-only mapping
+    size_t line_cap;
+    size_t released; // bytes at the start of a mapping already dropped from memory
+} line_reader;
+
+bool interactive = true; // false when running a script or -c string
+
+// Engine used to launch non-built-in commands, chosen with SMALLSH_SPAWN=spawn|fork
+typedef enum { SPAWN_ENGINE_SPAWN, SPAWN_ENGINE_FORK } spawn_engine_t;
+spawn_engine_t spawn_engine = SPAWN_ENGINE_SPAWN;
+
+// Command location cache, keyed by command name, so the PATH walk only
+// happens once per command instead of on every launch
+#define HASH_BUCKETS 256
+typedef struct hash_entry {
+    char *name;
+    char *path;
+    unsigned long hits;
+    struct hash_entry *next;
+} hash_entry;
+hash_entry *command_hash[HASH_BUCKETS];
+char *hash_path_value = NULL; // PATH the cached locations were resolved against
+unsigned long hash_hits = 0, hash_misses = 0;
+
+// SIGCHLD, and SIGINT when interactive, are blocked and read from signal_fd
+// in the main loop instead of interrupting the shell
+struct sigaction ignore_action = {0}, default_action = {0};
+sigset_t child_default_signals; // what children reset: those not ignored when smallsh started
+int signal_fd = -1;
+#define EVENT_INPUT 1     /* input fd is readable */
+#define EVENT_CHILD 2     /* SIGCHLD arrived */
+#define EVENT_INTERRUPT 4 /* SIGINT arrived */
+
+// Job control is on when interactive on a terminal: each job gets its own
+// process group, which owns the terminal while it runs in the foreground
+bool job_control = false;
+pid_t shell_pgid;
+struct termios shell_tmodes;
+
+// Struct to hold one process of a job
+typedef struct {
+    pid_t pid;
+    int status;   // wait status once done
+    bool done;
+    bool stopped;
+    struct rusage usage;  // from wait4 once done
+    struct timespec end;  // when it was reaped
+} process;
+
+// Struct to hold a job: every process started for one command line
+typedef struct {
+    int id;             // job number, %id
+    pid_t pgid;         // process group when job control is on
+    char *text;         // command line, for jobs
+    process *procs;
+    int proc_count;
+    int live_count;     // processes not yet done
+    int stopped_count;  // live processes that are stopped
+    bool is_background;
+    struct timespec start; // when the first process was started
+    char *cgroup;       // leaf cgroup directory of a limited job, NULL if none
+    bool placed;        // pinned to cpus by SMALLSH_PLACEMENT or taskset
+    int node;           // NUMA node of cpus, -1 if none or several
+    cpu_set_t cpus;
+} job;
+
+// Job table, slot i holds job %i+1
+job **job_table = NULL;
+int job_table_size = 0;
+
+// Statuses of recently finished background jobs, so wait can report them
+// after they have already been reaped
+#define FINISHED_JOBS 64
+struct {
+    pid_t pid; // last process of the job
+    int status;
+} finished_jobs[FINISHED_JOBS];
+int finished_jobs_next = 0;
+
+// Resource usage of the last foreground job to finish, for time and $SMALLSH_*
+typedef struct {
+    double real;       // wall seconds from the first start to the last exit
+    double user;       // CPU seconds summed over every process
+    double sys;
+    long max_rss;      // KiB, the largest of any process
+    long major_faults; // summed over every process
+    long minor_faults;
+} resource_usage;
+resource_usage last_usage;
+char usage_value_str[32] = ""; // formatted $SMALLSH_* value
+
+// smallsh --serve: zygotes are idle copies of the shell waiting for a client
+#define ZYGOTES 4 /* Default pool size, set with SMALLSH_ZYGOTES */
+#define PARALLEL_HELD_SLOTS 4 /* parallel -k holds at most this many jobs per slot, running or done */
+typedef struct {
+    pid_t pid;
+    int ctl_fd; // socketpair the client fd is sent on, -1 once used
+} zygote;
+zygote *zygotes = NULL;
+int zygote_count = 0;
+bool serve_client = false; // this process is serving a --serve connection
+
+// Command history: an append-only log shared by every interactive shell,
+// mapped at startup and only split into entries the first time it is searched
+#define HISTORY_MAX_BYTES (1024 * 1024) /* Default log size limit, set with SMALLSH_HISTFILESIZE */
+typedef struct {
+    const char *text; // not NUL terminated
+    size_t len;
+} history_entry;
+struct {
+    int fd;                 // log, opened O_APPEND, -1 if there is none
+    char *path;
+    size_t max_bytes;
+    char *map;              // log as it was at startup
+    size_t map_len;
+    history_entry *mapped;  // entries in map, oldest first
+    size_t mapped_count;
+    history_entry *added;   // entries added since startup, malloc'd copies
+    size_t added_count, added_cap;
+    uint32_t *by_text;      // every entry number, sorted by text for !prefix
+    size_t by_text_cap;
+    bool indexed;           // mapped and by_text are built
+} history = {.fd = -1};
+
+// Jobs started with the limit prefix each get a cgroup v2 leaf under the
+// shell's own cgroup, which their processes join before exec
+const char *cgroup_base = NULL;      // the shell's cgroup directory, "" if cgroup v2 is unusable
+unsigned long cgroup_serial = 0; // names each leaf
+int launch_cgroup_fd = -1;     // cgroup.procs of the job being launched, -1 for none
+// Leaf the shell moved into to hand out controllers, and the ones it
+// enabled, so CgroupCleanup can put things back at exit
+struct {
+    char *leaf;
+    pid_t owner;
+    char enabled[32]; // e.g. "-memory -pids"
+} cgroup_move;
+
+// Background job placement, opt in with SMALLSH_PLACEMENT=core or node:
+// CPUs are handed out round-robin, node by node
+struct {
+    cpu_set_t allowed;  // the shell's affinity when first used
+    int *cpus;          // allowed CPUs ordered by NUMA node, NULL until loaded
+    int *node_start;    // index in cpus of each node's first CPU, node_count + 1 entries
+    int *node_ids;      // sysfs number of each node, -1 for CPUs of no node
+    int node_count;
+    int next_node, next_offset; // where the next job starts
+} placement;
+
+// Parsed-line cache: the tokens and stages of each line, before expansion,
+// keyed by the line's text so a repeated line skips straight to expansion
+#define PARSE_CACHE_BUCKETS 1024
+#define PARSE_CACHE_MAX 4096 /* Lines kept before the cache is cleared */
+typedef struct parsed_line {
+    struct parsed_line *next; // next in the bucket
+    uint64_t hash;
+    const char *text;         // the line, not NUL terminated
+    size_t len;
+    char **tokens;            // every stage's argv, each NULL terminated, end to end
+    size_t token_count;
+    stage *stages;            // argv point into tokens
+    int stage_count;
+    int is_background;
+    int is_timed;
+    job_limits *limits;       // NULL if none
+    bool expands;             // some word has something to expand or unquote
+    program *program;         // compiled compound command, NULL for a simple one
+    unsigned long hits;
+} parsed_line;
+struct {
+    parsed_line *buckets[PARSE_CACHE_BUCKETS];
+    size_t count;
+    char *ifs;                // IFS the lines were split with, NULL if unset
+    unsigned long hits, misses;
+} parse_cache;
+#define PARSE_MORE 1 /* ParseLine needs another line to finish a compound command */
+
+// Compound commands: if, while, until, for, { } groups, function
+// definitions and lists joined by ; or &. Each is compiled once into
+// bytecode for RunProgram, with its simple commands parsed at compile
+// time and only expanded when they run, so loop bodies aren't parsed again.
+typedef enum {
+    OP_RUN,        // run commands[a]
+    OP_JUMP,       // go to a
+    OP_JUMP_FALSE, // go to a if $? is not 0
+    OP_JUMP_TRUE,  // go to a if $? is 0
+    OP_STATUS,     // set $? to a
+    OP_LOOP,       // enter a while or until loop
+    OP_FOR,        // enter a for loop over the words of commands[a], the positional parameters if -1
+    OP_NEXT,       // set names[a] to the loop's next word, or go to b if there is none
+    OP_SAVE,       // keep $? as the innermost loop's status
+    OP_END,        // leave the innermost loop and set $? to its status
+    OP_DROP,       // leave the innermost loop for break or continue to an outer one
+    OP_DEFINE,     // define the function names[a] as bodies[b]
+    OP_RETURN,     // return from the function with the status in commands[a], $? if -1
+} opcode;
+typedef struct {
+    unsigned char op;
+    int a, b;
+} instruction;
+struct program {
+    instruction *code;
+    int code_count, code_cap;
+    parsed_line **commands;  // simple commands and word lists, not in the parse cache
+    int command_count, command_cap;
+    char **names;            // loop variables and function names
+    int name_count, name_cap;
+    program **bodies;        // function bodies
+    int body_count, body_cap;
+    int refs;                // held by the line running it, the cache and function definitions
+};
+
+// Loop being compiled, for break and continue
+typedef struct loop_label {
+    struct loop_label *outer;
+    int continue_at;
+    int breaks;              // chain of break jumps through their targets, -1 at the end
+} loop_label;
+#define COMPILE_OK 0
+#define COMPILE_MORE 1       /* the command is incomplete */
+#define COMPILE_ERROR 2
+typedef struct {
+    char **tokens;
+    int pos, count;
+    program *prog;
+    loop_label *loop;        // innermost loop, NULL if none
+    bool in_function;
+    int status;              // COMPILE_*
+} compiler;
+
+// Lines of a compound command read so far, until it is complete
+struct {
+    char *text;              // the lines, each ending in a newline
+    size_t len, cap;
+    int depth;               // constructs opened and not closed yet
+} compound;
+
+// Functions by name, they shadow built-ins and commands
+typedef struct {
+    char *name;
+    program *body;
+} function;
+function *function_table = NULL;
+int function_count = 0, function_cap = 0;
+int function_depth = 0;
+#define FUNCTION_DEPTH_MAX 1000 /* Nested calls before a call fails */
+bool run_interrupted = false; // SIGINT stopped a compound command
+
+// Positional parameters: $0 is smallsh or the script, $1 on are the
+// script's arguments or, inside a function, the call's
+struct {
+    const char *name;
+    char **args;
+    int count;
+    char count_str[12];
+} positional = {.name = "smallsh"};
+
+// Open addressing map from PID to its job so each reaped child is found in O(1)
+typedef struct {
+    pid_t pid; // 0 if empty, -1 if deleted
+    job *jb;
+    int index;
+} pid_slot;
+pid_slot *pid_map = NULL;
+size_t pid_map_cap = 0, pid_map_used = 0;
+
+// Line editor used at the prompt when job control is on: the terminal is
+// in raw mode while a line is typed and back in cooked mode while it runs
+struct {
+    char *buf;              // line being typed, NUL terminated
+    size_t len, cap;
+    size_t cursor;          // byte offset in buf
+    bool done;              // Enter was pressed
+    char pending[512];      // keys read but not handled yet
+    size_t pending_len;
+    size_t history_pos;     // entry shown by ^P/^N, SIZE_MAX for the new line
+    char *saved;            // the new line while history is shown
+    int tabs;               // Tabs pressed in a row
+    char *out;              // output queued for one write
+    size_t out_len, out_cap;
+} editor;
+
+// Completion matches, malloc'd
+typedef struct {
+    char **items;
+    size_t count, cap;
+} completion_list;
+
+// Directory entry as returned by getdents64
+#define DIRENT_BATCH (32 * 1024) /* Bytes of directory entries read at a time */
+typedef struct {
+    uint64_t ino;
+    int64_t off;
+    unsigned short reclen;
+    unsigned char type;
+    char name[];
+} dirent64_record;
+
+// Trie of every command name for completion: built-ins and the executables
+// in PATH. It is built a directory batch at a time while the prompt is idle
+// and kept current with inotify instead of being rescanned.
+#define TRIE_MAX_DIRS 63                   /* PATH directories tracked */
+#define TRIE_BUILTIN ((uint64_t) 1 << 63)  /* dirs bit of a built-in */
+typedef struct {
+    char c;
+    uint32_t child;   // first child, 0 if none
+    uint32_t sibling; // next child of the parent, 0 if none
+    uint64_t dirs;    // bit i set if the name is an executable in PATH directory i
+} trie_node;
+struct {
+    trie_node *nodes; // nodes[0] is the root
+    size_t count, cap;
+    char *path;       // PATH the trie was built from
+    char **dirs;
+    int *watches;     // inotify watch of each directory
+    int dir_count;
+    int inotify_fd;
+    int scan_dir;     // directory being read by TrieBuildStep
+    int scan_fd;
+    bool started;
+} command_trie = {.inotify_fd = -1, .scan_fd = -1};
+
+// Tracing of the shell's own stages, off until `trace on` or SMALLSH_TRACE.
+// Events go to a ring in shared memory, so forked children record into it
+// too, with slots claimed by an atomic counter instead of a lock. Each
+// stage also keeps a histogram of log2 nanosecond buckets. "setup" is a
+// forked child's time from fork to exec, so only the fork engine records it;
+// posix_spawn returns once the child has exec'd, so "spawn" includes it.
+#define TRACE_EVENTS 4096 /* Events kept in the ring, a power of two */
+#define TRACE_BUCKETS 64
+typedef enum {
+    TRACE_READ, TRACE_TOKENIZE, TRACE_PARSE, TRACE_COMPILE, TRACE_EXPAND,
+    TRACE_FORK, TRACE_SPAWN, TRACE_SETUP, TRACE_WAIT, TRACE_STAGES
+} trace_stage;
+const char *const trace_stage_names[TRACE_STAGES] = {
+    "read", "tokenize", "parse", "compile", "expand", "fork", "spawn", "setup", "wait",
+};
+typedef struct {
+    uint64_t seq;      // index + 1 once written, 0 while being written
+    uint64_t start;    // ns on CLOCK_MONOTONIC
+    uint64_t duration; // ns
+    int32_t pid;       // process that recorded it
+    int32_t stage;
+} trace_event;
+typedef struct {
+    uint64_t head;     // events ever recorded
+    uint64_t counts[TRACE_STAGES][TRACE_BUCKETS];
+    uint64_t total[TRACE_STAGES];
+    uint64_t max[TRACE_STAGES];
+    trace_event events[TRACE_EVENTS];
+} trace_ring;
+struct {
+    bool enabled;
+    trace_ring *ring;  // NULL until tracing is first turned on
+    FILE *stream;      // SMALLSH_TRACE file of Chrome trace events, NULL if none
+    uint64_t flushed;  // events written to stream so far
+    pid_t owner;       // the shell that writes stream
+} trace;
 
 // Function prototypes
-static int GetCommands(command *cmd, char *line, size_t len);
+static int GetCommands(command *cmd, line_reader *reader);
+static int GetScriptCommands(command *cmd, line_reader *reader);
+static int TokenizeLine(command *cmd, char *line);
+static int ParseLine(command *cmd, char *line);
+static void ParseCacheStore(command *cmd, const char *line, size_t len, uint64_t hash);
+static parsed_line *ParsedLineNew(command *cmd, const char *line, size_t len, uint64_t hash);
+static int ParsedLineLoad(parsed_line *entry, command *cmd);
+static void ParsedLineFree(parsed_line *entry);
+static void ParseCacheClear(void);
+static int CacheCommand(command *cmd);
+static bool IsCompound(command *cmd);
+static int CompoundDepth(char **tokens, int count, int *closed);
+static bool IsStageCompound(const char *word);
+static int CompileLine(command *cmd, const char *line, size_t len, uint64_t hash);
+static int CompoundAppend(const char *line, size_t len);
+static void CompoundClear(void);
+static program *CompileProgram(char **tokens, int count, int *status);
+static int CompileList(compiler *c, const char *const *ends);
+static int CompileCommand(compiler *c);
+static int CompileIf(compiler *c);
+static int CompileLoop(compiler *c, bool until);
+static int CompileFor(compiler *c);
+static int CompileFunction(compiler *c, const char *name, size_t name_len);
+static int CompileJump(compiler *c);
+static int CompileSimple(compiler *c);
+static int CompilePipeline(compiler *c);
+static int CompileEnd(compiler *c);
+static int CompileError(compiler *c, const char *token);
+static parsed_line *CompileWords(char **words, int count);
+static bool IsCloser(const char *word);
+static int Emit(compiler *c, int op, int a, int b);
+static int ProgramAddCommand(compiler *c, parsed_line *entry);
+static int ProgramAddName(compiler *c, const char *name, size_t name_len);
+static void *GrowArray(void *items, int count, int *cap, size_t size);
+static void ProgramRelease(program *prog);
+static int RunProgram(program *prog);
+static bool InterruptPending(void);
+static program *FindFunction(const char *name);
+static int DefineFunction(const char *name, program *body);
+static int FunctionCommand(command *cmd);
+static int GroupCommand(command *cmd);
+static int ShiftCommand(command *cmd);
+static const char *PositionalParameter(long n);
+static const char *PositionalJoined(void);
+static int PushToken(command *cmd, char *token);
+static void SetupSignals(void);
+static int WaitForEvents(int input_fd);
+static void PrintPrompt(void);
+static const char *PromptString(void);
+static int OpenScript(line_reader *reader, const char *path);
+static int OpenScriptString(line_reader *reader, const char *string);
+static int FillScript(line_reader *reader);
+static char *ReadScriptLine(line_reader *reader, size_t *line_length);
+static char *TakeLine(line_reader *reader, size_t *line_length);
+static void HistoryOpen(void);
+static const char *HistoryEntry(size_t i, size_t *len);
+static int HistoryCompareText(const void *a, const void *b);
+static int HistoryIndex(void);
+static void HistoryAdd(const char *line, size_t line_len);
+static void HistoryCompact(void);
+static char *HistoryExpand(char *line);
+static int HistoryCommand(command *cmd);
+static void EditorStart(void);
+static void EditorStop(void);
+static void EditorRead(line_reader *reader);
+static char *EditorTakeLine(line_reader *reader);
+static size_t EditorKey(const char *keys, size_t n, line_reader *reader);
+static size_t EditorNextChar(size_t pos);
+static void EditorInsert(const char *text, size_t n);
+static void EditorDelete(size_t start, size_t n);
+static void EditorHistory(int direction);
+static void EditorRedraw(void);
+static void EditorOutput(const char *text, size_t n);
+static void EditorFlush(void);
+static void EditorComplete(void);
+static void EditorInsertEscaped(const char *text, size_t n);
+static void EditorList(completion_list *list);
+static int CompareStrings(const void *a, const void *b);
+static void CompletionAdd(completion_list *list, const char *name, size_t len, bool is_dir);
+static void PathComplete(const char *word, size_t dir_len, completion_list *list);
+static ssize_t ReadDirectoryBatch(int dir_fd, char *buf, size_t size);
+static void TrieStart(void);
+static bool TrieBuildStep(void);
+static void TrieCheck(int dir, int dir_fd, const char *name);
+static void TrieSet(const char *name, uint64_t bit, bool present);
+static void TrieWatch(void);
+static void TrieComplete(const char *prefix, size_t prefix_len, completion_list *list);
+static void TrieCollect(uint32_t node, char *name, size_t depth, completion_list *list);
+static int ServeSocket(const char *path, line_reader *reader);
+static int ForkZygote(zygote *z, int listen_fd);
+static void ServeStatus(void);
 static int ExpandVariables(command *cmd);
 static int ParseCommands(command *cmd);
 static int ExecuteCommands(command *cmd);
-static int ExitShell(command *cmd, pid_t pid);
+static void ParseRedirections(stage *st, char **argv, ssize_t argc);
+static int ParseLimits(command *cmd);
+static pid_t LaunchCommand(stage *st, int in_fd, int out_fd, pid_t pgid);
+static pid_t SpawnCommand(stage *st, int in_fd, int out_fd, pid_t pgid);
+static pid_t ForkCommand(stage *st, int in_fd, int out_fd, pid_t pgid);
+static const struct builtin *FindBuiltin(const char *name);
+static const struct builtin *FindCommand(const char *name);
+static const struct builtin *FindStageCommand(stage *st);
+static int RunBuiltin(const struct builtin *b, command *cmd);
+static int ExitShell(command *cmd);
 static int ChangeDirectory(command *cmd);
+static int TrueCommand(command *cmd);
+static int FalseCommand(command *cmd);
+static const char *PrintEscape(const char *p, bool *stop);
+static int EchoCommand(command *cmd);
+static int PrintWorkingDirectory(command *cmd);
+static int PrintfCommand(command *cmd);
+static int TestCommand(command *cmd);
+static int TestExpression(char **args, int count);
+static int ExportCommand(command *cmd);
+static int UnsetCommand(command *cmd);
+static int UlimitCommand(command *cmd);
 static int ManageBackgroundProcesses();
-int KillChildrenProcesses(pid_t parent_pid, int signal);
-char *str_gsub(char *restrict *restrict haystack, char const *restrict needle, char const *restrict sub);
+int KillChildrenProcesses(int signal);
+static job *NewJob(command *cmd);
+static void AddJobProcess(job *jb, pid_t pid);
+static void RemoveJob(job *jb);
+static int JobStatus(job *jb);
+static int WaitForJob(job *jb, bool foreground);
+static resource_usage JobUsage(job *jb);
+static void PrintUsage(const resource_usage *usage);
+static const char *CgroupBase(void);
+static int CgroupCreate(job *jb, const job_limits *limits);
+static int CgroupWrite(const char *dir, const char *file, const char *value);
+static void CgroupCleanup(void);
+static bool CgroupRead(const char *dir, const char *file, const char *key, char *value, size_t size);
+static void PrintJobUsage(job *jb);
+static int PlacementLoad(void);
+static bool PlaceJob(job *jb, int cpu_count, cpu_set_t *shell_cpus);
+static int ParseCpuList(const char *list, cpu_set_t *set);
+static int ParseCpuMask(const char *mask, cpu_set_t *set);
+static char *FormatCpus(const cpu_set_t *set, bool as_list, char *buf, size_t size);
+static int TasksetCommand(command *cmd);
+static const char *UsageVariable(const char *name, size_t name_len);
+static void ContinueJob(job *jb);
+static job *FindJob(const char *spec, const char *builtin);
+static int JobsCommand(command *cmd);
+static int WaitCommand(command *cmd);
+static int FinishedJobStatus(pid_t pid, int *job_status);
+static int ForegroundCommand(command *cmd);
+static int BackgroundCommand(command *cmd);
+static int ParallelCommand(command *cmd);
+static pid_slot *PidMapFind(pid_t pid);
+static int PidMapInsert(pid_t pid, job *jb, int index);
+static const char *HashLookup(const char *name);
+static void HashForget(const char *name);
+static void HashClear(void);
+static int HashCommand(command *cmd);
+static uint64_t TraceStart(void);
+static void TraceEnd(trace_stage stage, uint64_t start);
+static int TraceEnable(void);
+static bool TraceRead(uint64_t index, trace_event *event);
+static void TraceOpenStream(const char *path);
+static void TraceFlush(void);
+static int TraceCommand(command *cmd);
+static void *ArenaAlloc(size_t size);
+static char *ArenaStrndup(const char *str, size_t len);
+static void ArenaReset(void);
+static arena_mark ArenaMark(void);
+static void ArenaRelease(arena_mark mark);
+static int ArenaCommand(command *cmd);
+static int ExpandToken(char **token);
+static int ExpandFields(stage *st);
+static char *ExpandWord(const char *word, int *field_count);
+static bool AppendFields(const char *text, size_t len, int *fields, bool *field_started);
+static const char *SubstitutionEnd(const char *p);
+static int ExpandSubstitutions(command *cmd);
+static void RunSubshell(const char *text, size_t len);
+static void SubstitutionsClear(void);
+static bool AppendExpansion(const char *text, size_t text_len);
+static bool AppendQuoted(const char *text, size_t text_len);
+static int PushField(char ***argv, int *count, int *cap, char *field);
+static bool IsGlob(const char *word);
+static bool HasGlobCharacters(const char *pattern);
+static int GlobExpand(const char *pattern, char ***argv, int *count, int *cap);
+static int GlobMatch(const char *dir, char **components, int component_count, char ***argv, int *count, int *cap);
+static char *GlobPath(const char *dir, const char *name, bool is_dir);
+static bool GlobIsDirectory(const char *path, unsigned char type, bool follow);
+static glob_dir *GlobReadDirectory(const char *path);
+static int GlobCompareEntries(const void *a, const void *b);
+static char *GlobUnescape(char *pattern);
+static const char *LookupVariable(const char *name, size_t name_len);
+static bool IsName(const char *name, size_t name_len);
+
+// Commands run inside the shell, sorted by name for FindBuiltin
+typedef struct builtin {
+    const char *name;
+    int (*run)(command *cmd);
+    bool sets_status; // sets $? itself, otherwise $? is 1 if run fails and 0 if not
+    bool runs_jobs;   // time reports the usage of the jobs it ran
+} builtin;
+const builtin builtins[] = {
+    {":", TrueCommand, false, false},
+    {"[", TestCommand, true, false},
+    {"arena", ArenaCommand, false, false},
+    {"bg", BackgroundCommand, false, false},
+    {"cache", CacheCommand, false, false},
+    {"cd", ChangeDirectory, false, false},
+    {"echo", EchoCommand, false, false},
+    {"exit", ExitShell, false, false},
+    {"export", ExportCommand, false, false},
+    {"false", FalseCommand, false, false},
+    {"fg", ForegroundCommand, true, true},
+    {"hash", HashCommand, false, false},
+    {"history", HistoryCommand, false, false},
+    {"jobs", JobsCommand, false, false},
+    {"parallel", ParallelCommand, true, true},
+    {"printf", PrintfCommand, false, false},
+    {"pwd", PrintWorkingDirectory, false, false},
+    {"shift", ShiftCommand, false, false},
+    {"taskset", TasksetCommand, true, true},
+    {"test", TestCommand, true, false},
+    {"trace", TraceCommand, false, false},
+    {"true", TrueCommand, false, false},
+    {"ulimit", UlimitCommand, false, false},
+    {"unset", UnsetCommand, false, false},
+    {"wait", WaitCommand, true, true},
+};
+// How a function is run: like a built-in that runs jobs and sets $?
+const builtin function_builtin = {"function", FunctionCommand, true, true};
+// How a redirected, piped or background compound command is run
+const builtin group_builtin = {"group", GroupCommand, true, true};
 
 /*******************************************************************************
  * Main function
  ********************************************************************************/
-int main(void) {
+int main(int argc, char *argv[]) {
 
     // Initialize the command struct
     command cmd;
 
-    // Declare line pointer outside of loop to avoid memory leak
-    char *line = NULL;
-    size_t len = 0;
+    // smallsh script and smallsh -c string run without a prompt or job control
+    line_reader input;
+    bool line_read = false;
+    if (argc > 1) {
+        if (strcmp(argv[1], "--serve") == 0) {
+            if (argc < 3) {
+                fprintf(stderr, "smallsh: --serve: option requires a socket path\n");
+                exit(2);
+            }
+            interactive = false;
+            SetupSignals();
+            if (ServeSocket(argv[2], &input) < 0) exit(1);
+        }
+        else if (strcmp(argv[1], "-c") == 0) {
+            if (argc < 3) {
+                fprintf(stderr, "smallsh: -c: option requires an argument\n");
+                exit(2);
+            }
+            if (OpenScriptString(&input, argv[2]) < 0) exit(1);
+            // smallsh -c string [name [args...]]
+            if (argc > 3) {
+                positional.name = argv[3];
+                positional.args = argv + 4;
+                positional.count = argc - 4;
+            }
+        }
+        else if (OpenScript(&input, argv[1]) < 0) {
+            fprintf(stderr, "smallsh: %s: %s\n", argv[1], strerror(errno));
+            exit(127);
+        }
+        else { // smallsh script [args...]
+            positional.name = argv[1];
+            positional.args = argv + 2;
+            positional.count = argc - 2;
+        }
+        interactive = false;
+    }
+    else {
+        memset(&input, 0, sizeof input);
+        input.fd = STDIN_FILENO;
+    }
+    if (!serve_client) SetupSignals();
+    if (interactive && isatty(STDIN_FILENO)) HistoryOpen();
+
+    // Pick the launch engine for non-built-in commands
+    const char *engine = getenv("SMALLSH_SPAWN");
+    if (engine != NULL && strcmp(engine, "fork") == 0) spawn_engine = SPAWN_ENGINE_FORK;
+    const char *trace_path = getenv("SMALLSH_TRACE");
+    if (trace_path != NULL && trace_path[0] != '\0') TraceOpenStream(trace_path);
+
     // Enter the main loop, only exit if the user types "exit".
     for (;;) {
-        // Clean up
+        // Clean up, dropping everything the last line allocated
         getcmd:
+        if (serve_client && line_read) ServeStatus();
+        TraceFlush();
+        ArenaReset();
         cmd.is_background = 0;
-        memset(cmd.command_array, 0, sizeof (cmd.command_array));
-        memset(cmd.in_file_name, 0, sizeof (cmd.in_file_name));
-        memset(cmd.out_file_name, 0, sizeof (cmd.out_file_name));
-
-        cmd.is_input_redirection = 0; cmd.is_output_redirection = 0;
+        cmd.is_timed = 0;
+        cmd.limits = NULL;
+        cmd.is_literal = 0;
+        cmd.command_array = NULL;
+        cmd.token_capacity = 0;
         cmd.line_count = 0;
+        cmd.stages = NULL;
+        cmd.stage_count = 0;
+        cmd.program = NULL;
 
-        GetCommands(&cmd, line, len);
-        if (feof(stdin)) goto exit;
-        if (cmd.command_array[0] == NULL){ // no command word
+        if (!interactive) {
+            if (GetScriptCommands(&cmd, &input) < 0) goto exit;
+            line_read = true;
+            if (serve_client) last_usage = (resource_usage) {0}; // a built-in line has no job
+        }
+        else GetCommands(&cmd, &input);
+        if (cmd.program != NULL) {
+            run_interrupted = false;
+            RunProgram(cmd.program);
+            ProgramRelease(cmd.program);
+            goto getcmd;
+        }
+        if (cmd.line_count == 0){ // no command word
             // Go back to get command
             goto getcmd;
         }
-        ParseCommands(&cmd);
+        if (!cmd.is_literal && ExpandVariables(&cmd) < 0) goto getcmd;
         ExecuteCommands(&cmd);
     } exit:
     exit(dollar_question);
 }
 
-/*****************************************************************
- * char *str_gsub
- * Replace all occurrences of a substring in a string.
- * @param char* haystack
- * @param char* needle
- * @param char* sub
- * @return char* str
- ******************************************************************/
-char *str_gsub(char *restrict *restrict haystack, char const *restrict needle, char const *restrict sub){
-
-    char *str = *haystack;
-    size_t haystack_len = strlen(str);
-    size_t const needle_len = strlen(needle),
-            sub_len = strlen(sub);
-
-    for (; (str = strstr(str, needle));) {
-        ptrdiff_t off = str - *haystack;
-
-        if (sub_len > needle_len) {
-            str = realloc(*haystack, sizeof **haystack * (haystack_len + sub_len - needle_len + 1));
-            if (!str) goto exit;
-            *haystack = str;
-            str = *haystack + off;
-        }
-
-        memmove(str + sub_len, str + needle_len, haystack_len + 1 - off - needle_len);
-        memcpy(str, sub, sub_len);
-        haystack_len += sub_len - needle_len;
-        str += sub_len;
-    }
-    str = *haystack;
-    if (sub_len < needle_len){
-        str = realloc(*haystack, sizeof **haystack * (haystack_len + 1));
-        if (!str) goto exit;
-        *haystack = str;
-    }
-    exit:
-    return str;
-}
-
 /*********************************************************************
  * GetCommands
- * Print prompt message, get user input, parse it into tokens,
- * and expand variables.
+ * Print prompt message, get user input and parse it.
+ * While waiting for input, background processes are reaped and reported
+ * as soon as they finish, and SIGINT discards the line being typed.
  * @param command* cmd
- * @param char* line
- * @param size_t len
+ * @param line_reader* reader - buffered standard input
  * @return: 0 if successful, -1 if error
  *********************************************************************/
-static int GetCommands(command *cmd, char *line, size_t len) {
-    ignore_action.sa_handler = SIG_IGN;
-    // Fill out the SIGINT_action struct
-    // Register handle_SIGINT as the signal handler
-    SIGINT_action.sa_handler = handle_SIGINT_JUMP;
-    // Block all catchable signals while handle_SIGINT is running
-    sigfillset(&SIGINT_action.sa_mask);
-
-    SIGINT_action.sa_flags = SA_RESTART;
-
-    // Install our signal handlers
-    sigaction(SIGINT, &SIGINT_action, NULL);
-    sigaction(SIGTSTP, &ignore_action, NULL); // ignore SIGTSTP
-
-    // Set up the sigsetjmp
-    jump_point:
-    if (sigsetjmp(env, 1) != 0) {
-        // If we get here, we jumped back from a SIGINT
-        // Clear the input buffer
-        putchar('\n');
-        fflush(stdin);
-        fflush(stdout);
-    }
-    jump_bool = true;
-
+static int GetCommands(command *cmd, line_reader *reader) {
     /* Managing background processes
     *  Before printing a prompt message, smallsh shall check for any
-    *  un-waited-for background processes in the same process group ID as
-    *  smallsh, and prints informative message to stderr for each*/
+    *  un-waited-for background processes, and prints informative
+    *  message to stderr for each*/
     ManageBackgroundProcesses();
-
-    const char *ps1 = getenv("PS1");
-    if (ps1 == NULL) ps1 = "";
-
-    // Print prompt message
-    if (fprintf(stderr, "%s", ps1) < 0) goto exit;
-    fflush(stdout);
-
-    // Get user input
-    ssize_t line_length = getline(&line, &len, stdin); /* Reallocates line */
-    if (feof(stdin)){
-        fprintf(stderr, "\nexit\n");
-        exit(dollar_question);
+    bool editing = job_control; // a terminal the shell owns gets the line editor
+    if (editing) {
+        if (!command_trie.started) TrieStart();
+        EditorStart();
+        EditorRedraw();
+        EditorFlush();
     }
+    else PrintPrompt();
 
-    if (line_length == 1) goto exit; // no command word
-    if (line_length > MAX_LINE) {
-        perror("Input line too long");
-        exit(1);
-    }
-    if (line_length == -1) {
-        clearerr(stdin); // reset stdin status due to interrupt
-        goto jump_point;
-    }
-        // Process user input
-    else {
-        char *token;
-        int i = 0;
-        const char *sep = getenv("IFS");
-        if (sep == NULL) sep = " \t\n";
-        // Make a copy of each word, store them in cmd.command_array for individual reallocation.
-        token = strtok(line, sep);
-        char *token_copy = NULL;
-        // Store each token in cmd.command_array until # is reached.
-        while (token != NULL && strcmp(token, "#") != 0) {
-            token_copy = strdup(token);
-            cmd->command_array[i] = token_copy;
-            token = strtok(NULL, sep);
-            i++;
-            cmd->line_count++;
+    for (;;) {
+        // Get user input
+        size_t line_length;
+        uint64_t trace_start = TraceStart();
+        char *line = editing ? EditorTakeLine(reader) : TakeLine(reader, &line_length);
+        if (line != NULL) {
+            TraceEnd(TRACE_READ, trace_start);
+            line = HistoryExpand(line);
+            if (line == NULL) return 0;
+            HistoryAdd(line, strlen(line));
+            int result = ParseLine(cmd, line);
+            if (result != PARSE_MORE) return result;
+            // The compound command goes on, prompt for its next line
+            if (editing) {
+                EditorStart();
+                EditorRedraw();
+                EditorFlush();
+            }
+            else PrintPrompt();
+            continue;
+        }
+        if (reader->fd == -1) {
+            if (editing) EditorStop();
+            fprintf(stderr, "\nexit\n");
+            exit(dollar_question);
         }
 
-        // Expand variables
-        ExpandVariables(cmd);
-
-    } exit:
-    return errno ? -1 : 0;
+        int events = WaitForEvents(reader->fd);
+        if ((events & EVENT_CHILD) && editing) {
+            // Clear the line for any job reports, then draw it again below them
+            EditorOutput("\r\x1b[K", 4);
+            EditorFlush();
+            ManageBackgroundProcesses();
+            EditorRedraw();
+            EditorFlush();
+        }
+        else if ((events & EVENT_CHILD) && ManageBackgroundProcesses() > 0) PrintPrompt();
+        if ((events & EVENT_INTERRUPT) && editing) {
+            // Leave the line on screen and start a new one
+            editor.cursor = editor.len;
+            EditorRedraw();
+            EditorOutput("^C\r\n", 4);
+            editor.pending_len = 0;
+            CompoundClear();
+            EditorStart();
+            EditorRedraw();
+            EditorFlush();
+        }
+        else if (events & EVENT_INTERRUPT) {
+            // Throw away the partial line and start over
+            reader->pos = reader->len;
+            CompoundClear();
+            putchar('\n');
+            fflush(stdout);
+            PrintPrompt();
+        }
+        if ((events & EVENT_INPUT) && editing) EditorRead(reader);
+        else if ((events & EVENT_INPUT) && FillScript(reader) < 0) {
+            perror("read()");
+            exit(1);
+        }
+    }
 }
 
-/*******************************************************************************
- * ExpandVariables
- * Expand variables in command array
- * @param command* cmd
- * @return 0 if successful, -1 if error
- ********************************************************************************/
-static int ExpandVariables(command *cmd) {
-    // Check each token for variable expansion
-    int i = 0;
-    while (cmd->command_array[i] != NULL && strcmp(cmd->command_array[i], "#") != 0) {
-        // get 2 first chars of token to compare for expansion
-        char *first_chars = malloc(3);
-        memset(first_chars, 0, 3);
-        first_chars[0] = cmd->command_array[i][0];
-        first_chars[1] = cmd->command_array[i][1];
-
-        // Expand ~ to home directory
-        if (strcmp(first_chars, "~/") == 0) {
-            char *home = getenv("HOME");
-            str_gsub(&cmd->command_array[i], "~", home);
-        }
-
-        // Expand $$ to PID of smallsh
-        pid_t pid = getpid();
-        char *str_pid = malloc(21);
-        if (sprintf(str_pid, "%jd", (intmax_t) pid) < 0) goto exit;
-        str_gsub(&cmd->command_array[i], "$$", str_pid);
-        free(str_pid);
-
-        // Expand $? to exit status of last foreground command
-        char *dollar_question_str = malloc(11);
-        if (sprintf(dollar_question_str, "%d", dollar_question) < 0) goto exit;
-        str_gsub(&cmd->command_array[i], "$?", dollar_question_str);
-        free(dollar_question_str);
-
-        //Expand $! to PID of most recent background process
-        str_gsub(&cmd->command_array[i], "$!", dollar_exclamation);
+/*********************************************************************
+ * PrintPrompt
+ * Print the prompt message to stderr.
+ *********************************************************************/
+static void PrintPrompt(void) {
+    // Print prompt message
+    fprintf(stderr, "%s", PromptString());
+    fflush(stdout);
+}
 
-        i++;
+/*********************************************************************
+ * PromptString
+ * The prompt to show: PS1, or PS2 while a compound command is being
+ * read a line at a time.
+ * @return: the prompt, "" if unset
+ *********************************************************************/
+static const char *PromptString(void) {
+    if (compound.len > 0) {
+        const char *ps2 = getenv("PS2");
+        return ps2 != NULL ? ps2 : "> ";
     }
-    exit:
-    return errno ? -1 : 0;
+    const char *ps1 = getenv("PS1");
+    return ps1 != NULL ? ps1 : "";
 }
 
-/*******************************************************************************
- * ParseCommands
- * Parse the commands in cmd.command_array and handle redirection and background processes
+/*********************************************************************
+ * GetScriptCommands
+ * Get the next line of a script or -c string and parse it, or every
+ * line of a compound command. No prompt is printed.
  * @param command* cmd
- * @return 0 if successful, -1 if error
- ********************************************************************************/
-static int ParseCommands(command *cmd) {
+ * @param line_reader* reader
+ * @return: 0 if successful, -1 at the end of the script
+ *********************************************************************/
+static int GetScriptCommands(command *cmd, line_reader *reader) {
+    // Report finished background processes as each line is reached
+    ManageBackgroundProcesses();
 
-    //if (cmd.command_array[0] == NULL) goto exit;
-    if (cmd->command_array[0] == NULL) return 0;
-    ssize_t i = cmd->line_count; // i is the index of the last valid token
-    // Parse background indicator
-    if (cmd->command_array[i - 1] != NULL && strcmp(cmd->command_array[i - 1], "&") == 0) {
-        cmd->is_background = 1;
-        free(cmd->command_array[i - 1]);
-        cmd->command_array[i - 1] = NULL;
-        i--;
-        cmd->line_count--;
-    }
-    // Parse redirection
-    if (cmd->command_array[i - 1] != NULL && cmd->command_array[i - 2] != NULL) {
-        // Need to loop through these options twice to make sure either order works
-        for (int j = 0; j < 2; j++) {
-            // Check for input redirection
-            if (cmd->is_input_redirection == 0) { // Only set infile once
-                if (strcmp(cmd->command_array[i - 2], "<") == 0) {
-                    strcpy(cmd->in_file_name, cmd->command_array[i - 1]);
-                    free(cmd->command_array[i - 2]);
-                    cmd->command_array[i - 2] = NULL;
-                    cmd->command_array[i - 1] = NULL;
-                    i -= 2;
-                    cmd->line_count -= 2;
-                    cmd->is_input_redirection = 1;
-                }
-            }
-            // Check for output redirection
-            if (cmd->is_output_redirection == 0) { // Only set outfile once
-                if (strcmp(cmd->command_array[i - 2], ">") == 0) {
-                    strcpy(cmd->out_file_name, cmd->command_array[i - 1]);
-                    free(cmd->command_array[i - 2]);
-                    cmd->command_array[i - 2] = NULL;
-                    cmd->command_array[i - 1] = NULL;
-                    i -= 2;
-                    cmd->line_count -= 2;
-                    cmd->is_output_redirection = 1;
-                }
+    for (;;) {
+        size_t line_length; // lines have no length limit
+        uint64_t trace_start = TraceStart();
+        char *line = ReadScriptLine(reader, &line_length);
+        TraceEnd(TRACE_READ, trace_start);
+        if (line == NULL) {
+            if (compound.len > 0) {
+                fprintf(stderr, "smallsh: syntax error: unexpected end of file\n");
+                CompoundClear();
+                dollar_question = 2;
             }
+            return -1;
         }
+        if (ParseLine(cmd, line) != PARSE_MORE) return 0;
     }
-    return errno ? -1 : 0;
 }
 
 /*********************************************************************
- * ExecuteCommands
- * Execute the commands stored in cmd.command_array.
- * Includes built-in commands: exit and cd.
- * Supports non-built in commands, and background processes.
- * Handles redirection.
+ * ParseLine()
+ * Turn a line into cmd's tokens and pipeline stages, or into a compiled
+ * program if it is a compound command. A line seen before is copied out
+ * of the parsed-line cache instead of being tokenized and parsed again;
+ * only its expansion is redone.
  * @param command* cmd
- * @return: 0 if successful, -1 if error
+ * @param char* line
+ * @return: 0 if successful, PARSE_MORE if a compound command needs
+ *          more lines, -1 if error
  *********************************************************************/
-static int ExecuteCommands(command *cmd) {
-
-    int err_status = 0;
-    int child_status;
-    pid_t my_pid = getpid();
-    waitpid(-my_pid, &child_status, WNOHANG | WUNTRACED); // Get any child with same group PID as smallsh.
-
-    // Built in commands
-    if (cmd->command_array[0] == NULL) goto exit;
+static int ParseLine(command *cmd, char *line){
+    // Lines are split on IFS, so a new IFS makes every cached line stale
+    const char *ifs = getenv("IFS");
+    if ((ifs == NULL) != (parse_cache.ifs == NULL) || (ifs != NULL && strcmp(ifs, parse_cache.ifs) != 0)) {
+        ParseCacheClear();
+        parse_cache.ifs = ifs != NULL ? strdup(ifs) : NULL;
+    }
 
-    // exit
-    if (strcmp(cmd->command_array[0], "exit") == 0) {
-        err_status = (ExitShell(cmd, my_pid) < 0) ? -1 : 0;
-        goto exit;
+    size_t len = strlen(line);
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    if (compound.len > 0) { // the next line of a compound command
+        if (TokenizeLine(cmd, line) < 0) return -1;
+        return CompileLine(cmd, line, len, hash);
+    }
+    for (size_t i = 0; i < len; i++) hash = (hash ^ (unsigned char) line[i]) * 1099511628211ULL;
+    parsed_line *entry = parse_cache.buckets[hash % PARSE_CACHE_BUCKETS];
+    while (entry != NULL && (entry->hash != hash || entry->len != len || memcmp(entry->text, line, len) != 0)) {
+        entry = entry->next;
+    }
+    if (entry != NULL) {
+        entry->hits++;
+        parse_cache.hits++;
+        return ParsedLineLoad(entry, cmd);
     }
 
-    // cd
-    if (strcmp(cmd->command_array[0], "cd") == 0) {
-        err_status = (ChangeDirectory(cmd) < 0) ? -1 : 0;
-        goto exit;
+    if (TokenizeLine(cmd, line) < 0) return -1;
+    if (cmd->line_count == 0) return 0; // nothing to run or cache
+    parse_cache.misses++;
+    if (IsCompound(cmd)) return CompileLine(cmd, line, len, hash);
+    uint64_t trace_start = TraceStart();
+    int parsed = ParseCommands(cmd);
+    TraceEnd(TRACE_PARSE, trace_start);
+    if (parsed < 0) {
+        cmd->line_count = 0;
+        return -1;
     }
+    if (cmd->stage_count > 0) ParseCacheStore(cmd, line, len, hash);
+    return 0;
+}
 
-    // Non-Built-in commands
-    else{
-        // Using exec() with fork()
-
-        // Fork a new process
-        pid_t spawn_pid = fork();
-        switch(spawn_pid){
-            case -1:
-                perror("fork()\n");
-                err_status = -1;
-                goto exit;
-            case 0:
-                // This runs in the child process.
-
-                // All signals shall be reset to their original actions when smallsh was invoked.
-                sigaction(SIGTSTP, &old_sigstp_action, NULL);
-                sigaction(SIGINT, &old_sigint_action, NULL);
-
-                // File input
-                if (cmd->is_input_redirection == 1){
-                    // Open source file
-                    int source_file = open(cmd->in_file_name, O_RDONLY);
-                    if (source_file == -1){
-                        fprintf(stderr, "open() failed on \"%s\"\n", cmd->in_file_name);
-                        exit(-1);
-                    }
-                    // Redirect stdin to source file
-                    int result = dup2(source_file , 0);
-                    if (result == -1) {
-                        perror("source dup2()");
-                        exit(-1);
-                    }
-                    //Close source file
-                    fcntl(source_file, F_SETFD, FD_CLOEXEC);
-                }
+/*********************************************************************
+ * ParseCacheStore()
+ * Add a parsed line to the cache. The cache is cleared when it is full.
+ * @param command* cmd - the line, parsed but not expanded
+ * @param const char* line
+ * @param size_t len
+ * @param uint64_t hash
+ *********************************************************************/
+static void ParseCacheStore(command *cmd, const char *line, size_t len, uint64_t hash){
+    if (parse_cache.count >= PARSE_CACHE_MAX) ParseCacheClear();
+    parsed_line *entry = ParsedLineNew(cmd, line, len, hash);
+    if (entry == NULL) return;
+    entry->next = parse_cache.buckets[hash % PARSE_CACHE_BUCKETS];
+    parse_cache.buckets[hash % PARSE_CACHE_BUCKETS] = entry;
+    parse_cache.count++;
+}
 
-                // File output
-                if (cmd->is_output_redirection == 1) {
-                    // Open target file
-                    int target_file = open(cmd->out_file_name, O_WRONLY | O_CREAT | O_TRUNC, 0777);
-                    if (target_file == -1) {
-                        perror("target open()");
-                        exit(-1);
-                    }
-                    // Redirect stdout to target file
-                    int result = dup2(target_file, 1);
-                    if (result == -1) {
-                        perror("target dup2()");
-                        exit(-1);
-                    }
-                }
+/*********************************************************************
+ * ParsedLineNew()
+ * Copy a parsed line out of the arena as one allocation: its stages,
+ * their argv arrays end to end, its limits and every word. Used for the
+ * parse cache and for the simple commands of a compiled program.
+ * @param command* cmd - the line, parsed but not expanded
+ * @param const char* line
+ * @param size_t len
+ * @param uint64_t hash
+ * @return: the copy, NULL if out of memory
+ *********************************************************************/
+static parsed_line *ParsedLineNew(command *cmd, const char *line, size_t len, uint64_t hash){
+    // Size everything first
+    size_t token_count = 0, text_size = len;
+    bool expands = false;
+    for (int i = 0; i < cmd->stage_count; i++) {
+        stage *st = &cmd->stages[i];
+        char *words[] = {st->in_file_name, st->out_file_name};
+        for (int j = 0; st->argv[j] != NULL; j++, token_count++) {
+            text_size += strlen(st->argv[j]) + 1;
+            if (st->argv[j][0] == '~' || strpbrk(st->argv[j], "$'\"\\*?[") != NULL) expands = true;
+        }
+        token_count++; // NULL after each argv
+        for (int j = 0; j < 2; j++) {
+            if (words[j] == NULL) continue;
+            text_size += strlen(words[j]) + 1;
+            if (words[j][0] == '~' || strpbrk(words[j], "$'\"\\") != NULL) expands = true;
+        }
+    }
+    job_limits *limits = cmd->limits;
+    const char *limit_values[] = {
+        limits ? limits->memory_max : NULL, limits ? limits->cpu_max : NULL, limits ? limits->pids_max : NULL,
+    };
+    for (int j = 0; j < 3; j++) text_size += limit_values[j] != NULL ? strlen(limit_values[j]) + 1 : 0;
 
-                // Replace the current process image with a new process image
-                execvp(cmd->command_array[0], cmd->command_array);
+    parsed_line *entry = malloc(sizeof *entry + sizeof(stage) * cmd->stage_count + sizeof(char *) * token_count +
+                                sizeof(job_limits) + text_size);
+    if (entry == NULL) return NULL;
+    entry->stages = (stage *) (entry + 1);
+    entry->tokens = (char **) (entry->stages + cmd->stage_count);
+    entry->limits = limits != NULL ? (job_limits *) (entry->tokens + token_count) : NULL;
+    char *text = (char *) (entry->tokens + token_count) + sizeof(job_limits);
+    entry->text = memcpy(text, line, len);
+    text += len;
 
-                // exec only returns if there is an error
-                perror("execve");
-                exit(-1);
-            default:
-                // In the parent process
-                // If not background, blocking wait for child's termination
-                if (cmd->is_background == 0){
-                    // Wait for child process to terminate
-                    spawn_pid = waitpid(spawn_pid, &child_status, WUNTRACED);
-                    dollar_question = child_status;
-                    if (WIFEXITED(child_status)){
-                        dollar_question = WEXITSTATUS(child_status);
-                    }
-                        // If child process was terminated by a signal, set $? to 128 + signal number
-                    else if (WIFSIGNALED(child_status)){
-                        dollar_question = 128 + WTERMSIG(child_status);
-                    }
-                        // If child process was stopped by a signal, send SIGCONT to child process
-                        // set $! to child process ID. Print message to stderr.
-                    else if (WIFSTOPPED(child_status)) {
-                        if (kill(spawn_pid, SIGCONT) < 0) goto exit;
-                        if (fprintf(stderr, "Child process %jd stopped. Continuing.\n", (intmax_t) spawn_pid) < 0) goto exit;
-                        dollar_exclamation = malloc(21);
-                        if (sprintf(dollar_exclamation, "%jd", (intmax_t) spawn_pid) < 0) goto exit;
-                        goto background_process;
-                    }
-                    goto exit;
-                }
-                else {
-                    background_process:
-                    waitpid(spawn_pid, &child_status, WNOHANG);
-                    dollar_exclamation = malloc(21);
-                    if (sprintf(dollar_exclamation, "%jd", (intmax_t) spawn_pid) < 0) goto exit;
-                    goto exit;
-                }
+    // Copy each word once, so the strings are never written to after this
+    size_t token = 0;
+    for (int i = 0; i < cmd->stage_count; i++) {
+        stage *st = &cmd->stages[i];
+        entry->stages[i] = *st;
+        entry->stages[i].argv = entry->tokens + token;
+        if (st->group != NULL) st->group->refs++;
+        for (int j = 0; st->argv[j] != NULL; j++) {
+            entry->tokens[token++] = text;
+            text = stpcpy(text, st->argv[j]) + 1;
+        }
+        entry->tokens[token++] = NULL;
+        if (st->in_file_name != NULL) {
+            entry->stages[i].in_file_name = text;
+            text = stpcpy(text, st->in_file_name) + 1;
+        }
+        if (st->out_file_name != NULL) {
+            entry->stages[i].out_file_name = text;
+            text = stpcpy(text, st->out_file_name) + 1;
         }
     }
-    exit:
-    return err_status;
+    if (limits != NULL) {
+        const char **values[] = {&entry->limits->memory_max, &entry->limits->cpu_max, &entry->limits->pids_max};
+        for (int j = 0; j < 3; j++) {
+            *values[j] = limit_values[j] != NULL ? text : NULL;
+            if (limit_values[j] != NULL) text = stpcpy(text, limit_values[j]) + 1;
+        }
+    }
+    entry->next = NULL;
+    entry->hash = hash;
+    entry->len = len;
+    entry->token_count = token_count;
+    entry->stage_count = cmd->stage_count;
+    entry->is_background = cmd->is_background;
+    entry->is_timed = cmd->is_timed;
+    entry->expands = expands;
+    entry->program = cmd->program;
+    if (entry->program != NULL) entry->program->refs++;
+    entry->hits = 0;
+    return entry;
 }
 
 /*********************************************************************
- * ExitShell()
- * Handles exit command.
- * If exit argument is an int, exits with that status.
- * If exit argument is not an int, prints error message to stderr.
- * If exit argument is not given, exits with status 0.
- * Kills all child processes before exiting.
- * @param: command *cmd - command struct
- * @param: pid_t my_pid - PID of smallsh
- * @return: -1 if error, otherwise exits shell.
+ * ParsedLineLoad()
+ * Set cmd up from a parsed line. The arena gets its own token array and
+ * stages, which expansion writes to, while the words stay shared.
+ * @param parsed_line* entry
+ * @param command* cmd
+ * @return: 0 if successful, -1 if error
  *********************************************************************/
-static int ExitShell(command *cmd, pid_t my_pid){
-    if (cmd->command_array[2] != NULL) { // too many arguments
-        fprintf(stderr, "exit: too many arguments\n");
-        goto exit;
+static int ParsedLineLoad(parsed_line *entry, command *cmd){
+    if (entry->program != NULL) {
+        cmd->program = entry->program;
+        cmd->program->refs++;
+        return 0;
     }
-    if (cmd->command_array[1] != NULL) { // exit argument
-        // Check if exit argument is an int
-        for (size_t i = 0; i < strlen(cmd->command_array[1]); i++){
-            if (isdigit(cmd->command_array[1][i]) == 0){
-                fprintf(stderr, "exit: argument not an int\n");
-                goto exit;
-            }
-        }
-        // Convert exit argument to int
-        long exit_status = strtol(cmd->command_array[1], NULL, 10);
-        fprintf(stderr, "\nexit\n");
-        KillChildrenProcesses(my_pid, SIGINT);
-        int err_status = (int) exit_status;
-        exit(err_status);
+    char **tokens = ArenaAlloc(sizeof *tokens * entry->token_count);
+    stage *stages = ArenaAlloc(sizeof *stages * entry->stage_count);
+    if (tokens == NULL || stages == NULL) return -1;
+    memcpy(tokens, entry->tokens, sizeof *tokens * entry->token_count);
+    for (int i = 0; i < entry->stage_count; i++) {
+        stages[i] = entry->stages[i];
+        stages[i].argv = tokens + (entry->stages[i].argv - entry->tokens);
     }
-    else { // no exit argument, exit with status of last foreground command
-        fprintf(stderr, "\nexit\n");
-        KillChildrenProcesses(my_pid, SIGINT);
-        exit(dollar_question);
+    cmd->command_array = tokens;
+    cmd->line_count = entry->token_count - entry->stage_count;
+    cmd->token_capacity = entry->token_count;
+    cmd->stages = stages;
+    cmd->stage_count = entry->stage_count;
+    cmd->is_background = entry->is_background;
+    cmd->is_timed = entry->is_timed;
+    cmd->limits = entry->limits;
+    cmd->is_literal = !entry->expands;
+    return 0;
+}
+
+/*********************************************************************
+ * ParsedLineFree()
+ * Free a parsed line and drop its hold on its program and on those of
+ * its compound stages.
+ * @param parsed_line* entry
+ *********************************************************************/
+static void ParsedLineFree(parsed_line *entry){
+    if (entry->program != NULL) ProgramRelease(entry->program);
+    for (int i = 0; i < entry->stage_count; i++) {
+        if (entry->stages[i].group != NULL) ProgramRelease(entry->stages[i].group);
     }
-    exit:
-    return -1;
+    free(entry);
 }
 
 /*********************************************************************
- * ChangeDirectory()
- * Handles cd command.
- * If no argument, changes directory to home directory.
- * If argument, changes directory to argument.
- * If too many arguments, prints error message to stderr.
+ * ParseCacheClear()
+ * Drop every cached line.
+ *********************************************************************/
+static void ParseCacheClear(void){
+    for (size_t i = 0; i < PARSE_CACHE_BUCKETS; i++) {
+        while (parse_cache.buckets[i] != NULL) {
+            parsed_line *entry = parse_cache.buckets[i];
+            parse_cache.buckets[i] = entry->next;
+            ParsedLineFree(entry);
+        }
+    }
+    parse_cache.count = 0;
+    free(parse_cache.ifs);
+    parse_cache.ifs = NULL;
+}
+
+/*********************************************************************
+ * CacheCommand()
+ * Handles cache command.
+ * Prints the parsed-line cache's size and hit rate. -r clears it and
+ * its counters.
  * @param cmd: command struct
  * @return: 0 if successful, -1 if error
  *********************************************************************/
-static int ChangeDirectory(command *cmd){
-    int err_status = 0;
-    if (cmd->command_array[2] != NULL) { // too many arguments
-        fprintf(stderr, "smallsh: cd: too many arguments\n");
-        err_status = -1;
-        goto exit;
+static int CacheCommand(command *cmd){
+    if (cmd->command_array[1] != NULL && strcmp(cmd->command_array[1], "-r") == 0) {
+        ParseCacheClear();
+        parse_cache.hits = 0;
+        parse_cache.misses = 0;
+        return 0;
+    }
+    if (cmd->command_array[1] != NULL) {
+        fprintf(stderr, "smallsh: cache: usage: cache [-r]\n");
+        return -1;
+    }
+    unsigned long lookups = parse_cache.hits + parse_cache.misses;
+    printf("cache: %zu lines, %lu hits, %lu misses, %.1f%% hit rate\n", parse_cache.count,
+           parse_cache.hits, parse_cache.misses, lookups ? 100.0 * parse_cache.hits / lookups : 0.0);
+    fflush(stdout);
+    return 0;
+}
+
+/*********************************************************************
+ * IsCompound()
+ * Check whether a tokenized line needs compiling: it starts with a
+ * reserved word or a function definition, has several commands, or
+ * pipes into a compound command.
+ * @param command* cmd
+ * @return: true if it does
+ *********************************************************************/
+static bool IsCompound(command *cmd){
+    static const char *const openers[] = {
+        "if", "while", "until", "for", "{", "break", "continue", "return", NULL,
+    };
+    const char *first = cmd->command_array[0];
+    for (int i = 0; openers[i] != NULL; i++) {
+        if (strcmp(first, openers[i]) == 0) return true;
+    }
+    size_t first_len = strlen(first);
+    if (IsCloser(first) || (first_len > 2 && strcmp(first + first_len - 2, "()") == 0)) return true;
+    if (cmd->line_count > 1 && strcmp(cmd->command_array[1], "()") == 0) return true;
+    for (int i = 0; i < cmd->line_count; i++) {
+        if (strcmp(cmd->command_array[i], ";") == 0) return true;
+        if (i < cmd->line_count - 1 && strcmp(cmd->command_array[i], "&") == 0) return true;
+        if (i > 0 && strcmp(cmd->command_array[i - 1], "|") == 0 && IsStageCompound(cmd->command_array[i])) return true;
+    }
+    return false;
+}
+
+/*********************************************************************
+ * IsStageCompound()
+ * Check whether a word starts a compound command that can be a
+ * pipeline stage: if, while, until, for or a { } group.
+ * @param const char* word
+ * @return: true if it does
+ *********************************************************************/
+static bool IsStageCompound(const char *word){
+    static const char *const openers[] = {"if", "while", "until", "for", "{", NULL};
+    for (int i = 0; openers[i] != NULL; i++) {
+        if (strcmp(word, openers[i]) == 0) return true;
+    }
+    return false;
+}
+
+/*********************************************************************
+ * IsCloser()
+ * Check whether a word is a reserved word that ends a list.
+ * @param const char* word
+ * @return: true if it is
+ *********************************************************************/
+static bool IsCloser(const char *word){
+    static const char *const closers[] = {"then", "elif", "else", "fi", "do", "done", "}", NULL};
+    for (int i = 0; closers[i] != NULL; i++) {
+        if (strcmp(word, closers[i]) == 0) return true;
+    }
+    return false;
+}
+
+/*********************************************************************
+ * CompoundDepth()
+ * Count the constructs a line opens less those it closes, looking at
+ * reserved words only where a command can start, so a compound command
+ * isn't compiled before its last line has been read.
+ * @param char** tokens
+ * @param int count
+ * @param int* closed - if not NULL, set to the number of tokens up to the
+ *                      word that closes the first construct, and the
+ *                      count stops there; -1 if it isn't closed
+ * @return: the change in depth
+ *********************************************************************/
+static int CompoundDepth(char **tokens, int count, int *closed){
+    static const char *const starts[] = {"if", "while", "until", "then", "elif", "else", "do", "|", "&", ";", NULL};
+    int depth = 0;
+    bool at_start = true;
+    for (int i = 0; i < count; i++) {
+        const char *word = tokens[i];
+        size_t len = strlen(word);
+        if (at_start && (strcmp(word, "if") == 0 || strcmp(word, "while") == 0 || strcmp(word, "until") == 0 ||
+                         strcmp(word, "for") == 0 || strcmp(word, "{") == 0)) depth++;
+        else if (at_start && (strcmp(word, "fi") == 0 || strcmp(word, "done") == 0 || strcmp(word, "}") == 0)) depth--;
+        else if (strcmp(word, "{") == 0 && i > 0 && (strcmp(tokens[i - 1], "()") == 0 ||
+                 (strlen(tokens[i - 1]) > 2 && strcmp(tokens[i - 1] + strlen(tokens[i - 1]) - 2, "()") == 0))) {
+            depth++; // body of a function definition
+        }
+        if (closed != NULL && depth == 0) {
+            *closed = i + 1;
+            return depth;
+        }
+        at_start = strcmp(word, "{") == 0 || strcmp(word, "}") == 0 || strcmp(word, "fi") == 0 ||
+                   strcmp(word, "done") == 0 || (len > 2 && strcmp(word + len - 2, "()") == 0);
+        for (int j = 0; !at_start && starts[j] != NULL; j++) at_start = strcmp(word, starts[j]) == 0;
+    }
+    if (closed != NULL) *closed = -1;
+    return depth;
+}
+
+/*********************************************************************
+ * CompileLine()
+ * Compile a line that is, or continues, a compound command into
+ * cmd.program. An incomplete command is kept in compound until the
+ * lines that finish it have been read. A compound command on one line
+ * is added to the parse cache, so repeating it skips compiling.
+ * @param command* cmd - the line, tokenized
+ * @param const char* line
+ * @param size_t len
+ * @param uint64_t hash
+ * @return: 0 if successful, PARSE_MORE if more lines are needed, -1 if error
+ *********************************************************************/
+static int CompileLine(command *cmd, const char *line, size_t len, uint64_t hash){
+    bool continued = compound.len > 0;
+    char **tokens = cmd->command_array;
+    int count = cmd->line_count;
+    compound.depth += CompoundDepth(tokens, count, NULL);
+    command whole = {0};
+    if (continued || compound.depth > 0) {
+        if (CompoundAppend(line, len) < 0) return -1;
+        if (compound.depth > 0) goto more;
+        // Tokenize every line together
+        if (TokenizeLine(&whole, compound.text) < 0) return -1;
+        tokens = whole.command_array;
+        count = whole.line_count;
+    }
+
+    int status;
+    program *prog = CompileProgram(tokens, count, &status);
+    if (status == COMPILE_MORE) {
+        if (!continued && CompoundAppend(line, len) < 0) return -1;
+        goto more;
+    }
+    CompoundClear();
+    cmd->line_count = 0;
+    if (prog == NULL) return -1;
+    cmd->program = prog;
+    if (!continued) ParseCacheStore(cmd, line, len, hash);
+    return 0;
+
+    more:
+    cmd->command_array = NULL;
+    cmd->line_count = 0;
+    cmd->token_capacity = 0;
+    return PARSE_MORE;
+}
+
+/*********************************************************************
+ * CompoundAppend()
+ * Add a line to the compound command being read.
+ * @param const char* line
+ * @param size_t len
+ * @return: 0 if successful, -1 if out of memory
+ *********************************************************************/
+static int CompoundAppend(const char *line, size_t len){
+    if (compound.len + len + 2 > compound.cap) {
+        size_t cap = compound.cap ? compound.cap * 2 : 256;
+        while (cap < compound.len + len + 2) cap *= 2;
+        char *text = realloc(compound.text, cap);
+        if (text == NULL) {
+            perror("realloc()");
+            return -1;
+        }
+        compound.text = text;
+        compound.cap = cap;
+    }
+    memcpy(compound.text + compound.len, line, len);
+    compound.len += len;
+    compound.text[compound.len++] = '\n';
+    compound.text[compound.len] = '\0';
+    return 0;
+}
+
+/*********************************************************************
+ * CompoundClear()
+ * Forget the compound command being read.
+ *********************************************************************/
+static void CompoundClear(void){
+    compound.len = 0;
+    compound.depth = 0;
+}
+
+/*********************************************************************
+ * CompileProgram()
+ * Compile tokens into a program.
+ * @param char** tokens - ";" tokens end commands
+ * @param int count
+ * @param int* status - set to COMPILE_OK, COMPILE_MORE if the tokens end
+ *                      inside a compound command, or COMPILE_ERROR
+ * @return: the program with one reference, NULL unless COMPILE_OK
+ *********************************************************************/
+static program *CompileProgram(char **tokens, int count, int *status){
+    compiler c = {.tokens = tokens, .count = count, .prog = calloc(1, sizeof(program))};
+    if (c.prog == NULL) {
+        perror("calloc()");
+        *status = COMPILE_ERROR;
+        return NULL;
+    }
+    c.prog->refs = 1;
+    uint64_t trace_start = TraceStart();
+    CompileList(&c, NULL);
+    TraceEnd(TRACE_COMPILE, trace_start);
+    *status = c.status;
+    if (c.status == COMPILE_OK) return c.prog;
+    ProgramRelease(c.prog);
+    return NULL;
+}
+
+/*********************************************************************
+ * CompileList()
+ * Compile commands up to one of the reserved words in ends, which is
+ * consumed.
+ * @param compiler* c
+ * @param const char* const* ends - NULL terminated, NULL to compile to the end
+ * @return: index in ends of the word found, -1 if error or incomplete
+ *********************************************************************/
+static int CompileList(compiler *c, const char *const *ends){
+    for (;;) {
+        while (c->pos < c->count && strcmp(c->tokens[c->pos], ";") == 0) c->pos++;
+        if (c->pos == c->count) {
+            if (ends == NULL) return 0;
+            c->status = COMPILE_MORE;
+            return -1;
+        }
+        const char *word = c->tokens[c->pos];
+        for (int i = 0; ends != NULL && ends[i] != NULL; i++) {
+            if (strcmp(word, ends[i]) == 0) {
+                c->pos++;
+                return i;
+            }
+        }
+        if (IsCloser(word) || strcmp(word, "&") == 0) return CompileError(c, word);
+        if (CompileCommand(c) < 0) return -1;
+    }
+}
+
+/*********************************************************************
+ * CompileCommand()
+ * Compile the command at the current token.
+ * @param compiler* c
+ * @return: 0 if successful, -1 if error or incomplete
+ *********************************************************************/
+static int CompileCommand(compiler *c){
+    static const char *const group_end[] = {"}", NULL};
+    const char *word = c->tokens[c->pos];
+    size_t len = strlen(word);
+    // Redirected, piped or put in the background, it becomes a pipeline stage
+    int closed;
+    if (IsStageCompound(word) && CompoundDepth(c->tokens + c->pos, c->count - c->pos, &closed) == 0 &&
+        c->pos + closed < c->count && strlen(c->tokens[c->pos + closed]) == 1 &&
+        strchr("|<>&", c->tokens[c->pos + closed][0]) != NULL) {
+        return CompilePipeline(c);
+    }
+    if (strcmp(word, "if") == 0) return CompileIf(c);
+    if (strcmp(word, "while") == 0) return CompileLoop(c, false);
+    if (strcmp(word, "until") == 0) return CompileLoop(c, true);
+    if (strcmp(word, "for") == 0) return CompileFor(c);
+    if (strcmp(word, "break") == 0 || strcmp(word, "continue") == 0 || strcmp(word, "return") == 0) {
+        return CompileJump(c);
+    }
+    if (strcmp(word, "{") == 0) {
+        c->pos++;
+        if (CompileList(c, group_end) < 0) return -1;
+        return CompileEnd(c);
+    }
+    // name() { list } or name () { list }
+    if (len > 2 && strcmp(word + len - 2, "()") == 0 && IsName(word, len - 2)) {
+        c->pos++;
+        return CompileFunction(c, word, len - 2);
+    }
+    if (c->pos + 1 < c->count && strcmp(c->tokens[c->pos + 1], "()") == 0 && IsName(word, len)) {
+        c->pos += 2;
+        return CompileFunction(c, word, len);
+    }
+    return CompileSimple(c);
+}
+
+/*********************************************************************
+ * CompileIf()
+ * Compile if list; then list; [elif list; then list;]... [else list;] fi
+ * @param compiler* c
+ * @return: 0 if successful, -1 if error or incomplete
+ *********************************************************************/
+static int CompileIf(compiler *c){
+    static const char *const then_end[] = {"then", NULL};
+    static const char *const branch_ends[] = {"elif", "else", "fi", NULL};
+    static const char *const fi_end[] = {"fi", NULL};
+    int fi_jumps = -1; // each branch taken jumps past the rest
+    int end;
+    c->pos++;
+    do {
+        if (CompileList(c, then_end) < 0) return -1;
+        int skip = Emit(c, OP_JUMP_FALSE, -1, 0);
+        if (skip < 0 || (end = CompileList(c, branch_ends)) < 0) return -1;
+        fi_jumps = Emit(c, OP_JUMP, fi_jumps, 0);
+        if (fi_jumps < 0) return -1;
+        c->prog->code[skip].a = c->prog->code_count;
+    } while (end == 0);
+    // With no branch taken the status is 0
+    if (end == 1 && CompileList(c, fi_end) < 0) return -1;
+    if (end == 2 && Emit(c, OP_STATUS, 0, 0) < 0) return -1;
+    while (fi_jumps != -1) {
+        int next = c->prog->code[fi_jumps].a;
+        c->prog->code[fi_jumps].a = c->prog->code_count;
+        fi_jumps = next;
+    }
+    return CompileEnd(c);
+}
+
+/*********************************************************************
+ * CompileLoop()
+ * Compile while list; do list; done, or until. The loop's status is
+ * that of the last body run, 0 if none was.
+ * @param compiler* c
+ * @param bool until
+ * @return: 0 if successful, -1 if error or incomplete
+ *********************************************************************/
+static int CompileLoop(compiler *c, bool until){
+    static const char *const do_end[] = {"do", NULL};
+    static const char *const done_end[] = {"done", NULL};
+    c->pos++;
+    if (Emit(c, OP_LOOP, 0, 0) < 0) return -1;
+    loop_label label = {.outer = c->loop, .continue_at = c->prog->code_count, .breaks = -1};
+    c->loop = &label;
+    int leave = -1;
+    if (CompileList(c, do_end) < 0 || (leave = Emit(c, until ? OP_JUMP_TRUE : OP_JUMP_FALSE, -1, 0)) < 0 ||
+        CompileList(c, done_end) < 0 || Emit(c, OP_SAVE, 0, 0) < 0 || Emit(c, OP_JUMP, label.continue_at, 0) < 0) {
+        c->loop = label.outer;
+        return -1;
+    }
+    c->loop = label.outer;
+    c->prog->code[leave].a = c->prog->code_count;
+    while (label.breaks != -1) {
+        int next = c->prog->code[label.breaks].a;
+        c->prog->code[label.breaks].a = c->prog->code_count;
+        label.breaks = next;
+    }
+    if (Emit(c, OP_END, 0, 0) < 0) return -1;
+    return CompileEnd(c);
+}
+
+/*********************************************************************
+ * CompileFor()
+ * Compile for name [in word...]; do list; done. Without in, the loop
+ * is over the positional parameters. The words are expanded once, when
+ * the loop starts.
+ * @param compiler* c
+ * @return: 0 if successful, -1 if error or incomplete
+ *********************************************************************/
+static int CompileFor(compiler *c){
+    static const char *const done_end[] = {"done", NULL};
+    c->pos++;
+    if (c->pos == c->count) {
+        c->status = COMPILE_MORE;
+        return -1;
+    }
+    const char *name = c->tokens[c->pos++];
+    if (!IsName(name, strlen(name))) return CompileError(c, name);
+
+    int words = -1;
+    if (c->pos < c->count && strcmp(c->tokens[c->pos], "in") == 0) {
+        int start = ++c->pos;
+        while (c->pos < c->count && strcmp(c->tokens[c->pos], ";") != 0) c->pos++;
+        if (c->pos == c->count) {
+            c->status = COMPILE_MORE;
+            return -1;
+        }
+        parsed_line *entry = CompileWords(c->tokens + start, c->pos - start);
+        if (entry == NULL || (words = ProgramAddCommand(c, entry)) < 0) return CompileError(c, NULL);
+    }
+    while (c->pos < c->count && strcmp(c->tokens[c->pos], ";") == 0) c->pos++;
+    if (c->pos == c->count) {
+        c->status = COMPILE_MORE;
+        return -1;
+    }
+    if (strcmp(c->tokens[c->pos], "do") != 0) return CompileError(c, c->tokens[c->pos]);
+    c->pos++;
+
+    int name_index = ProgramAddName(c, name, strlen(name));
+    if (name_index < 0 || Emit(c, OP_FOR, words, 0) < 0) return -1;
+    loop_label label = {.outer = c->loop, .continue_at = c->prog->code_count, .breaks = -1};
+    int next = Emit(c, OP_NEXT, name_index, -1);
+    if (next < 0) return -1;
+    c->loop = &label;
+    if (CompileList(c, done_end) < 0 || Emit(c, OP_SAVE, 0, 0) < 0 || Emit(c, OP_JUMP, label.continue_at, 0) < 0) {
+        c->loop = label.outer;
+        return -1;
+    }
+    c->loop = label.outer;
+    c->prog->code[next].b = c->prog->code_count;
+    while (label.breaks != -1) {
+        int later = c->prog->code[label.breaks].a;
+        c->prog->code[label.breaks].a = c->prog->code_count;
+        label.breaks = later;
+    }
+    if (Emit(c, OP_END, 0, 0) < 0) return -1;
+    return CompileEnd(c);
+}
+
+/*********************************************************************
+ * CompileFunction()
+ * Compile a function definition's { list } into a program of its own,
+ * defined when the definition runs.
+ * @param compiler* c - at the {
+ * @param const char* name - not NUL terminated
+ * @param size_t name_len
+ * @return: 0 if successful, -1 if error or incomplete
+ *********************************************************************/
+static int CompileFunction(compiler *c, const char *name, size_t name_len){
+    static const char *const body_end[] = {"}", NULL};
+    while (c->pos < c->count && strcmp(c->tokens[c->pos], ";") == 0) c->pos++;
+    if (c->pos == c->count) {
+        c->status = COMPILE_MORE;
+        return -1;
+    }
+    if (strcmp(c->tokens[c->pos], "{") != 0) return CompileError(c, c->tokens[c->pos]);
+    c->pos++;
+
+    // The body is compiled on its own, break and continue can't leave it
+    compiler body = *c;
+    body.prog = calloc(1, sizeof(program));
+    if (body.prog == NULL) return CompileError(c, NULL);
+    body.prog->refs = 1;
+    body.loop = NULL;
+    body.in_function = true;
+    int result = CompileList(&body, body_end);
+    c->pos = body.pos;
+    c->status = body.status;
+    if (result < 0) {
+        ProgramRelease(body.prog);
+        return -1;
+    }
+
+    program **bodies = GrowArray(c->prog->bodies, c->prog->body_count, &c->prog->body_cap, sizeof *bodies);
+    if (bodies == NULL) {
+        ProgramRelease(body.prog);
+        return CompileError(c, NULL);
+    }
+    c->prog->bodies = bodies;
+    bodies[c->prog->body_count] = body.prog;
+    int name_index = ProgramAddName(c, name, name_len);
+    if (name_index < 0 || Emit(c, OP_DEFINE, name_index, c->prog->body_count++) < 0) return -1;
+    return CompileEnd(c);
+}
+
+/*********************************************************************
+ * CompileJump()
+ * Compile break [n], continue [n] or return [status]. break and
+ * continue leave the n - 1 innermost loops first.
+ * @param compiler* c
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int CompileJump(compiler *c){
+    const char *word = c->tokens[c->pos++];
+    int start = c->pos;
+    while (c->pos < c->count && strcmp(c->tokens[c->pos], ";") != 0 && strcmp(c->tokens[c->pos], "&") != 0) c->pos++;
+    int argc = c->pos - start;
+    if (c->pos < c->count && strcmp(c->tokens[c->pos], "&") == 0) c->pos++;
+    if (argc > 1) {
+        fprintf(stderr, "smallsh: %s: too many arguments\n", word);
+        return Emit(c, OP_STATUS, 1, 0) < 0 ? -1 : 0;
+    }
+
+    if (strcmp(word, "return") == 0) {
+        if (!c->in_function) {
+            fprintf(stderr, "smallsh: return: can only `return' from a function\n");
+            return Emit(c, OP_STATUS, 1, 0) < 0 ? -1 : 0;
+        }
+        int status = -1;
+        if (argc == 1) {
+            parsed_line *entry = CompileWords(c->tokens + start, 1);
+            if (entry == NULL || (status = ProgramAddCommand(c, entry)) < 0) return CompileError(c, NULL);
+        }
+        return Emit(c, OP_RETURN, status, 0) < 0 ? -1 : 0;
+    }
+
+    long levels = 1;
+    if (argc == 1) {
+        char *end;
+        levels = strtol(c->tokens[start], &end, 10);
+        if (*end != '\0' || end == c->tokens[start] || levels < 1) {
+            fprintf(stderr, "smallsh: %s: %s: loop count out of range\n", word, c->tokens[start]);
+            return Emit(c, OP_STATUS, 1, 0) < 0 ? -1 : 0;
+        }
+    }
+    if (c->loop == NULL) {
+        fprintf(stderr, "smallsh: %s: only meaningful in a `for', `while', or `until' loop\n", word);
+        return Emit(c, OP_STATUS, 0, 0) < 0 ? -1 : 0;
+    }
+    loop_label *label = c->loop;
+    for (; levels > 1 && label->outer != NULL; levels--) {
+        if (Emit(c, OP_DROP, 0, 0) < 0) return -1;
+        label = label->outer;
+    }
+    if (word[0] == 'c') return Emit(c, OP_JUMP, label->continue_at, 0) < 0 ? -1 : 0;
+    label->breaks = Emit(c, OP_JUMP, label->breaks, 0);
+    return label->breaks < 0 ? -1 : 0;
+}
+
+/*********************************************************************
+ * CompileSimple()
+ * Parse a simple command or pipeline, up to ; or &, for OP_RUN. A
+ * pipeline with a compound stage goes to CompilePipeline instead.
+ * @param compiler* c
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int CompileSimple(compiler *c){
+    int start = c->pos;
+    while (c->pos < c->count && strcmp(c->tokens[c->pos], ";") != 0) {
+        if (strcmp(c->tokens[c->pos], "|") == 0 && c->pos + 1 < c->count && IsStageCompound(c->tokens[c->pos + 1])) {
+            c->pos = start;
+            return CompilePipeline(c);
+        }
+        if (strcmp(c->tokens[c->pos++], "&") == 0) break;
+    }
+
+    // ParseCommands writes to the token array, so it gets a copy
+    command simple = {.line_count = c->pos - start, .token_capacity = c->pos - start + 1};
+    simple.command_array = ArenaAlloc(sizeof(char *) * simple.token_capacity);
+    if (simple.command_array == NULL) return CompileError(c, NULL);
+    memcpy(simple.command_array, c->tokens + start, sizeof(char *) * simple.line_count);
+    simple.command_array[simple.line_count] = NULL;
+    if (ParseCommands(&simple) < 0) {
+        c->status = COMPILE_ERROR;
+        return -1;
+    }
+    if (simple.stage_count == 0) return 0;
+    parsed_line *entry = ParsedLineNew(&simple, "", 0, 0);
+    int index = entry != NULL ? ProgramAddCommand(c, entry) : -1;
+    if (index < 0) return CompileError(c, NULL);
+    return Emit(c, OP_RUN, index, 0) < 0 ? -1 : 0;
+}
+
+/*********************************************************************
+ * CompilePipeline()
+ * Compile a pipeline, up to ; or &, in which a compound command is a
+ * stage or has redirections: while ...; done > file, ... | { list; }.
+ * Each compound stage is compiled into a program of its own that
+ * GroupCommand runs, so break, continue and return inside it can't
+ * leave it. Its < and > follow the closing word.
+ * @param compiler* c
+ * @return: 0 if successful, -1 if error or incomplete
+ *********************************************************************/
+static int CompilePipeline(compiler *c){
+    command pipeline = {0};
+    pipeline.stages = ArenaAlloc(sizeof *pipeline.stages * (c->count - c->pos));
+    if (pipeline.stages == NULL) return CompileError(c, NULL);
+    int result = -1;
+    for (;;) {
+        stage *st = &pipeline.stages[pipeline.stage_count];
+        const char *word = c->tokens[c->pos];
+        int closed;
+        if (IsStageCompound(word)) {
+            if (CompoundDepth(c->tokens + c->pos, c->count - c->pos, &closed) != 0 || closed < 0) {
+                c->status = COMPILE_MORE;
+                goto exit;
+            }
+            // Compiled on its own, up to its closing word
+            compiler group = *c;
+            group.count = c->pos + closed;
+            group.loop = NULL;
+            group.prog = calloc(1, sizeof(program));
+            if (group.prog == NULL) {
+                CompileError(c, NULL);
+                goto exit;
+            }
+            group.prog->refs = 1;
+            int compiled = CompileCommand(&group);
+            c->pos = group.pos;
+            c->status = group.status;
+            char **argv = ArenaAlloc(sizeof *argv * 2);
+            if (compiled < 0 || argv == NULL) {
+                ProgramRelease(group.prog);
+                if (compiled == 0) CompileError(c, NULL);
+                goto exit;
+            }
+            argv[0] = (char *) word;
+            argv[1] = NULL;
+            ParseRedirections(st, argv, 0);
+            st->group = group.prog;
+            pipeline.stage_count++;
+            while (c->pos < c->count && (strcmp(c->tokens[c->pos], "<") == 0 || strcmp(c->tokens[c->pos], ">") == 0)) {
+                if (c->pos + 1 == c->count) {
+                    CompileError(c, "newline");
+                    goto exit;
+                }
+                if (c->tokens[c->pos][0] == '<') st->in_file_name = c->tokens[c->pos + 1];
+                else st->out_file_name = c->tokens[c->pos + 1];
+                if (c->tokens[c->pos][0] == '<') st->is_input_redirection = 1;
+                else st->is_output_redirection = 1;
+                c->pos += 2;
+            }
+        }
+        else {
+            int start = c->pos;
+            while (c->pos < c->count && strcmp(c->tokens[c->pos], "|") != 0 && strcmp(c->tokens[c->pos], ";") != 0 &&
+                   strcmp(c->tokens[c->pos], "&") != 0) {
+                c->pos++;
+            }
+            char **argv = ArenaAlloc(sizeof *argv * (c->pos - start + 1));
+            if (argv == NULL) {
+                CompileError(c, NULL);
+                goto exit;
+            }
+            memcpy(argv, c->tokens + start, sizeof *argv * (c->pos - start));
+            argv[c->pos - start] = NULL;
+            ParseRedirections(st, argv, c->pos - start);
+            pipeline.stage_count++;
+            if (argv[0] == NULL) {
+                CompileError(c, c->pos < c->count ? c->tokens[c->pos] : "newline");
+                goto exit;
+            }
+        }
+
+        if (c->pos == c->count || strcmp(c->tokens[c->pos], ";") == 0 || IsCloser(c->tokens[c->pos])) break;
+        if (strcmp(c->tokens[c->pos], "&") == 0) {
+            pipeline.is_background = 1;
+            c->pos++;
+            break;
+        }
+        if (strcmp(c->tokens[c->pos], "|") != 0 || c->pos + 1 == c->count) {
+            CompileError(c, c->tokens[c->pos]);
+            goto exit;
+        }
+        c->pos++;
+    }
+
+    pipeline.command_array = pipeline.stages[0].argv;
+    parsed_line *entry = ParsedLineNew(&pipeline, "", 0, 0);
+    int index = entry != NULL ? ProgramAddCommand(c, entry) : -1;
+    if (index < 0) CompileError(c, NULL);
+    else result = Emit(c, OP_RUN, index, 0) < 0 ? -1 : 0;
+
+    exit:
+    // The parsed line holds its own references
+    for (int i = 0; i < pipeline.stage_count; i++) {
+        if (pipeline.stages[i].group != NULL) ProgramRelease(pipeline.stages[i].group);
+    }
+    return result;
+}
+
+/*********************************************************************
+ * CompileWords()
+ * Keep words to expand later, as a parsed line of one stage with no
+ * redirections.
+ * @param char** words
+ * @param int count
+ * @return: the parsed line, NULL if out of memory
+ *********************************************************************/
+static parsed_line *CompileWords(char **words, int count){
+    char **argv = ArenaAlloc(sizeof *argv * (count + 1));
+    if (argv == NULL) return NULL;
+    memcpy(argv, words, sizeof *argv * count);
+    argv[count] = NULL;
+    stage st = {.argv = argv};
+    command list = {.command_array = argv, .line_count = count, .stages = &st, .stage_count = 1};
+    return ParsedLineNew(&list, "", 0, 0);
+}
+
+/*********************************************************************
+ * CompileEnd()
+ * Check what follows a compound command: the end of a command or a
+ * reserved word that ends a list. A pipe, & or redirection after it
+ * was already taken by CompilePipeline.
+ * @param compiler* c
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int CompileEnd(compiler *c){
+    if (c->pos == c->count || strcmp(c->tokens[c->pos], ";") == 0 || IsCloser(c->tokens[c->pos])) return 0;
+    return CompileError(c, c->tokens[c->pos]);
+}
+
+/*********************************************************************
+ * CompileError()
+ * Report a syntax error and set $? to 2.
+ * @param compiler* c
+ * @param const char* token - the unexpected token, NULL if out of memory
+ * @return: -1
+ *********************************************************************/
+static int CompileError(compiler *c, const char *token){
+    if (token != NULL) fprintf(stderr, "smallsh: syntax error near unexpected token `%s'\n", token);
+    else perror("smallsh");
+    dollar_question = 2;
+    c->status = COMPILE_ERROR;
+    return -1;
+}
+
+/*********************************************************************
+ * Emit()
+ * Append an instruction to the program being compiled.
+ * @param compiler* c
+ * @param int op
+ * @param int a
+ * @param int b
+ * @return: its index, -1 if out of memory
+ *********************************************************************/
+static int Emit(compiler *c, int op, int a, int b){
+    program *prog = c->prog;
+    instruction *code = GrowArray(prog->code, prog->code_count, &prog->code_cap, sizeof *code);
+    if (code == NULL) return CompileError(c, NULL);
+    prog->code = code;
+    code[prog->code_count] = (instruction) {.op = op, .a = a, .b = b};
+    return prog->code_count++;
+}
+
+/*********************************************************************
+ * ProgramAddCommand()
+ * Hand a parsed line to the program being compiled.
+ * @param compiler* c
+ * @param parsed_line* entry
+ * @return: its index, -1 if out of memory, which frees entry
+ *********************************************************************/
+static int ProgramAddCommand(compiler *c, parsed_line *entry){
+    program *prog = c->prog;
+    parsed_line **commands = GrowArray(prog->commands, prog->command_count, &prog->command_cap, sizeof *commands);
+    if (commands == NULL) {
+        ParsedLineFree(entry);
+        return -1;
+    }
+    prog->commands = commands;
+    commands[prog->command_count] = entry;
+    return prog->command_count++;
+}
+
+/*********************************************************************
+ * ProgramAddName()
+ * Copy a name into the program being compiled.
+ * @param compiler* c
+ * @param const char* name - not NUL terminated
+ * @param size_t name_len
+ * @return: its index, -1 if out of memory
+ *********************************************************************/
+static int ProgramAddName(compiler *c, const char *name, size_t name_len){
+    program *prog = c->prog;
+    char **names = GrowArray(prog->names, prog->name_count, &prog->name_cap, sizeof *names);
+    if (names == NULL || (names[prog->name_count] = strndup(name, name_len)) == NULL) {
+        if (names != NULL) prog->names = names;
+        return CompileError(c, NULL);
+    }
+    prog->names = names;
+    return prog->name_count++;
+}
+
+/*********************************************************************
+ * GrowArray()
+ * Make room for one more item in a malloc'd array, doubling it when full.
+ * @param void* items
+ * @param int count - items in use
+ * @param int* cap - updated when the array grows
+ * @param size_t size - size of an item
+ * @return: the array, which may have moved, NULL if out of memory
+ *********************************************************************/
+static void *GrowArray(void *items, int count, int *cap, size_t size){
+    if (count < *cap) return items;
+    int new_cap = *cap ? *cap * 2 : 8;
+    void *grown = realloc(items, size * new_cap);
+    if (grown != NULL) *cap = new_cap;
+    return grown;
+}
+
+/*********************************************************************
+ * ProgramRelease()
+ * Drop a reference to a program, freeing it with the last one.
+ * @param program* prog
+ *********************************************************************/
+static void ProgramRelease(program *prog){
+    if (--prog->refs > 0) return;
+    for (int i = 0; i < prog->command_count; i++) ParsedLineFree(prog->commands[i]);
+    for (int i = 0; i < prog->name_count; i++) free(prog->names[i]);
+    for (int i = 0; i < prog->body_count; i++) ProgramRelease(prog->bodies[i]);
+    free(prog->commands);
+    free(prog->names);
+    free(prog->bodies);
+    free(prog->code);
+    free(prog);
+}
+
+/*********************************************************************
+ * RunProgram()
+ * Run a compiled program. Each simple command is loaded from its parsed
+ * line, expanded and run through ExecuteCommands, with the arena
+ * released after it. Loops are stopped by SIGINT, whether it killed a
+ * command or reached the shell between commands.
+ * @param program* prog
+ * @return: 0 at the end, 1 if the function returned, -1 if interrupted
+ *********************************************************************/
+static int RunProgram(program *prog){
+    // Loops being run, innermost last
+    struct {
+        char **words; // malloc'd, NULL for while and until
+        int count, next;
+        int status;
+    } *loops = NULL;
+    int loop_count = 0, loop_cap = 0;
+    int result = 0;
+
+    for (int pc = 0; pc < prog->code_count;) {
+        instruction *in = &prog->code[pc++];
+        switch (in->op) {
+            case OP_RUN: {
+                arena_mark mark = ArenaMark();
+                command cmd = {0};
+                if (ParsedLineLoad(prog->commands[in->a], &cmd) == 0 && (cmd.is_literal || ExpandVariables(&cmd) == 0)) {
+                    ExecuteCommands(&cmd);
+                }
+                ArenaRelease(mark);
+                if (interactive && dollar_question == 128 + SIGINT) run_interrupted = true;
+                if (run_interrupted) {
+                    result = -1;
+                    goto exit;
+                }
+                break;
+            }
+            case OP_JUMP:
+                // A loop of built-ins never waits for a child, so look for ^C here
+                if (in->a < pc && InterruptPending()) {
+                    fputc('\n', stderr);
+                    run_interrupted = true;
+                    dollar_question = 128 + SIGINT;
+                    result = -1;
+                    goto exit;
+                }
+                pc = in->a;
+                break;
+            case OP_JUMP_FALSE:
+                if (dollar_question != 0) pc = in->a;
+                break;
+            case OP_JUMP_TRUE:
+                if (dollar_question == 0) pc = in->a;
+                break;
+            case OP_STATUS:
+                dollar_question = in->a;
+                break;
+            case OP_LOOP:
+            case OP_FOR: {
+                void *grown = GrowArray(loops, loop_count, &loop_cap, sizeof *loops);
+                if (grown == NULL) {
+                    perror("realloc()");
+                    result = -1;
+                    goto exit;
+                }
+                loops = grown;
+                loops[loop_count].words = NULL;
+                loops[loop_count].count = 0;
+                loops[loop_count].next = 0;
+                loops[loop_count].status = 0;
+                loop_count++;
+                if (in->op == OP_LOOP) break;
+
+                // Expand the words once, into memory that outlives the arena mark
+                char **words = positional.args;
+                int count = positional.count;
+                arena_mark mark = ArenaMark();
+                command list = {0};
+                if (in->a >= 0) {
+                    if (ParsedLineLoad(prog->commands[in->a], &list) < 0 || ExpandVariables(&list) < 0) {
+                        ArenaRelease(mark);
+                        break;
+                    }
+                    // A command substitution can leave any number of words
+                    words = list.stages[0].argv;
+                    for (count = 0; words[count] != NULL; count++);
+                }
+                loops[loop_count - 1].words = malloc(sizeof *words * (count + 1));
+                for (int i = 0; loops[loop_count - 1].words != NULL && i < count; i++) {
+                    loops[loop_count - 1].words[i] = strdup(words[i]);
+                    loops[loop_count - 1].count++;
+                }
+                ArenaRelease(mark);
+                break;
+            }
+            case OP_NEXT:
+                if (loops[loop_count - 1].next == loops[loop_count - 1].count) {
+                    pc = in->b;
+                    break;
+                }
+                setenv(prog->names[in->a], loops[loop_count - 1].words[loops[loop_count - 1].next++], 1);
+                break;
+            case OP_SAVE:
+                loops[loop_count - 1].status = dollar_question;
+                break;
+            case OP_END:
+            case OP_DROP:
+                loop_count--;
+                for (int i = 0; i < loops[loop_count].count; i++) free(loops[loop_count].words[i]);
+                free(loops[loop_count].words);
+                if (in->op == OP_END) dollar_question = loops[loop_count].status;
+                break;
+            case OP_DEFINE:
+                DefineFunction(prog->names[in->a], prog->bodies[in->b]);
+                break;
+            case OP_RETURN: {
+                result = 1;
+                if (in->a < 0) goto exit;
+                arena_mark mark = ArenaMark();
+                command status = {0};
+                if (ParsedLineLoad(prog->commands[in->a], &status) == 0 && ExpandVariables(&status) == 0 &&
+                    status.stages[0].argv[0] != NULL) {
+                    char *end;
+                    long value = strtol(status.stages[0].argv[0], &end, 10);
+                    if (*end != '\0' || end == status.stages[0].argv[0]) {
+                        fprintf(stderr, "smallsh: return: %s: numeric argument required\n", status.stages[0].argv[0]);
+                        value = 2;
+                    }
+                    dollar_question = value & 255;
+                }
+                ArenaRelease(mark);
+                goto exit;
+            }
+        }
+    }
+    exit:
+    while (loop_count > 0) {
+        loop_count--;
+        for (int i = 0; i < loops[loop_count].count; i++) free(loops[loop_count].words[i]);
+        free(loops[loop_count].words);
+    }
+    free(loops);
+    return result;
+}
+
+/*********************************************************************
+ * InterruptPending()
+ * Check for a SIGINT waiting on signal_fd without blocking. Children
+ * reported on the way are reaped.
+ * @return: true if SIGINT arrived
+ *********************************************************************/
+static bool InterruptPending(void){
+    if (!interactive) return false;
+    sigset_t pending;
+    if (sigpending(&pending) == -1 || !sigismember(&pending, SIGINT)) return false;
+    int events = WaitForEvents(-1); // doesn't block, a signal is pending
+    if (events & EVENT_CHILD) ManageBackgroundProcesses();
+    return (events & EVENT_INTERRUPT) != 0;
+}
+
+/*********************************************************************
+ * FindFunction()
+ * Look up a function by name.
+ * @param const char* name - may be NULL
+ * @return: its body, NULL if there is no such function
+ *********************************************************************/
+static program *FindFunction(const char *name){
+    if (name == NULL) return NULL;
+    for (int i = 0; i < function_count; i++) {
+        if (strcmp(function_table[i].name, name) == 0) return function_table[i].body;
+    }
+    return NULL;
+}
+
+/*********************************************************************
+ * DefineFunction()
+ * Define a function, replacing any of the same name.
+ * @param const char* name
+ * @param program* body - gets a reference
+ * @return: 0 if successful, -1 if out of memory
+ *********************************************************************/
+static int DefineFunction(const char *name, program *body){
+    body->refs++;
+    for (int i = 0; i < function_count; i++) {
+        if (strcmp(function_table[i].name, name) == 0) {
+            ProgramRelease(function_table[i].body);
+            function_table[i].body = body;
+            return 0;
+        }
+    }
+    function *table = GrowArray(function_table, function_count, &function_cap, sizeof *table);
+    char *copy = strdup(name);
+    if (table == NULL || copy == NULL) {
+        if (table != NULL) function_table = table;
+        free(copy);
+        ProgramRelease(body);
+        perror("smallsh");
+        return -1;
+    }
+    function_table = table;
+    function_table[function_count++] = (function) {.name = copy, .body = body};
+    return 0;
+}
+
+/*********************************************************************
+ * FunctionCommand()
+ * Run a function, called through function_builtin so it gets the
+ * redirections and forking of a built-in. Its arguments are the
+ * positional parameters while it runs and $? is its last command's
+ * status or the one it returned.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int FunctionCommand(command *cmd){
+    program *body = FindFunction(cmd->command_array[0]);
+    if (body == NULL) return -1;
+    if (function_depth >= FUNCTION_DEPTH_MAX) {
+        fprintf(stderr, "smallsh: %s: maximum function nesting level exceeded (%d)\n",
+                cmd->command_array[0], FUNCTION_DEPTH_MAX);
+        dollar_question = 1;
+        return -1;
+    }
+    char **saved_args = positional.args;
+    int saved_count = positional.count;
+    positional.args = cmd->command_array + 1;
+    for (positional.count = 0; positional.args[positional.count] != NULL; positional.count++);
+
+    // Hold the body, the function may redefine itself
+    body->refs++;
+    function_depth++;
+    RunProgram(body);
+    function_depth--;
+    ProgramRelease(body);
+    positional.args = saved_args;
+    positional.count = saved_count;
+    return run_interrupted ? -1 : 0;
+}
+
+/*********************************************************************
+ * GroupCommand()
+ * Run a compound command that is a pipeline stage or has redirections,
+ * called through group_builtin like a function, but with the caller's
+ * positional parameters. $? is its last command's status.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int GroupCommand(command *cmd){
+    program *body = cmd->stages[0].group;
+    body->refs++;
+    RunProgram(body);
+    ProgramRelease(body);
+    return run_interrupted ? -1 : 0;
+}
+
+/*********************************************************************
+ * ShiftCommand()
+ * Handles shift command.
+ * shift [n] drops the first n positional parameters, 1 by default.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int ShiftCommand(command *cmd){
+    long n = 1;
+    if (cmd->command_array[1] != NULL) {
+        char *end;
+        n = strtol(cmd->command_array[1], &end, 10);
+        if (*end != '\0' || end == cmd->command_array[1] || n < 0 || n > positional.count) {
+            fprintf(stderr, "smallsh: shift: %s: shift count out of range\n", cmd->command_array[1]);
+            return -1;
+        }
+    }
+    positional.args += n;
+    positional.count -= n;
+    return 0;
+}
+
+/*********************************************************************
+ * PositionalParameter()
+ * Look up $n.
+ * @param long n
+ * @return: the value, "" if there are fewer parameters
+ *********************************************************************/
+static const char *PositionalParameter(long n){
+    if (n == 0) return positional.name;
+    return n <= positional.count ? positional.args[n - 1] : "";
+}
+
+/*********************************************************************
+ * PositionalJoined()
+ * Join the positional parameters with spaces, for $@ and $*.
+ * @return: the parameters allocated in the line arena, NULL if error
+ *********************************************************************/
+static const char *PositionalJoined(void){
+    size_t len = 0;
+    for (int i = 0; i < positional.count; i++) len += strlen(positional.args[i]) + 1;
+    char *joined = ArenaAlloc(len + 1);
+    if (joined == NULL) return NULL;
+    char *p = joined;
+    for (int i = 0; i < positional.count; i++) {
+        if (i > 0) *p++ = ' ';
+        p = stpcpy(p, positional.args[i]);
+    }
+    *p = '\0';
+    return joined;
+}
+
+/*********************************************************************
+ * TokenizeLine
+ * Split a line of input into tokens in cmd.command_array, skipping
+ * # comments. Tokens are separated by IFS characters outside quotes and
+ * keep their quotes and backslashes; ExpandVariables removes them later.
+ * An unquoted ; or newline ends a command and becomes a ";" token, and
+ * a $(...) command substitution is kept whole, whatever it contains.
+ * Runs of ordinary characters are skipped with strspn/strcspn, which
+ * glibc vectorizes, and lines and token counts have no fixed limit.
+ * @param command* cmd
+ * @param char* line
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int TokenizeLine(command *cmd, char *line) {
+    uint64_t trace_start = TraceStart();
+    int err_status = 0;
+    const char *ifs = getenv("IFS");
+    if (ifs == NULL) ifs = " \t\n";
+    // Separators are IFS without the newline, which ends a command instead
+    char sep[256];
+    size_t sep_len = 0;
+    for (const char *c = ifs; *c != '\0' && sep_len < sizeof sep - 1; c++) {
+        if (*c != '\n') sep[sep_len++] = *c;
+    }
+    sep[sep_len] = '\0';
+    // Characters that end or change the meaning of an unquoted run: IFS, ; quoting and $(
+    char reject[256 + 7];
+    memcpy(reject, sep, sep_len);
+    memcpy(reject + sep_len, "'\"\\;\n$", 7);
+
+    char *p = line;
+    for (;;) {
+        // Skip separators
+        if (sep_len > 0) p += strspn(p, sep);
+        if (*p == '\0') break;
+        if (*p == ';' || *p == '\n') {
+            if (PushToken(cmd, ";") < 0) {
+                err_status = -1;
+                break;
+            }
+            p++;
+            continue;
+        }
+        char *start = p;
+
+        // Find the end of the word; quoted text and escaped characters don't end it
+        for (;;) {
+            p += strcspn(p, reject);
+            if (*p == '\0' || *p == ';' || *p == '\n' || (sep_len > 0 && memchr(sep, *p, sep_len) != NULL)) break;
+            if (*p == '\\') { // escaped character
+                p += p[1] != '\0' ? 2 : 1;
+            }
+            else if (*p == '\'') { // single quotes run to the next single quote
+                char *close = strchr(p + 1, '\'');
+                p = close != NULL ? close + 1 : p + strlen(p);
+            }
+            else if (*p == '$') { // a command substitution runs to its )
+                const char *close = p[1] == '(' ? SubstitutionEnd(p + 2) : NULL;
+                p = close != NULL ? (char *) close + 1 : p + (p[1] == '(' ? strlen(p) : 1);
+            }
+            else { // double quotes run to the next unescaped double quote
+                for (p++; *p != '\0' && *p != '"'; p++) {
+                    if (*p == '\\' && p[1] != '\0') p++;
+                    else if (*p == '$' && p[1] == '(') {
+                        const char *close = SubstitutionEnd(p + 2);
+                        if (close == NULL) {
+                            p += strlen(p);
+                            break;
+                        }
+                        p = (char *) close;
+                    }
+                }
+                if (*p == '"') p++;
+            }
+        }
+
+        // A # comment runs to the end of the line
+        if (p - start == 1 && *start == '#') {
+            p = strchr(p, '\n');
+            if (p == NULL) break;
+            continue;
+        }
+        // Store each token in cmd.command_array
+        char *token = ArenaStrndup(start, p - start);
+        if (token == NULL || PushToken(cmd, token) < 0) {
+            err_status = -1;
+            break;
+        }
+    }
+    TraceEnd(TRACE_TOKENIZE, trace_start);
+    return err_status;
+}
+
+/*********************************************************************
+ * PushToken
+ * Append a token to cmd.command_array, doubling it in the line arena
+ * when full, and keep the array NULL terminated.
+ * @param command* cmd
+ * @param char* token
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int PushToken(command *cmd, char *token) {
+    if (cmd->line_count + 1 >= cmd->token_capacity) {
+        int capacity = cmd->token_capacity ? cmd->token_capacity * 2 : MIN_TOKENS;
+        char **tokens = ArenaAlloc(sizeof *tokens * capacity);
+        if (tokens == NULL) return -1;
+        if (cmd->line_count > 0) memcpy(tokens, cmd->command_array, sizeof *tokens * cmd->line_count);
+        cmd->command_array = tokens;
+        cmd->token_capacity = capacity;
+    }
+    cmd->command_array[cmd->line_count++] = token;
+    cmd->command_array[cmd->line_count] = NULL;
+    return 0;
+}
+
+/*********************************************************************
+ * SetupSignals
+ * Route SIGCHLD, and SIGINT when interactive, through signal_fd so the
+ * main loop can wait for them together with input. Interactive shells
+ * ignore SIGTSTP and, with job control, the terminal stop signals.
+ * Scripts keep the default actions for everything else. The signals
+ * the shell changes are reset for its children, except those that were
+ * already ignored when it started, as under nohup.
+ *********************************************************************/
+static void SetupSignals(void) {
+    ignore_action.sa_handler = SIG_IGN;
+    default_action.sa_handler = SIG_DFL;
+
+    const int reset[] = {SIGINT, SIGTSTP, SIGTTIN, SIGTTOU};
+    sigemptyset(&child_default_signals);
+    for (size_t i = 0; i < sizeof reset / sizeof reset[0]; i++) {
+        struct sigaction inherited;
+        if (sigaction(reset[i], NULL, &inherited) == 0 && inherited.sa_handler != SIG_IGN) {
+            sigaddset(&child_default_signals, reset[i]);
+        }
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (interactive) sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        perror("signalfd()");
+        exit(1);
+    }
+
+    if (!interactive) return;
+    sigaction(SIGTSTP, &ignore_action, NULL); // ignore SIGTSTP
+
+    // Job control needs smallsh to be the terminal's foreground process group
+    shell_pgid = getpgrp();
+    if (isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == shell_pgid) {
+        job_control = true;
+        sigaction(SIGTTOU, &ignore_action, NULL);
+        sigaction(SIGTTIN, &ignore_action, NULL);
+        tcgetattr(STDIN_FILENO, &shell_tmodes);
+    }
+}
+
+/*********************************************************************
+ * WaitForEvents
+ * Block until input_fd is readable or a signal arrives on signal_fd,
+ * and drain the pending signals. Changes to PATH directories are
+ * applied to the command trie on the way, and while waiting for input
+ * the trie is built one batch at a time whenever nothing else is ready.
+ * @param int input_fd - fd to wait for, -1 to wait for signals only
+ * @return: EVENT_* flags for what happened, 0 if nothing did
+ *********************************************************************/
+static int WaitForEvents(int input_fd) {
+    struct pollfd fds[3] = {
+        {.fd = signal_fd, .events = POLLIN},
+        {.fd = command_trie.inotify_fd, .events = POLLIN},
+        {.fd = input_fd, .events = POLLIN},
+    };
+    bool building = input_fd != -1 && command_trie.started && command_trie.scan_dir < command_trie.dir_count;
+    int events = 0, ready;
+    while ((ready = poll(fds, input_fd == -1 ? 2 : 3, building ? 0 : -1)) == -1) {
+        if (errno != EINTR) return 0;
+    }
+    if (ready == 0) {
+        TrieBuildStep();
+        return 0;
+    }
+    if (fds[1].revents & POLLIN) TrieWatch();
+    if (input_fd != -1 && (fds[2].revents & (POLLIN | POLLHUP | POLLERR))) events |= EVENT_INPUT;
+    if (fds[0].revents & POLLIN) {
+        struct signalfd_siginfo info[16];
+        ssize_t n;
+        while ((n = read(signal_fd, info, sizeof info)) > 0) {
+            for (size_t i = 0; i < (size_t) n / sizeof info[0]; i++) {
+                if (info[i].ssi_signo == SIGCHLD) events |= EVENT_CHILD;
+                else if (info[i].ssi_signo == SIGINT) events |= EVENT_INTERRUPT;
+            }
+        }
+    }
+    return events;
+}
+
+/*********************************************************************
+ * OpenScript
+ * Open a script file for reading. Regular files are mmap'd read-only
+ * and each line is copied out as it is reached; anything else (pipes,
+ * ttys) is read in large chunks. A leading #! line is skipped.
+ * @param line_reader* reader
+ * @param const char* path
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int OpenScript(line_reader *reader, const char *path) {
+    memset(reader, 0, sizeof *reader);
+    reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (reader->fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(reader->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            reader->buf = map;
+            reader->len = reader->cap = st.st_size;
+            reader->is_mapped = true;
+            close(reader->fd);
+            reader->fd = -1;
+        }
+    }
+
+    // Skip the interpreter line
+    size_t line_length;
+    if (FillScript(reader) == 0 && reader->len >= 2 && memcmp(reader->buf, "#!", 2) == 0) {
+        ReadScriptLine(reader, &line_length);
+    }
+    return 0;
+}
+
+/*********************************************************************
+ * OpenScriptString
+ * Read the lines of a -c argument.
+ * @param line_reader* reader
+ * @param const char* string
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int OpenScriptString(line_reader *reader, const char *string) {
+    memset(reader, 0, sizeof *reader);
+    reader->fd = -1;
+    reader->len = strlen(string);
+    reader->cap = reader->len + 1;
+    reader->buf = strdup(string);
+    return reader->buf == NULL ? -1 : 0;
+}
+
+/*********************************************************************
+ * HistoryOpen()
+ * Open the history log, $SMALLSH_HISTFILE or ~/.smallsh_history, and
+ * map it. Nothing is read until history is first searched.
+ *********************************************************************/
+static void HistoryOpen(void){
+    const char *path = getenv("SMALLSH_HISTFILE");
+    const char *home = getenv("HOME");
+    if (path != NULL) history.path = strdup(path);
+    else if (home != NULL && asprintf(&history.path, "%s/.smallsh_history", home) < 0) history.path = NULL;
+    if (history.path == NULL || history.path[0] == '\0') return;
+
+    const char *size = getenv("SMALLSH_HISTFILESIZE");
+    history.max_bytes = size != NULL ? strtoul(size, NULL, 10) : HISTORY_MAX_BYTES;
+    if (history.max_bytes < 4096) history.max_bytes = 4096;
+
+    history.fd = open(history.path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (history.fd == -1) return;
+    struct stat st;
+    if (fstat(history.fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, history.fd, 0);
+        if (map != MAP_FAILED) {
+            history.map = map;
+            history.map_len = st.st_size;
+        }
+    }
+}
+
+/*********************************************************************
+ * HistoryEntry()
+ * @param size_t i - entry number, from 0 for the oldest
+ * @param size_t* len - set to the length of the entry
+ * @return: the entry's text, not NUL terminated
+ *********************************************************************/
+static const char *HistoryEntry(size_t i, size_t *len){
+    history_entry *entry = i < history.mapped_count ? &history.mapped[i] : &history.added[i - history.mapped_count];
+    *len = entry->len;
+    return entry->text;
+}
+
+/*********************************************************************
+ * HistoryCompareText()
+ * qsort and bsearch order of entry numbers: by text, then oldest first.
+ *********************************************************************/
+static int HistoryCompareText(const void *a, const void *b){
+    size_t i = *(const uint32_t *) a, j = *(const uint32_t *) b;
+    size_t i_len, j_len;
+    const char *i_text = HistoryEntry(i, &i_len), *j_text = HistoryEntry(j, &j_len);
+    int order = memcmp(i_text, j_text, i_len < j_len ? i_len : j_len);
+    if (order == 0) order = (i_len > j_len) - (i_len < j_len);
+    if (order == 0) order = (i > j) - (i < j);
+    return order;
+}
+
+/*********************************************************************
+ * HistoryIndex()
+ * Split the mapped log into entries and sort every entry number by
+ * text, so a prefix is found with a binary search. Only done once,
+ * the first time history is searched; later entries are inserted.
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int HistoryIndex(void){
+    if (history.indexed) return 0;
+    size_t count = 0;
+    for (const char *p = history.map, *end = history.map + history.map_len; p < end; count++) {
+        const char *newline = memchr(p, '\n', end - p);
+        p = newline != NULL ? newline + 1 : end;
+    }
+    history.mapped = malloc(sizeof *history.mapped * (count ? count : 1));
+    history.by_text = malloc(sizeof *history.by_text * (count + history.added_count + 1));
+    if (history.mapped == NULL || history.by_text == NULL) {
+        free(history.mapped);
+        free(history.by_text);
+        history.mapped = NULL;
+        history.by_text = NULL;
+        return -1;
+    }
+    history.by_text_cap = count + history.added_count + 1;
+    const char *p = history.map, *end = history.map + history.map_len;
+    for (size_t i = 0; i < count; i++) {
+        const char *newline = memchr(p, '\n', end - p);
+        history.mapped[i].text = p;
+        history.mapped[i].len = (newline != NULL ? newline : end) - p;
+        p = newline != NULL ? newline + 1 : end;
+    }
+    history.mapped_count = count;
+    for (size_t i = 0; i < count + history.added_count; i++) history.by_text[i] = i;
+    qsort(history.by_text, count + history.added_count, sizeof *history.by_text, HistoryCompareText);
+    history.indexed = true;
+    return 0;
+}
+
+/*********************************************************************
+ * HistoryAdd()
+ * Record a line typed at the prompt: append it to the log and to the
+ * index. Blank lines and repeats of the previous line are skipped.
+ * Several shells can share the log: each line goes out in a single
+ * O_APPEND write under a shared lock, and a log that was replaced by
+ * another shell's compaction is reopened first. Once the log is over
+ * its size limit it is compacted.
+ * @param const char* line
+ * @param size_t line_len
+ *********************************************************************/
+static void HistoryAdd(const char *line, size_t line_len){
+    if (history.fd == -1 || line[strspn(line, " \t")] == '\0') return;
+    if (history.added_count > 0) {
+        history_entry *last = &history.added[history.added_count - 1];
+        if (last->len == line_len && memcmp(last->text, line, line_len) == 0) return;
+    }
+
+    // Keep our own copy, entries from the log are only read from the mapping
+    if (history.added_count == history.added_cap) {
+        size_t cap = history.added_cap ? history.added_cap * 2 : 64;
+        history_entry *added = realloc(history.added, sizeof *added * cap);
+        if (added == NULL) return;
+        history.added = added;
+        history.added_cap = cap;
+    }
+    char *text = strndup(line, line_len);
+    if (text == NULL) return;
+    history.added[history.added_count].text = text;
+    history.added[history.added_count].len = line_len;
+    history.added_count++;
+    if (history.indexed) {
+        if (history.mapped_count + history.added_count > history.by_text_cap) {
+            size_t cap = history.by_text_cap * 2;
+            uint32_t *by_text = realloc(history.by_text, sizeof *by_text * cap);
+            if (by_text == NULL) {
+                history.indexed = false; // rebuilt on the next search
+                free(history.mapped);
+                free(history.by_text);
+                history.mapped = NULL;
+                history.by_text = NULL;
+                history.mapped_count = 0;
+                goto append;
+            }
+            history.by_text = by_text;
+            history.by_text_cap = cap;
+        }
+        // Newest entry of its text, so it goes after every equal one
+        uint32_t number = history.mapped_count + history.added_count - 1;
+        size_t low = 0, high = number;
+        while (low < high) {
+            size_t mid = (low + high) / 2;
+            if (HistoryCompareText(&history.by_text[mid], &number) < 0) low = mid + 1;
+            else high = mid;
+        }
+        memmove(history.by_text + low + 1, history.by_text + low, sizeof *history.by_text * (number - low));
+        history.by_text[low] = number;
+    }
+
+    append:
+    for (int tries = 0; tries < 3; tries++) {
+        flock(history.fd, LOCK_SH);
+        struct stat by_path, by_fd;
+        if (fstat(history.fd, &by_fd) == 0 && (stat(history.path, &by_path) != 0 ||
+                by_path.st_ino != by_fd.st_ino || by_path.st_dev != by_fd.st_dev)) {
+            // Another shell compacted the log into a new file
+            close(history.fd);
+            history.fd = open(history.path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+            if (history.fd == -1) return;
+            continue;
+        }
+        struct iovec iov[2] = {{(void *) line, line_len}, {"\n", 1}};
+        ssize_t written = writev(history.fd, iov, 2);
+        flock(history.fd, LOCK_UN);
+        if (written > 0 && (size_t) by_fd.st_size + written > history.max_bytes) HistoryCompact();
+        return;
+    }
+}
+
+/*********************************************************************
+ * HistoryCompact()
+ * Drop the oldest lines of the log so it is back to three quarters of
+ * its size limit. The newest lines are copied in the kernel into a new
+ * file, which replaces the log while the old one is locked, so the log
+ * is compacted a quarter at a time rather than on every line.
+ *********************************************************************/
+static void HistoryCompact(void){
+    char *temp_path = NULL;
+    int temp_fd = -1;
+    flock(history.fd, LOCK_EX);
+    struct stat st;
+    if (fstat(history.fd, &st) < 0 || (size_t) st.st_size <= history.max_bytes) goto exit;
+
+    // Keep whole lines only
+    off_t offset = st.st_size - history.max_bytes * 3 / 4;
+    char buf[4096];
+    ssize_t n;
+    while ((n = pread(history.fd, buf, sizeof buf, offset)) > 0) {
+        char *newline = memchr(buf, '\n', n);
+        if (newline != NULL) {
+            offset += newline - buf + 1;
+            break;
+        }
+        offset += n;
+    }
+
+    if (asprintf(&temp_path, "%s.%jd", history.path, (intmax_t) getpid()) < 0) {
+        temp_path = NULL;
+        goto exit;
+    }
+    temp_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (temp_fd == -1) goto exit;
+    while (offset < st.st_size) {
+        ssize_t copied = copy_file_range(history.fd, &offset, temp_fd, NULL, st.st_size - offset, 0);
+        if (copied > 0) continue;
+        // Across filesystems or on an old kernel copy it by hand
+        while ((n = pread(history.fd, buf, sizeof buf, offset)) > 0 && write(temp_fd, buf, n) == n) offset += n;
+        break;
+    }
+    if (offset < st.st_size || rename(temp_path, history.path) < 0) {
+        unlink(temp_path);
+        goto exit;
+    }
+    // The old log, and its lock, go once it is closed
+    close(history.fd);
+    history.fd = temp_fd;
+    temp_fd = -1;
+    int fd = open(history.path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (fd != -1) {
+        close(history.fd);
+        history.fd = fd;
+    }
+    free(temp_path);
+    return;
+
+    exit:
+    if (temp_fd != -1) close(temp_fd);
+    free(temp_path);
+    flock(history.fd, LOCK_UN);
+}
+
+/*********************************************************************
+ * HistoryExpand()
+ * Recall a history entry for a line starting with !: !! is the last
+ * entry, !N entry N and !prefix the newest entry starting with prefix.
+ * The event ends at the first blank and the rest of the line is
+ * appended to the recalled entry, so !ls -l reruns the last ls with -l.
+ * The recalled line is printed, as it will run in place of the line.
+ * @param char* line
+ * @return: the line to run, NULL if no entry matches
+ *********************************************************************/
+static char *HistoryExpand(char *line){
+    if (line[0] != '!' || line[1] == '\0' || strchr(" \t=(", line[1]) != NULL) return line;
+    if (HistoryIndex() < 0) return line;
+    size_t total = history.mapped_count + history.added_count;
+    const char *text = NULL;
+    size_t len = 0;
+
+    size_t event_len = strcspn(line + 1, " \t");
+    const char *rest = line + 1 + event_len;
+    char *end;
+    long number = strtol(line + 1, &end, 10);
+    if (event_len == 1 && line[1] == '!') {
+        if (total > 0) text = HistoryEntry(total - 1, &len);
+    }
+    else if (end != line + 1 && end == rest) {
+        if (number < 0) number += total + 1;
+        if (number >= 1 && (size_t) number <= total) text = HistoryEntry(number - 1, &len);
+    }
+    else {
+        // The entries starting with prefix are together in by_text, take the newest
+        const char *prefix = line + 1;
+        size_t prefix_len = event_len, low = 0, high = total, newest = total;
+        while (low < high) {
+            size_t mid = (low + high) / 2;
+            size_t entry_len;
+            const char *entry = HistoryEntry(history.by_text[mid], &entry_len);
+            int order = memcmp(entry, prefix, entry_len < prefix_len ? entry_len : prefix_len);
+            if (order < 0 || (order == 0 && entry_len < prefix_len)) low = mid + 1;
+            else high = mid;
+        }
+        for (size_t i = low; i < total; i++) {
+            size_t entry_len;
+            const char *entry = HistoryEntry(history.by_text[i], &entry_len);
+            if (entry_len < prefix_len || memcmp(entry, prefix, prefix_len) != 0) break;
+            if (newest == total || history.by_text[i] > newest) newest = history.by_text[i];
+        }
+        if (newest < total) text = HistoryEntry(newest, &len);
+    }
+
+    if (text == NULL) {
+        fprintf(stderr, "smallsh: !%.*s: event not found\n", (int) event_len, line + 1);
+        dollar_question = 1;
+        return NULL;
+    }
+    size_t rest_len = strlen(rest);
+    char *recalled = ArenaAlloc(len + rest_len + 1);
+    if (recalled != NULL) {
+        memcpy(recalled, text, len);
+        memcpy(recalled + len, rest, rest_len + 1);
+        printf("%s\n", recalled);
+    }
+    fflush(stdout);
+    return recalled;
+}
+
+/*********************************************************************
+ * HistoryCommand()
+ * Handles history command.
+ * history [N] lists the whole history, or its last N entries, and
+ * history -s text lists the entries containing text.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int HistoryCommand(command *cmd){
+    char **argv = cmd->command_array;
+    if (HistoryIndex() < 0) {
+        perror("smallsh: history");
+        return -1;
+    }
+    size_t total = history.mapped_count + history.added_count, first = 0;
+    const char *needle = NULL;
+    if (argv[1] != NULL && strcmp(argv[1], "-s") == 0) {
+        needle = argv[2];
+        if (needle == NULL || argv[3] != NULL) {
+            fprintf(stderr, "smallsh: history: usage: history [N] | history -s text\n");
+            return -1;
+        }
+    }
+    else if (argv[1] != NULL) {
+        char *end;
+        long count = strtol(argv[1], &end, 10);
+        if (*end != '\0' || count < 0 || argv[2] != NULL) {
+            fprintf(stderr, "smallsh: history: usage: history [N] | history -s text\n");
+            return -1;
+        }
+        if ((size_t) count < total) first = total - count;
+    }
+    size_t needle_len = needle != NULL ? strlen(needle) : 0;
+    for (size_t i = first; i < total; i++) {
+        size_t len;
+        const char *text = HistoryEntry(i, &len);
+        if (needle != NULL && memmem(text, len, needle, needle_len) == NULL) continue;
+        printf("%5zu  %.*s\n", i + 1, (int) len, text);
+    }
+    return 0;
+}
+
+/*********************************************************************
+ * EditorStart
+ * Put the terminal in raw mode and start a new line at the prompt.
+ *********************************************************************/
+static void EditorStart(void) {
+    struct termios raw = shell_tmodes;
+    raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+    raw.c_iflag &= ~IXON;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    editor.len = editor.cursor = 0;
+    if (editor.buf != NULL) editor.buf[0] = '\0';
+    editor.done = false;
+    editor.history_pos = SIZE_MAX; // below the newest entry, the log is indexed on the first ^P
+    free(editor.saved);
+    editor.saved = NULL;
+}
+
+/*********************************************************************
+ * EditorStop
+ * Put the terminal back the way commands expect it.
+ *********************************************************************/
+static void EditorStop(void) {
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+}
+
+/*********************************************************************
+ * EditorRead
+ * Read whatever keys are waiting on the terminal.
+ * @param line_reader* reader - its fd is set to -1 at end of input
+ *********************************************************************/
+static void EditorRead(line_reader *reader) {
+    ssize_t n = read(STDIN_FILENO, editor.pending + editor.pending_len, sizeof editor.pending - editor.pending_len);
+    if (n == 0) reader->fd = -1;
+    if (n > 0) editor.pending_len += n;
+}
+
+/*********************************************************************
+ * EditorTakeLine
+ * Handle the keys read so far and return the line once Enter is
+ * pressed. Keys typed after Enter are kept for the next line.
+ * @param line_reader* reader - its fd is set to -1 on ^D at an empty line
+ * @return: the line, NULL if it is not finished
+ *********************************************************************/
+static char *EditorTakeLine(line_reader *reader) {
+    size_t used = 0;
+    while (used < editor.pending_len && !editor.done && reader->fd != -1) {
+        size_t n = EditorKey(editor.pending + used, editor.pending_len - used, reader);
+        if (n == 0) break; // the rest of an escape sequence hasn't arrived
+        used += n;
+    }
+    memmove(editor.pending, editor.pending + used, editor.pending_len - used);
+    editor.pending_len -= used;
+    EditorFlush();
+    if (!editor.done) return NULL;
+    EditorStop();
+    return editor.buf != NULL ? editor.buf : "";
+}
+
+/*********************************************************************
+ * EditorKey
+ * Handle one key.
+ * @param const char* keys - bytes read from the terminal
+ * @param size_t n - number of bytes
+ * @param line_reader* reader
+ * @return: bytes used by the key, 0 if it is an incomplete escape sequence
+ *********************************************************************/
+static size_t EditorKey(const char *keys, size_t n, line_reader *reader) {
+    unsigned char key = keys[0];
+    size_t used = 1;
+    if (key == 0x1b) { // escape sequence: arrows, Home, End, Delete
+        if (n < 3) return n == sizeof editor.pending ? n : 0;
+        if (keys[1] != '[' && keys[1] != 'O') return 1;
+        used = 3;
+        char final = keys[2];
+        if (keys[2] >= '0' && keys[2] <= '9') {
+            while (used < n && keys[used - 1] != '~') used++;
+            if (keys[used - 1] != '~') return 0;
+            final = keys[2] == '1' || keys[2] == '7' ? 'H' : keys[2] == '4' || keys[2] == '8' ? 'F' : keys[2] == '3' ? 'X' : 0;
+        }
+        switch (final) {
+            case 'A': key = 0x10; break;   // up, as ^P
+            case 'B': key = 0x0e; break;   // down, as ^N
+            case 'C': key = 0x06; break;   // right, as ^F
+            case 'D': key = 0x02; break;   // left, as ^B
+            case 'H': key = 0x01; break;   // Home, as ^A
+            case 'F': key = 0x05; break;   // End, as ^E
+            case 'X': key = 0x7e; break;   // Delete
+            default: return used;
+        }
+        if (key == 0x7e) {
+            if (editor.cursor < editor.len) {
+                size_t end = EditorNextChar(editor.cursor);
+                EditorDelete(editor.cursor, end - editor.cursor);
+            }
+            return used;
+        }
+    }
+
+    if (key != '\t') editor.tabs = 0;
+    switch (key) {
+        case '\r':
+        case '\n':
+            editor.done = true;
+            EditorOutput("\r\n", 2);
+            break;
+        case 0x01: // ^A
+            editor.cursor = 0;
+            break;
+        case 0x05: // ^E
+            editor.cursor = editor.len;
+            break;
+        case 0x02: // ^B
+            while (editor.cursor > 0 && (editor.buf[--editor.cursor] & 0xc0) == 0x80);
+            break;
+        case 0x06: // ^F
+            editor.cursor = EditorNextChar(editor.cursor);
+            break;
+        case 0x7f: // backspace
+        case 0x08: {
+            size_t start = editor.cursor;
+            while (start > 0 && (editor.buf[--start] & 0xc0) == 0x80);
+            EditorDelete(start, editor.cursor - start);
+            break;
+        }
+        case 0x04: // ^D, end of input at an empty line
+            if (editor.len == 0) {
+                reader->fd = -1;
+                return used;
+            }
+            EditorDelete(editor.cursor, EditorNextChar(editor.cursor) - editor.cursor);
+            break;
+        case 0x0b: // ^K
+            EditorDelete(editor.cursor, editor.len - editor.cursor);
+            break;
+        case 0x15: // ^U
+            EditorDelete(0, editor.cursor);
+            break;
+        case 0x17: { // ^W
+            size_t start = editor.cursor;
+            while (start > 0 && editor.buf[start - 1] == ' ') start--;
+            while (start > 0 && editor.buf[start - 1] != ' ') start--;
+            EditorDelete(start, editor.cursor - start);
+            break;
+        }
+        case 0x0c: // ^L
+            EditorOutput("\x1b[H\x1b[2J", 7);
+            break;
+        case 0x10: // ^P
+        case 0x0e: // ^N
+            EditorHistory(key == 0x10 ? -1 : 1);
+            break;
+        case '\t':
+            EditorComplete();
+            break;
+        default:
+            if (key < 0x20) break; // other control characters
+            // Insert a run of plain characters at once
+            while (used < n && (unsigned char) keys[used] >= 0x20 && keys[used] != 0x7f) used++;
+            EditorInsert(keys, used);
+            break;
+    }
+    if (!editor.done) EditorRedraw();
+    return used;
+}
+
+/*********************************************************************
+ * EditorNextChar
+ * @param size_t pos - byte offset in the line
+ * @return: offset of the character after the one at pos, skipping
+ *          UTF-8 continuation bytes
+ *********************************************************************/
+static size_t EditorNextChar(size_t pos) {
+    if (pos < editor.len) pos++;
+    while (pos < editor.len && (editor.buf[pos] & 0xc0) == 0x80) pos++;
+    return pos;
+}
+
+/*********************************************************************
+ * EditorInsert
+ * Insert text at the cursor.
+ * @param const char* text
+ * @param size_t n
+ *********************************************************************/
+static void EditorInsert(const char *text, size_t n) {
+    if (editor.len + n + 1 > editor.cap) {
+        size_t cap = editor.cap ? editor.cap * 2 : 256;
+        while (cap < editor.len + n + 1) cap *= 2;
+        char *buf = realloc(editor.buf, cap);
+        if (buf == NULL) return;
+        editor.buf = buf;
+        editor.cap = cap;
+    }
+    memmove(editor.buf + editor.cursor + n, editor.buf + editor.cursor, editor.len - editor.cursor + 1);
+    memcpy(editor.buf + editor.cursor, text, n);
+    editor.len += n;
+    editor.cursor += n;
+    editor.buf[editor.len] = '\0';
+}
+
+/*********************************************************************
+ * EditorDelete
+ * Delete part of the line, moving the cursor to where it was.
+ * @param size_t start
+ * @param size_t n
+ *********************************************************************/
+static void EditorDelete(size_t start, size_t n) {
+    if (n == 0) return;
+    memmove(editor.buf + start, editor.buf + start + n, editor.len - start - n + 1);
+    editor.len -= n;
+    editor.cursor = start;
+}
+
+/*********************************************************************
+ * EditorHistory
+ * Show the previous or next history entry, the line being typed is
+ * kept to come back to below the newest entry.
+ * @param int direction - -1 for older, 1 for newer
+ *********************************************************************/
+static void EditorHistory(int direction) {
+    if (HistoryIndex() < 0) return;
+    size_t total = history.mapped_count + history.added_count;
+    if (editor.history_pos > total) editor.history_pos = total;
+    if ((direction < 0 && editor.history_pos == 0) || (direction > 0 && editor.history_pos >= total)) return;
+    if (editor.history_pos == total) {
+        free(editor.saved);
+        editor.saved = strndup(editor.buf != NULL ? editor.buf : "", editor.len);
+    }
+    editor.history_pos += direction;
+    size_t len = 0;
+    const char *text = editor.saved;
+    if (editor.history_pos < total) text = HistoryEntry(editor.history_pos, &len);
+    else if (text != NULL) len = strlen(text);
+    EditorDelete(0, editor.len);
+    if (text != NULL) EditorInsert(text, len);
+}
+
+/*********************************************************************
+ * EditorRedraw
+ * Draw the prompt and the line again, with the cursor in place.
+ *********************************************************************/
+static void EditorRedraw(void) {
+    const char *prompt = PromptString();
+    EditorOutput("\r", 1);
+    EditorOutput(prompt, strlen(prompt));
+    if (editor.len > 0) EditorOutput(editor.buf, editor.len);
+    EditorOutput("\x1b[K", 3);
+    size_t columns = 0;
+    for (size_t i = editor.cursor; i < editor.len; i++) columns += (editor.buf[i] & 0xc0) != 0x80;
+    if (columns > 0) {
+        char move[24];
+        EditorOutput(move, snprintf(move, sizeof move, "\x1b[%zuD", columns));
+    }
+}
+
+/*********************************************************************
+ * EditorOutput
+ * Queue output for the terminal, sent by EditorFlush in one write.
+ * @param const char* text
+ * @param size_t n
+ *********************************************************************/
+static void EditorOutput(const char *text, size_t n) {
+    if (editor.out_len + n > editor.out_cap) {
+        size_t cap = editor.out_cap ? editor.out_cap * 2 : 1024;
+        while (cap < editor.out_len + n) cap *= 2;
+        char *out = realloc(editor.out, cap);
+        if (out == NULL) return;
+        editor.out = out;
+        editor.out_cap = cap;
+    }
+    memcpy(editor.out + editor.out_len, text, n);
+    editor.out_len += n;
+}
+
+/*********************************************************************
+ * EditorFlush
+ * Write the queued output to the terminal.
+ *********************************************************************/
+static void EditorFlush(void) {
+    size_t written = 0;
+    while (written < editor.out_len) {
+        ssize_t n = write(STDERR_FILENO, editor.out + written, editor.out_len - written);
+        if (n <= 0 && errno != EINTR) break;
+        if (n > 0) written += n;
+    }
+    editor.out_len = 0;
+}
+
+/*********************************************************************
+ * EditorComplete
+ * Complete the word before the cursor. The first word of a command
+ * is completed from the trie of PATH executables and built-ins, any
+ * other word as a path. A single match is inserted whole; otherwise
+ * the longest common prefix is, and a second Tab lists the matches.
+ *********************************************************************/
+static void EditorComplete(void) {
+    editor.tabs++;
+    // Find the start of the word, an escaped space doesn't end it
+    size_t start = editor.cursor;
+    while (start > 0 && (strchr(" \t|<>&", editor.buf[start - 1]) == NULL ||
+                         (start >= 2 && editor.buf[start - 2] == '\\'))) {
+        start--;
+    }
+    size_t before = start;
+    while (before > 0 && editor.buf[before - 1] == ' ') before--;
+    bool command_word = before == 0 || editor.buf[before - 1] == '|';
+
+    // Match against the word without its backslashes
+    char *word = malloc(editor.cursor - start + 1);
+    if (word == NULL) return;
+    size_t word_len = 0;
+    for (size_t i = start; i < editor.cursor; i++) {
+        if (editor.buf[i] == '\\' && i + 1 < editor.cursor) i++;
+        word[word_len++] = editor.buf[i];
+    }
+    word[word_len] = '\0';
+
+    completion_list list = {0};
+    const char *base = word;
+    if (command_word && strchr(word, '/') == NULL) {
+        const char *path = getenv("PATH");
+        if (!command_trie.started || strcmp(command_trie.path, path != NULL ? path : "") != 0) TrieStart();
+        while (TrieBuildStep()); // finish a build still going on in the background
+        TrieComplete(word, word_len, &list);
+    }
+    else {
+        char *slash = strrchr(word, '/');
+        base = slash != NULL ? slash + 1 : word;
+        PathComplete(word, slash != NULL ? (size_t) (slash - word + 1) : 0, &list);
+    }
+    size_t base_len = strlen(base);
+
+    if (list.count == 0) EditorOutput("\a", 1);
+    else if (list.count == 1) {
+        const char *item = list.items[0];
+        size_t item_len = strlen(item);
+        EditorInsertEscaped(item + base_len, item_len - base_len);
+        if (item[item_len - 1] != '/') EditorInsert(" ", 1);
+    }
+    else {
+        size_t common = strlen(list.items[0]);
+        for (size_t i = 1; i < list.count; i++) {
+            size_t j = 0;
+            while (j < common && list.items[i][j] == list.items[0][j]) j++;
+            common = j;
+        }
+        if (common > base_len) EditorInsertEscaped(list.items[0] + base_len, common - base_len);
+        else if (editor.tabs >= 2) EditorList(&list);
+        else EditorOutput("\a", 1);
+    }
+    for (size_t i = 0; i < list.count; i++) free(list.items[i]);
+    free(list.items);
+    free(word);
+}
+
+/*********************************************************************
+ * EditorInsertEscaped
+ * Insert completed text, with a backslash before characters that
+ * would otherwise split or change the word.
+ * @param const char* text
+ * @param size_t n
+ *********************************************************************/
+static void EditorInsertEscaped(const char *text, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (strchr(" \t'\"\\|&<>#$*?", text[i]) != NULL) EditorInsert("\\", 1);
+        EditorInsert(text + i, 1);
+    }
+}
+
+/*********************************************************************
+ * EditorList
+ * List completion matches in columns below the line.
+ * @param completion_list* list
+ *********************************************************************/
+static void EditorList(completion_list *list) {
+    qsort(list->items, list->count, sizeof list->items[0], CompareStrings);
+    struct winsize ws;
+    size_t width = ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    size_t longest = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        size_t len = strlen(list->items[i]);
+        if (len > longest) longest = len;
+    }
+    size_t columns = width / (longest + 2);
+    if (columns == 0) columns = 1;
+    size_t rows = (list->count + columns - 1) / columns;
+    EditorOutput("\r\n", 2);
+    for (size_t row = 0; row < rows; row++) {
+        for (size_t column = 0; column < columns; column++) {
+            size_t i = column * rows + row;
+            if (i >= list->count) break;
+            size_t len = strlen(list->items[i]);
+            EditorOutput(list->items[i], len);
+            if (column + 1 < columns && i + rows < list->count) {
+                for (size_t pad = len; pad < longest + 2; pad++) EditorOutput(" ", 1);
+            }
+        }
+        EditorOutput("\r\n", 2);
+    }
+}
+
+/*********************************************************************
+ * CompareStrings
+ * qsort comparison for an array of strings.
+ *********************************************************************/
+static int CompareStrings(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/*********************************************************************
+ * CompletionAdd
+ * Add a match to a completion list.
+ * @param completion_list* list
+ * @param const char* name
+ * @param size_t len
+ * @param bool is_dir - add a / to the match
+ *********************************************************************/
+static void CompletionAdd(completion_list *list, const char *name, size_t len, bool is_dir) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 32;
+        char **items = realloc(list->items, sizeof *items * cap);
+        if (items == NULL) return;
+        list->items = items;
+        list->cap = cap;
+    }
+    char *item = malloc(len + 2);
+    if (item == NULL) return;
+    memcpy(item, name, len);
+    if (is_dir) item[len++] = '/';
+    item[len] = '\0';
+    list->items[list->count++] = item;
+}
+
+/*********************************************************************
+ * PathComplete
+ * Find the entries of a directory that start with the last part of
+ * a path, reading the directory a getdents64 batch at a time.
+ * @param const char* word - the path typed so far
+ * @param size_t dir_len - length of its directory part, with the /
+ * @param completion_list* list - gets each matching name
+ *********************************************************************/
+static void PathComplete(const char *word, size_t dir_len, completion_list *list) {
+    const char *base = word + dir_len;
+    size_t base_len = strlen(base);
+    char *dir;
+    if (dir_len == 0) dir = strdup(".");
+    else if (word[0] == '~' && word[1] == '/') {
+        const char *home = getenv("HOME");
+        if (asprintf(&dir, "%s%.*s", home != NULL ? home : "", (int) dir_len - 1, word + 1) < 0) dir = NULL;
+    }
+    else dir = strndup(word, dir_len);
+    if (dir == NULL) return;
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(dir);
+    if (dir_fd == -1) return;
+
+    char *buf = malloc(DIRENT_BATCH);
+    ssize_t n;
+    while (buf != NULL && (n = ReadDirectoryBatch(dir_fd, buf, DIRENT_BATCH)) > 0) {
+        for (ssize_t offset = 0; offset < n;) {
+            dirent64_record *entry = (dirent64_record *) (buf + offset);
+            offset += entry->reclen;
+            const char *name = entry->name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+            if (name[0] == '.' && base[0] != '.') continue;
+            if (strncmp(name, base, base_len) != 0) continue;
+            bool is_dir = entry->type == DT_DIR;
+            struct stat st;
+            if ((entry->type == DT_LNK || entry->type == DT_UNKNOWN) && fstatat(dir_fd, name, &st, 0) == 0) {
+                is_dir = S_ISDIR(st.st_mode);
+            }
+            CompletionAdd(list, name, strlen(name), is_dir);
+        }
+    }
+    free(buf);
+    close(dir_fd);
+}
+
+/*********************************************************************
+ * ReadDirectoryBatch
+ * Read as many directory entries as fit in buf with one getdents64.
+ * @param int dir_fd
+ * @param char* buf - gets dirent64_record entries
+ * @param size_t size
+ * @return: bytes read, 0 at the end of the directory, -1 if error
+ *********************************************************************/
+static ssize_t ReadDirectoryBatch(int dir_fd, char *buf, size_t size) {
+    ssize_t n;
+    do {
+        n = syscall(SYS_getdents64, dir_fd, buf, size);
+    } while (n == -1 && errno == EINTR);
+    return n;
+}
+
+/*********************************************************************
+ * TrieStart
+ * Start building the command trie from the current PATH: built-ins go
+ * in now, each PATH directory is watched with inotify, and its
+ * executables are added by TrieBuildStep while the prompt is idle.
+ *********************************************************************/
+static void TrieStart(void) {
+    if (command_trie.inotify_fd != -1) close(command_trie.inotify_fd);
+    if (command_trie.scan_fd != -1) close(command_trie.scan_fd);
+    for (int i = 0; i < command_trie.dir_count; i++) free(command_trie.dirs[i]);
+    free(command_trie.dirs);
+    free(command_trie.watches);
+    free(command_trie.path);
+    trie_node *nodes = command_trie.nodes; // kept for the new trie
+    size_t cap = command_trie.cap;
+    memset(&command_trie, 0, sizeof command_trie);
+    command_trie.nodes = nodes;
+    command_trie.cap = cap;
+    command_trie.inotify_fd = -1;
+    command_trie.scan_fd = -1;
+    command_trie.started = true;
+
+    const char *path = getenv("PATH");
+    command_trie.path = strdup(path != NULL ? path : "");
+    if (command_trie.path == NULL) return;
+    command_trie.count = 1; // the root
+    if (command_trie.cap == 0) {
+        command_trie.nodes = calloc(1024, sizeof *command_trie.nodes);
+        command_trie.cap = command_trie.nodes != NULL ? 1024 : 0;
+    }
+    if (command_trie.nodes == NULL) return;
+    memset(&command_trie.nodes[0], 0, sizeof command_trie.nodes[0]);
+    for (size_t i = 0; i < sizeof builtins / sizeof builtins[0]; i++) TrieSet(builtins[i].name, TRIE_BUILTIN, true);
+
+    size_t dir_cap = 1;
+    for (const char *p = command_trie.path; *p != '\0'; p++) dir_cap += *p == ':';
+    if (dir_cap > TRIE_MAX_DIRS) dir_cap = TRIE_MAX_DIRS;
+    command_trie.dirs = calloc(dir_cap, sizeof *command_trie.dirs);
+    command_trie.watches = calloc(dir_cap, sizeof *command_trie.watches);
+    if (command_trie.dirs == NULL || command_trie.watches == NULL) return;
+    command_trie.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    for (const char *p = command_trie.path; (size_t) command_trie.dir_count < dir_cap;) {
+        size_t len = strcspn(p, ":");
+        int i = command_trie.dir_count;
+        command_trie.dirs[i] = len > 0 ? strndup(p, len) : strdup("."); // empty means the current directory
+        if (command_trie.dirs[i] == NULL) break;
+        command_trie.watches[i] = command_trie.inotify_fd == -1 ? -1 :
+            inotify_add_watch(command_trie.inotify_fd, command_trie.dirs[i],
+                              IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR);
+        command_trie.dir_count++;
+        if (p[len] == '\0') break;
+        p += len + 1;
+    }
+}
+
+/*********************************************************************
+ * TrieBuildStep
+ * Add one getdents64 batch of a PATH directory to the command trie.
+ * @return: true if there is more to read
+ *********************************************************************/
+static bool TrieBuildStep(void) {
+    if (!command_trie.started || command_trie.scan_dir >= command_trie.dir_count) return false;
+    if (command_trie.scan_fd == -1) {
+        command_trie.scan_fd = open(command_trie.dirs[command_trie.scan_dir], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (command_trie.scan_fd == -1) {
+            command_trie.scan_dir++;
+            return command_trie.scan_dir < command_trie.dir_count;
+        }
+    }
+    char buf[DIRENT_BATCH];
+    ssize_t n = ReadDirectoryBatch(command_trie.scan_fd, buf, sizeof buf);
+    if (n <= 0) {
+        close(command_trie.scan_fd);
+        command_trie.scan_fd = -1;
+        command_trie.scan_dir++;
+        return command_trie.scan_dir < command_trie.dir_count;
+    }
+    for (ssize_t offset = 0; offset < n;) {
+        dirent64_record *entry = (dirent64_record *) (buf + offset);
+        offset += entry->reclen;
+        if (entry->type == DT_DIR || entry->name[0] == '.') continue;
+        TrieCheck(command_trie.scan_dir, command_trie.scan_fd, entry->name);
+    }
+    return true;
+}
+
+/*********************************************************************
+ * TrieCheck
+ * Add a file to the command trie if it is an executable, or take it
+ * out if it no longer is.
+ * @param int dir - index of its PATH directory
+ * @param int dir_fd - the directory, -1 to go by its path
+ * @param const char* name
+ *********************************************************************/
+static void TrieCheck(int dir, int dir_fd, const char *name) {
+    struct stat st;
+    int result;
+    if (dir_fd != -1) result = fstatat(dir_fd, name, &st, 0);
+    else {
+        char *path;
+        if (asprintf(&path, "%s/%s", command_trie.dirs[dir], name) < 0) return;
+        result = stat(path, &st);
+        free(path);
+    }
+    TrieSet(name, (uint64_t) 1 << dir, result == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111));
+}
+
+/*********************************************************************
+ * TrieSet
+ * Mark a name as present, or not, in a PATH directory.
+ * @param const char* name
+ * @param uint64_t bit - the directory's bit, or TRIE_BUILTIN
+ * @param bool present
+ *********************************************************************/
+static void TrieSet(const char *name, uint64_t bit, bool present) {
+    uint32_t node = 0;
+    for (const char *p = name; *p != '\0'; p++) {
+        uint32_t child = command_trie.nodes[node].child;
+        while (child != 0 && command_trie.nodes[child].c != *p) child = command_trie.nodes[child].sibling;
+        if (child == 0) {
+            if (!present) return; // never added
+            if (command_trie.count == command_trie.cap) {
+                trie_node *nodes = realloc(command_trie.nodes, sizeof *nodes * command_trie.cap * 2);
+                if (nodes == NULL) return;
+                command_trie.nodes = nodes;
+                command_trie.cap *= 2;
+            }
+            child = command_trie.count++;
+            command_trie.nodes[child] = (trie_node) {.c = *p, .sibling = command_trie.nodes[node].child};
+            command_trie.nodes[node].child = child;
+        }
+        node = child;
+    }
+    if (present) command_trie.nodes[node].dirs |= bit;
+    else command_trie.nodes[node].dirs &= ~bit;
+}
+
+/*********************************************************************
+ * TrieWatch
+ * Apply the changes inotify reports in the PATH directories.
+ *********************************************************************/
+static void TrieWatch(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(command_trie.inotify_fd, buf, sizeof buf)) > 0) {
+        for (ssize_t offset = 0; offset < n;) {
+            struct inotify_event *event = (struct inotify_event *) (buf + offset);
+            offset += sizeof *event + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                TrieStart(); // lost track, read the directories again
+                return;
+            }
+            if (event->len == 0) continue;
+            for (int i = 0; i < command_trie.dir_count; i++) {
+                if (command_trie.watches[i] != event->wd) continue;
+                if (event->mask & (IN_DELETE | IN_MOVED_FROM)) TrieSet(event->name, (uint64_t) 1 << i, false);
+                else TrieCheck(i, -1, event->name);
+            }
+        }
+    }
+}
+
+/*********************************************************************
+ * TrieComplete
+ * Find every command starting with a prefix.
+ * @param const char* prefix
+ * @param size_t prefix_len
+ * @param completion_list* list - gets each command
+ *********************************************************************/
+static void TrieComplete(const char *prefix, size_t prefix_len, completion_list *list) {
+    if (command_trie.nodes == NULL) return;
+    uint32_t node = 0;
+    for (size_t i = 0; i < prefix_len && node != UINT32_MAX; i++) {
+        uint32_t child = command_trie.nodes[node].child;
+        while (child != 0 && command_trie.nodes[child].c != prefix[i]) child = command_trie.nodes[child].sibling;
+        node = child != 0 ? child : UINT32_MAX;
+    }
+    if (node == UINT32_MAX) return;
+    char name[NAME_MAX + 1];
+    memcpy(name, prefix, prefix_len < NAME_MAX ? prefix_len : NAME_MAX);
+    TrieCollect(node, name, prefix_len, list);
+}
+
+/*********************************************************************
+ * TrieCollect
+ * Add every command under a trie node to a completion list.
+ * @param uint32_t node
+ * @param char* name - the name down to node, NAME_MAX + 1 bytes
+ * @param size_t depth - its length
+ * @param completion_list* list
+ *********************************************************************/
+static void TrieCollect(uint32_t node, char *name, size_t depth, completion_list *list) {
+    if (command_trie.nodes[node].dirs != 0) CompletionAdd(list, name, depth, false);
+    if (depth >= NAME_MAX) return;
+    for (uint32_t child = command_trie.nodes[node].child; child != 0; child = command_trie.nodes[child].sibling) {
+        name[depth] = command_trie.nodes[child].c;
+        TrieCollect(child, name, depth + 1, list);
+    }
+}
+
+/*********************************************************************
+ * ServeSocket
+ * Run smallsh --serve: accept clients on a Unix domain socket and hand
+ * each connection to a zygote, a copy of the shell forked ahead of
+ * time that is waiting for a client fd. Another zygote is forked as
+ * soon as one is used, so clients never wait for a shell to start and
+ * every connection runs in its own process without blocking the rest.
+ * Only returns in the process serving a connection.
+ * @param const char* path - socket to listen on, replaced if it exists
+ * @param line_reader* reader - set up to read the client's lines
+ * @return: 0 in a connection's shell, -1 if error
+ *********************************************************************/
+static int ServeSocket(const char *path, line_reader *reader) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "smallsh: --serve: %s: socket path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        perror("socket()");
+        return -1;
+    }
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof addr) == -1 || listen(listen_fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "smallsh: --serve: %s: %s\n", path, strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+
+    const char *pool_env = getenv("SMALLSH_ZYGOTES");
+    zygote_count = pool_env != NULL ? atoi(pool_env) : ZYGOTES;
+    if (zygote_count < 1) zygote_count = 1;
+    zygotes = calloc(zygote_count, sizeof *zygotes);
+    if (zygotes == NULL) return -1;
+    for (int i = 0; i < zygote_count; i++) zygotes[i].ctl_fd = -1;
+
+    int next = 0;
+    for (;;) {
+        // Keep the pool full
+        for (int i = 0; i < zygote_count; i++) {
+            if (zygotes[i].ctl_fd != -1) continue;
+            int client_fd = ForkZygote(&zygotes[i], listen_fd);
+            if (client_fd == -2) continue;
+            if (client_fd == -1) exit(1);
+            // A zygote that was handed a client: serve it like a script
+            memset(reader, 0, sizeof *reader);
+            reader->fd = client_fd;
+            int null_fd = open("/dev/null", O_RDONLY);
+            if (null_fd != -1) {
+                dup2(null_fd, STDIN_FILENO);
+                close(null_fd);
+            }
+            dup2(client_fd, STDOUT_FILENO);
+            dup2(client_fd, STDERR_FILENO);
+            serve_client = true;
+            return 0;
+        }
+
+        int events = WaitForEvents(listen_fd);
+        if (events & EVENT_CHILD) ManageBackgroundProcesses(); // reaps finished connections
+        if (!(events & EVENT_INPUT)) continue;
+        int client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd == -1) continue;
+
+        // Pass the client to the next zygote, passing over any that died
+        char byte = 0;
+        struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+        union {
+            char buf[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                             .msg_control = control.buf, .msg_controllen = sizeof control.buf};
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &client_fd, sizeof(int));
+        for (int tries = 0; tries < zygote_count; tries++) {
+            zygote *z = &zygotes[next];
+            next = (next + 1) % zygote_count;
+            if (z->ctl_fd == -1) continue;
+            ssize_t sent = sendmsg(z->ctl_fd, &msg, MSG_NOSIGNAL);
+            close(z->ctl_fd);
+            z->ctl_fd = -1;
+            if (sent == 1) break;
+        }
+        close(client_fd);
+    }
+}
+
+/*********************************************************************
+ * ForkZygote
+ * Fork a zygote for the --serve pool, connected to the server by a
+ * socketpair that the client fd will arrive on.
+ * @param zygote* z - pool slot to fill in the server
+ * @param int listen_fd - closed in the zygote
+ * @return: -2 in the server, the client fd in the zygote once a
+ *          client arrives, -1 if error
+ *********************************************************************/
+static int ForkZygote(zygote *z, int listen_fd) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1) {
+        perror("socketpair()");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork()");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid > 0) {
+        close(fds[1]);
+        z->pid = pid;
+        z->ctl_fd = fds[0];
+        return -2;
+    }
+
+    // Zygote: drop the server's descriptors and wait to be handed a client
+    close(fds[0]);
+    close(listen_fd);
+    for (int i = 0; i < zygote_count; i++) {
+        if (zygotes[i].ctl_fd != -1) close(zygotes[i].ctl_fd);
+    }
+    free(zygotes);
+    zygotes = NULL;
+
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control.buf, .msg_controllen = sizeof control.buf};
+    ssize_t n;
+    do {
+        n = recvmsg(fds[1], &msg, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n <= 0 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) exit(0); // server is gone
+    int client_fd;
+    memcpy(&client_fd, CMSG_DATA(cmsg), sizeof(int));
+    close(fds[1]);
+    return client_fd;
+}
+
+/*********************************************************************
+ * ServeStatus
+ * Tell a --serve client that its line has finished: a NUL byte, so it
+ * can't be confused with the command's output, then a status line with
+ * $? and the resource usage of the line's job.
+ *********************************************************************/
+static void ServeStatus(void) {
+    fflush(stdout);
+    fflush(stderr);
+    dprintf(STDOUT_FILENO, "%cstatus %d real %.6f user %.6f sys %.6f maxrss %ld majflt %ld minflt %ld\n", '\0',
+            dollar_question, last_usage.real, last_usage.user, last_usage.sys, last_usage.max_rss,
+            last_usage.major_faults, last_usage.minor_faults);
+}
+
+/*********************************************************************
+ * FillScript
+ * Read another chunk of an unmapped script, moving any partial line
+ * to the front of the buffer first. Closes the fd at end of file.
+ * @param line_reader* reader
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int FillScript(line_reader *reader) {
+    if (reader->fd == -1) return 0;
+    if (reader->pos > 0) memmove(reader->buf, reader->buf + reader->pos, reader->len - reader->pos);
+    reader->len -= reader->pos;
+    reader->pos = 0;
+    if (reader->cap - reader->len < SCRIPT_CHUNK + 1) {
+        size_t cap = reader->cap * 2;
+        if (cap < reader->len + SCRIPT_CHUNK + 1) cap = reader->len + SCRIPT_CHUNK + 1;
+        char *buf = realloc(reader->buf, cap);
+        if (buf == NULL) return -1;
+        reader->buf = buf;
+        reader->cap = cap;
+    }
+    ssize_t n;
+    do {
+        n = read(reader->fd, reader->buf + reader->len, reader->cap - reader->len - 1);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        if (reader->fd != STDIN_FILENO) close(reader->fd);
+        reader->fd = -1;
+        return n == 0 ? 0 : -1;
+    }
+    reader->len += n;
+    return 0;
+}
+
+/*********************************************************************
+ * ReadScriptLine
+ * Return the next line of a script, reading more of it as needed.
+ * @param line_reader* reader
+ * @param size_t* line_length - set to the length of the line
+ * @return: the line, NULL at the end of the script
+ *********************************************************************/
+static char *ReadScriptLine(line_reader *reader, size_t *line_length) {
+    for (;;) {
+        char *line = TakeLine(reader, line_length);
+        if (line != NULL || reader->fd == -1) return line;
+        if (FillScript(reader) < 0) return NULL;
+    }
+}
+
+/*********************************************************************
+ * TakeLine
+ * Return the next complete line already in the reader's buffer, without
+ * its newline. It is NUL terminated in place, or copied into the
+ * reader's line buffer if the script is mapped, and is valid until the
+ * next line is taken. Once the input has ended, an unterminated last
+ * line is returned too.
+ * @param line_reader* reader
+ * @param size_t* line_length - set to the length of the line
+ * @return: the line, NULL if no complete line is buffered
+ *********************************************************************/
+static char *TakeLine(line_reader *reader, size_t *line_length) {
+    if (reader->pos == reader->len) return NULL;
+    char *start = reader->buf + reader->pos;
+    char *newline = memchr(start, '\n', reader->len - reader->pos);
+    if (newline == NULL && reader->fd != -1) return NULL;
+    *line_length = newline != NULL ? (size_t) (newline - start) : reader->len - reader->pos;
+    reader->pos += *line_length + (newline != NULL);
+    if (!reader->is_mapped) {
+        start[*line_length] = '\0';
+        return start;
+    }
+
+    if (reader->line_cap < *line_length + 1) {
+        size_t cap = reader->line_cap ? reader->line_cap : 256;
+        while (cap < *line_length + 1) cap *= 2;
+        char *line = realloc(reader->line, cap);
+        if (line == NULL) return NULL;
+        reader->line = line;
+        reader->line_cap = cap;
+    }
+    memcpy(reader->line, start, *line_length);
+    reader->line[*line_length] = '\0';
+
+    // Drop the pages already read so a long script doesn't stay resident
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t done = reader->pos / page * page;
+    if (done - reader->released >= SCRIPT_RELEASE) {
+        madvise(reader->buf + reader->released, done - reader->released, MADV_DONTNEED);
+        reader->released = done;
+    }
+    return reader->line;
+}
+
+/*******************************************************************************
+ * ExpandVariables
+ * Expand variables and remove quotes in the arguments and redirection file
+ * names of every stage. Each word that needs it is rewritten by ExpandWord
+ * in a single pass. Command substitutions are run first, all together,
+ * and an argument holding an unquoted one is split into fields on IFS.
+ * Then arguments with unquoted *, ? or [...] become the file names they
+ * match.
+ * @param command* cmd
+ * @return 0 if successful, -1 if error
+ ********************************************************************************/
+static int ExpandVariables(command *cmd) {
+    uint64_t trace_start = TraceStart();
+    int err_status = 0;
+    glob_cache.buckets = NULL; // the last command's directories went with the arena
+    bool substitutes = false;
+    for (int i = 0; i < cmd->stage_count && !substitutes; i++) {
+        stage *st = &cmd->stages[i];
+        for (int j = 0; st->argv[j] != NULL && !substitutes; j++) substitutes = strstr(st->argv[j], "$(") != NULL;
+        if (st->in_file_name != NULL && strstr(st->in_file_name, "$(") != NULL) substitutes = true;
+        if (st->out_file_name != NULL && strstr(st->out_file_name, "$(") != NULL) substitutes = true;
+    }
+    if (substitutes && ExpandSubstitutions(cmd) < 0) goto error;
+
+    // Check each token for variable expansion
+    for (int i = 0; i < cmd->stage_count; i++) {
+        stage *st = &cmd->stages[i];
+        bool globs = false;
+        for (int j = 0; st->argv[j] != NULL && !globs; j++) globs = IsGlob(st->argv[j]);
+        if (substitutes || globs) {
+            if (ExpandFields(st) < 0) goto error;
+            // A pipeline stage left with no words does nothing and exits 0
+            if (st->argv[0] == NULL && cmd->stage_count > 1) {
+                char **argv = ArenaAlloc(sizeof *argv * 2);
+                if (argv == NULL || (argv[0] = ArenaStrndup("true", 4)) == NULL) goto error;
+                argv[1] = NULL;
+                st->argv = argv;
+            }
+            if (i == 0) cmd->command_array = st->argv;
+        }
+        else {
+            for (int j = 0; st->argv[j] != NULL; j++) {
+                if (ExpandToken(&st->argv[j]) < 0) goto error;
+            }
+        }
+        if (st->in_file_name != NULL && ExpandToken(&st->in_file_name) < 0) goto error;
+        if (st->out_file_name != NULL && ExpandToken(&st->out_file_name) < 0) goto error;
+    }
+    // With no command word left, $? is the last substitution's
+    if (substitutes && substitutions.count > 0) dollar_question = substitutions.items[substitutions.count - 1].status;
+    goto exit;
+    error:
+    err_status = -1;
+    exit:
+    if (substitutes) SubstitutionsClear();
+    TraceEnd(TRACE_EXPAND, trace_start);
+    return err_status;
+}
+
+/*******************************************************************************
+ * ExpandToken
+ * Replace a token with its expansion.
+ * @param char** token
+ * @return 0 if successful, -1 if error
+ ********************************************************************************/
+static int ExpandToken(char **token) {
+    // Most tokens have nothing to expand or unquote and are left alone
+    if ((*token)[0] != '~' && strpbrk(*token, "$'\"\\") == NULL) return 0;
+    char *expanded = ExpandWord(*token, NULL);
+    if (expanded == NULL) return -1;
+    *token = expanded;
+    return 0;
+}
+
+/*******************************************************************************
+ * ExpandFields
+ * Expand a stage's arguments into a new argv in the line arena, where a
+ * word with a command substitution or a glob can become any number of
+ * fields.
+ * @param stage* st
+ * @return 0 if successful, -1 if error
+ ********************************************************************************/
+static int ExpandFields(stage *st) {
+    int count = 0, cap = 0;
+    for (; st->argv[cap] != NULL; cap++);
+    cap++;
+    char **argv = ArenaAlloc(sizeof *argv * cap);
+    if (argv == NULL) return -1;
+    for (int j = 0; st->argv[j] != NULL; j++) {
+        char *word = st->argv[j];
+        int fields = 1;
+        bool glob = IsGlob(word);
+        if (glob || strstr(word, "$(") != NULL) {
+            expand_buffer.pattern = glob;
+            word = ExpandWord(word, &fields);
+            expand_buffer.pattern = false;
+            if (word == NULL) return -1;
+        }
+        else if (ExpandToken(&word) < 0) return -1;
+
+        // Fields are NUL separated. A pattern becomes the names it matches,
+        // or stays as it is, less its escapes, if it matches none.
+        for (int k = 0; k < fields; k++) {
+            char *next = word + strlen(word) + 1;
+            int matches = glob ? GlobExpand(word, &argv, &count, &cap) : 0;
+            if (matches < 0) return -1;
+            if (matches == 0 && PushField(&argv, &count, &cap, glob ? GlobUnescape(word) : word) < 0) return -1;
+            word = next;
+        }
+    }
+    argv[count] = NULL;
+    st->argv = argv;
+    return 0;
+}
+
+/*******************************************************************************
+ * PushField
+ * Append an argument to an argv in the line arena, doubling it when full
+ * and leaving room for the NULL.
+ * @param char*** argv
+ * @param int* count
+ * @param int* cap
+ * @param char* field
+ * @return 0 if successful, -1 if error
+ ********************************************************************************/
+static int PushField(char ***argv, int *count, int *cap, char *field) {
+    if (*count + 1 >= *cap) {
+        char **grown = ArenaAlloc(sizeof *grown * *cap * 2);
+        if (grown == NULL) return -1;
+        memcpy(grown, *argv, sizeof *grown * *count);
+        *argv = grown;
+        *cap *= 2;
+    }
+    (*argv)[(*count)++] = field;
+    return 0;
+}
+
+/*******************************************************************************
+ * ExpandWord
+ * Expand one token left to right into expand_buffer:
+ *      ~/ at the start to the home directory
+ *      $$ to the PID of smallsh
+ *      $? to the exit status of the last foreground command
+ *      $! to the PID of the most recent background process
+ *      $0 to $9 and ${N} to the positional parameters, $# to their count
+ *      and $@ and $* to all of them joined by spaces
+ *      $NAME and ${NAME} to the value of an environment variable
+ *      $(command) to the output of the command, run by ExpandSubstitutions,
+ *      without its trailing newlines
+ * A $ that starts none of these is kept as is. Quotes are removed as
+ * they are passed: nothing is expanded inside single quotes, and inside
+ * double quotes only $ is. A backslash keeps the next character literal
+ * (inside double quotes only before $, `, " or \).
+ * For a glob pattern, *?[]\ that are quoted or come from an expansion
+ * are escaped with a backslash, leaving only the word's own unquoted ones
+ * to match file names.
+ * With field_count, the output of an unquoted command substitution is
+ * split into fields on IFS as POSIX describes: runs of IFS white space
+ * separate fields and are dropped at either end, and every other IFS
+ * character ends a field, along with the white space around it.
+ * @param const char* word
+ * @param int* field_count - set to the number of fields, NULL to not split
+ * @return expansion allocated in the line arena with its fields NUL
+ *         separated, NULL if error
+ ********************************************************************************/
+static char *ExpandWord(const char *word, int *field_count) {
+    expand_buffer.len = 0;
+    const char *p = word;
+    bool in_double_quotes = false;
+    bool split = false;         // an unquoted substitution was split
+    bool field_started = false; // the current field has text, or quotes
+    int fields = 0;             // fields ended so far
+
+    // Expand ~ to home directory
+    if (p[0] == '~' && p[1] == '/') {
+        const char *home = getenv("HOME");
+        if (home == NULL) home = "";
+        if (!AppendQuoted(home, strlen(home))) return NULL;
+        field_started = true;
+        p++;
+    }
+
+    for (;;) {
+        // Copy everything up to the next special character in one go
+        size_t literal_len = strcspn(p, in_double_quotes ? "$\"\\" : "$'\"\\");
+        if (!(in_double_quotes ? AppendQuoted(p, literal_len) : AppendExpansion(p, literal_len))) return NULL;
+        if (literal_len > 0) field_started = true;
+        p += literal_len;
+        if (*p == '\0') break;
+
+        if (*p == '"') {
+            in_double_quotes = !in_double_quotes;
+            field_started = true;
+            p++;
+            continue;
+        }
+        if (*p != '$') field_started = true;
+        if (*p == '\'') {
+            const char *close = strchr(p + 1, '\'');
+            size_t quoted_len = close != NULL ? (size_t) (close - p - 1) : strlen(p + 1);
+            if (!AppendQuoted(p + 1, quoted_len)) return NULL;
+            p += quoted_len + 1 + (close != NULL);
+            continue;
+        }
+        if (*p == '\\') {
+            p++;
+            if (*p == '\0') break;
+            if (in_double_quotes && strchr("$`\"\\", *p) == NULL && !AppendQuoted("\\", 1)) return NULL;
+            if (!AppendQuoted(p, 1)) return NULL;
+            p++;
+            continue;
+        }
+
+        p++; // past the $
+        const char *close = *p == '(' ? SubstitutionEnd(p + 1) : NULL;
+        if (close != NULL) { // command substitution
+            const char *text = p + 1;
+            p = close + 1;
+            if (substitutions.collecting) {
+                substitution *items = GrowArray(substitutions.items, substitutions.count, &substitutions.cap,
+                                                sizeof *items);
+                if (items == NULL) return NULL;
+                substitutions.items = items;
+                items[substitutions.count++] = (substitution) {.text = text, .len = close - text, .pid = -1, .fd = -1};
+                continue;
+            }
+            if (substitutions.next >= substitutions.count) continue;
+            substitution *sub = &substitutions.items[substitutions.next++];
+            if (field_count != NULL && !in_double_quotes) {
+                split = true;
+                if (!AppendFields(sub->out, sub->out_len, &fields, &field_started)) return NULL;
+                continue;
+            }
+            if (!AppendQuoted(sub->out, sub->out_len)) return NULL;
+            field_started = true;
+            continue;
+        }
+        field_started = true;
+        const char *value = NULL;
+        if (*p == '$') { // PID of smallsh, formatted once
+            if (dollar_dollar_str[0] == '\0') {
+                snprintf(dollar_dollar_str, sizeof dollar_dollar_str, "%jd", (intmax_t) getpid());
+            }
+            value = dollar_dollar_str;
+            p++;
+        }
+        else if (*p == '?') { // exit status, formatted again only when it changes
+            if (dollar_question_str[0] == '\0' || dollar_question_cached != dollar_question) {
+                snprintf(dollar_question_str, sizeof dollar_question_str, "%d", dollar_question);
+                dollar_question_cached = dollar_question;
+            }
+            value = dollar_question_str;
+            p++;
+        }
+        else if (*p == '!') {
+            value = dollar_exclamation;
+            p++;
+        }
+        else if (isdigit((unsigned char) *p)) {
+            value = PositionalParameter(*p - '0');
+            p++;
+        }
+        else if (*p == '#') {
+            snprintf(positional.count_str, sizeof positional.count_str, "%d", positional.count);
+            value = positional.count_str;
+            p++;
+        }
+        else if (*p == '@' || *p == '*') {
+            value = PositionalJoined();
+            p++;
+        }
+        else if (*p == '{') {
+            const char *close = strchr(p + 1, '}');
+            if (close != NULL && (value = LookupVariable(p + 1, close - p - 1)) != NULL) p = close + 1;
+        }
+        else if (isalpha((unsigned char) *p) || *p == '_') {
+            const char *name = p;
+            while (isalnum((unsigned char) *p) || *p == '_') p++;
+            value = LookupVariable(name, p - name);
+        }
+
+        if (value == NULL) {
+            // Not an expansion, keep the $
+            if (!AppendExpansion("$", 1)) return NULL;
+            continue;
+        }
+        if (!AppendQuoted(value, strlen(value))) return NULL;
+    }
+    // The last field, unless splitting left nothing after the last separator
+    if (field_count != NULL) *field_count = fields + (field_started || !split);
+    return ArenaStrndup(expand_buffer.buf, expand_buffer.len);
+}
+
+/*******************************************************************************
+ * AppendExpansion
+ * Append text to expand_buffer, which is reused across tokens and only
+ * grows, doubling each time, so most expansions never allocate.
+ * @param const char* text
+ * @param size_t text_len
+ * @return true if successful, false if out of memory
+ ********************************************************************************/
+static bool AppendExpansion(const char *text, size_t text_len) {
+    if (expand_buffer.len + text_len + 1 > expand_buffer.cap) {
+        size_t cap = expand_buffer.cap ? expand_buffer.cap * 2 : 256;
+        while (cap < expand_buffer.len + text_len + 1) cap *= 2;
+        char *buf = realloc(expand_buffer.buf, cap);
+        if (buf == NULL) return false;
+        expand_buffer.buf = buf;
+        expand_buffer.cap = cap;
+    }
+    memcpy(expand_buffer.buf + expand_buffer.len, text, text_len);
+    expand_buffer.len += text_len;
+    return true;
+}
+
+/*******************************************************************************
+ * AppendFields
+ * Append the output of a command substitution to expand_buffer split
+ * into fields on IFS, ending each field with a NUL.
+ * @param const char* text
+ * @param size_t len
+ * @param int* fields - fields ended so far, updated
+ * @param bool* field_started - whether the current field has text, updated
+ * @return true if successful, false if out of memory
+ ********************************************************************************/
+static bool AppendFields(const char *text, size_t len, int *fields, bool *field_started) {
+    const char *ifs = getenv("IFS");
+    if (ifs == NULL) ifs = " \t\n";
+    bool after_space = false; // IFS white space ended the last field
+    size_t i = 0;
+    while (i < len) {
+        // Copy a run of field text at once
+        size_t run = 0;
+        while (i + run < len && strchr(ifs, text[i + run]) == NULL) run++;
+        if (run > 0) {
+            if (!AppendQuoted(text + i, run)) return false;
+            *field_started = true;
+            after_space = false;
+            i += run;
+            continue;
+        }
+        bool space = text[i] == ' ' || text[i] == '\t' || text[i] == '\n';
+        // White space ends a field, and another IFS character ends one even if
+        // empty, unless it follows white space that already did
+        if ((space && *field_started) || (!space && !after_space)) {
+            if (!AppendExpansion("", 1)) return false;
+            (*fields)++;
+            *field_started = false;
+            after_space = space;
+        }
+        else if (!space) after_space = false;
+        i++;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ * SubstitutionEnd
+ * Find the ) that closes a command substitution, skipping quoted text,
+ * escaped characters and nested substitutions.
+ * @param const char* p - just past the $(
+ * @return the closing ), NULL if there is none
+ ********************************************************************************/
+static const char *SubstitutionEnd(const char *p) {
+    bool in_double_quotes = false;
+    int depth = 0; // unquoted ( not yet closed
+    for (; *p != '\0'; p++) {
+        if (*p == '\\') {
+            if (p[1] == '\0') return NULL;
+            p++;
+        }
+        else if (*p == '"') in_double_quotes = !in_double_quotes;
+        else if (*p == '\'' && !in_double_quotes) {
+            if ((p = strchr(p + 1, '\'')) == NULL) return NULL;
+        }
+        else if (*p == '$' && p[1] == '(') {
+            if ((p = SubstitutionEnd(p + 2)) == NULL) return NULL;
+        }
+        else if (in_double_quotes) continue;
+        else if (*p == '(') depth++;
+        else if (*p == ')' && depth-- == 0) return p;
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ * ExpandSubstitutions
+ * Run every command substitution in cmd's words, each in a forked
+ * subshell with its stdout on a pipe. All of them run at once; their
+ * output is read as it arrives into buffers that double as they fill,
+ * and the trailing newlines are dropped once each one finishes.
+ * @param command* cmd
+ * @return 0 if successful, -1 if error or interrupted
+ ********************************************************************************/
+static int ExpandSubstitutions(command *cmd) {
+    int err_status = 0;
+    struct pollfd *fds = NULL;
+
+    // Find them in the order ExpandVariables expands the words
+    substitutions.collecting = true;
+    for (int i = 0; i < cmd->stage_count; i++) {
+        stage *st = &cmd->stages[i];
+        for (int j = 0; st->argv[j] != NULL; j++) {
+            if (strstr(st->argv[j], "$(") != NULL && ExpandWord(st->argv[j], NULL) == NULL) goto error;
+        }
+        if (st->in_file_name != NULL && strstr(st->in_file_name, "$(") != NULL &&
+            ExpandWord(st->in_file_name, NULL) == NULL) goto error;
+        if (st->out_file_name != NULL && strstr(st->out_file_name, "$(") != NULL &&
+            ExpandWord(st->out_file_name, NULL) == NULL) goto error;
+    }
+    substitutions.collecting = false;
+
+    // Start them all
+    fflush(stdout);
+    for (int i = 0; i < substitutions.count; i++) {
+        substitution *sub = &substitutions.items[i];
+        int pipe_fds[2];
+        if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+            perror("pipe2()");
+            goto error;
+        }
+        sub->pid = fork();
+        if (sub->pid == -1) {
+            perror("fork()");
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            goto error;
+        }
+        if (sub->pid == 0) {
+            for (int j = 0; j < i; j++) close(substitutions.items[j].fd);
+            close(pipe_fds[0]);
+            dup2(pipe_fds[1], STDOUT_FILENO);
+            close(pipe_fds[1]);
+            RunSubshell(sub->text, sub->len);
+        }
+        close(pipe_fds[1]);
+        sub->fd = pipe_fds[0];
+    }
+
+    // Read whatever is ready until every pipe is at end of file
+    fds = malloc(sizeof *fds * substitutions.count);
+    if (fds == NULL) goto error;
+    for (int open_count = substitutions.count; open_count > 0;) {
+        for (int i = 0; i < substitutions.count; i++) {
+            fds[i] = (struct pollfd) {.fd = substitutions.items[i].fd, .events = POLLIN};
+        }
+        if (poll(fds, substitutions.count, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll()");
+            goto error;
+        }
+        for (int i = 0; i < substitutions.count; i++) {
+            substitution *sub = &substitutions.items[i];
+            if (sub->fd == -1 || fds[i].revents == 0) continue;
+            if (sub->out_len == sub->out_cap) {
+                size_t cap = sub->out_cap ? sub->out_cap * 2 : 4096;
+                char *out = realloc(sub->out, cap);
+                if (out == NULL) goto error;
+                sub->out = out;
+                sub->out_cap = cap;
+            }
+            ssize_t n = read(sub->fd, sub->out + sub->out_len, sub->out_cap - sub->out_len);
+            if (n > 0) sub->out_len += n;
+            else if (n == 0 || errno != EINTR) {
+                close(sub->fd);
+                sub->fd = -1;
+                open_count--;
+            }
+        }
+    }
+
+    // Collect their statuses and trim their output
+    bool interrupted = false;
+    for (int i = 0; i < substitutions.count; i++) {
+        substitution *sub = &substitutions.items[i];
+        int wstatus;
+        while (waitpid(sub->pid, &wstatus, 0) == -1 && errno == EINTR);
+        sub->pid = -1;
+        sub->status = WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus) : WEXITSTATUS(wstatus);
+        if (WIFSIGNALED(wstatus) && WTERMSIG(wstatus) == SIGINT) interrupted = true;
+
+        // A NUL can't be in an argument, so it is dropped
+        size_t len = 0;
+        for (size_t j = 0; j < sub->out_len; j++) {
+            if (sub->out[j] != '\0') sub->out[len++] = sub->out[j];
+        }
+        while (len > 0 && sub->out[len - 1] == '\n') len--;
+        sub->out_len = len;
+    }
+    // They are reaped, so their SIGCHLD needn't wake the prompt; finished
+    // background jobs are still found before the next one
+    sigset_t child_mask;
+    sigemptyset(&child_mask);
+    sigaddset(&child_mask, SIGCHLD);
+    sigtimedwait(&child_mask, NULL, &(struct timespec) {0});
+    if (interrupted && interactive) {
+        InterruptPending(); // the shell got the SIGINT too
+        fputc('\n', stderr);
+        dollar_question = 130;
+        goto error;
+    }
+    goto exit;
+    error:
+    err_status = -1;
+    substitutions.collecting = false;
+    // Don't leave children behind
+    for (int i = 0; i < substitutions.count; i++) {
+        substitution *sub = &substitutions.items[i];
+        if (sub->fd != -1) close(sub->fd);
+        sub->fd = -1;
+        if (sub->pid > 0) {
+            kill(sub->pid, SIGKILL);
+            while (waitpid(sub->pid, NULL, 0) == -1 && errno == EINTR);
+            sub->pid = -1;
+        }
+    }
+    exit:
+    free(fds);
+    return err_status;
+}
+
+/*******************************************************************************
+ * RunSubshell
+ * Run the text of a command substitution as a script in the forked
+ * child and exit with its status. The child forgets the shell's jobs
+ * and lets SIGINT kill it.
+ * @param const char* text
+ * @param size_t len
+ ********************************************************************************/
+static void RunSubshell(const char *text, size_t len) {
+    // Drop the shell's copies of its jobs without touching them
+    for (int i = 0; i < job_table_size; i++) {
+        if (job_table[i] == NULL) continue;
+        free(job_table[i]->cgroup);
+        free(job_table[i]->procs);
+        free(job_table[i]->text);
+        free(job_table[i]);
+    }
+    free(job_table);
+    job_table = NULL;
+    job_table_size = 0;
+    free(pid_map);
+    pid_map = NULL;
+    pid_map_cap = pid_map_used = 0;
+    free(zygotes);
+    zygotes = NULL;
+    zygote_count = 0;
+    serve_client = false;
+    interactive = false;
+    job_control = false;
+    free(substitutions.items);
+    substitutions.items = NULL;
+    substitutions.count = substitutions.cap = substitutions.next = 0;
+    CompoundClear();
+    if (sigismember(&child_default_signals, SIGINT) == 1) sigaction(SIGINT, &default_action, NULL);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+
+    char *script = strndup(text, len);
+    line_reader reader;
+    if (script == NULL || OpenScriptString(&reader, script) < 0) exit(1);
+    command cmd;
+    for (;;) {
+        ArenaReset();
+        memset(&cmd, 0, sizeof cmd);
+        if (GetScriptCommands(&cmd, &reader) < 0) break;
+        if (cmd.program != NULL) {
+            RunProgram(cmd.program);
+            ProgramRelease(cmd.program);
+        }
+        else if (cmd.line_count > 0 && (cmd.is_literal || ExpandVariables(&cmd) == 0)) ExecuteCommands(&cmd);
+    }
+    exit(dollar_question);
+}
+
+/*******************************************************************************
+ * SubstitutionsClear
+ * Forget the command substitutions of the last command, freeing their output.
+ ********************************************************************************/
+static void SubstitutionsClear(void) {
+    for (int i = 0; i < substitutions.count; i++) free(substitutions.items[i].out);
+    substitutions.count = 0;
+    substitutions.next = 0;
+}
+
+/*******************************************************************************
+ * AppendQuoted
+ * Append quoted or expanded text to expand_buffer, escaping the
+ * characters that are special in a glob pattern when expanding one.
+ * @param const char* text
+ * @param size_t text_len
+ * @return true if successful, false if out of memory
+ ********************************************************************************/
+static bool AppendQuoted(const char *text, size_t text_len) {
+    if (!expand_buffer.pattern) return AppendExpansion(text, text_len);
+    for (size_t i = 0; i < text_len;) {
+        size_t run = 0;
+        while (i + run < text_len && memchr("*?[]\\", text[i + run], 5) == NULL) run++;
+        if (!AppendExpansion(text + i, run)) return false;
+        i += run;
+        if (i < text_len) {
+            char escaped[2] = {'\\', text[i++]};
+            if (!AppendExpansion(escaped, 2)) return false;
+        }
+    }
+    return true;
+}
+
+/*******************************************************************************
+ * IsGlob
+ * Check whether a word, before expansion, has an unquoted *, ? or [...]
+ * outside its variables and command substitutions.
+ * @param const char* word
+ * @return true if it is a glob pattern
+ ********************************************************************************/
+static bool IsGlob(const char *word) {
+    if (strpbrk(word, "*?[") == NULL) return false;
+    bool in_double_quotes = false;
+    for (const char *p = word; *p != '\0'; p++) {
+        if (*p == '\\') {
+            if (p[1] == '\0') break;
+            p++;
+        }
+        else if (*p == '$') {
+            if (p[1] == '(') {
+                if ((p = SubstitutionEnd(p + 2)) == NULL) break;
+            }
+            else if (p[1] == '{') {
+                if ((p = strchr(p, '}')) == NULL) break;
+            }
+            else if (p[1] != '\0' && strchr("$?!#@*", p[1]) != NULL) p++;
+        }
+        else if (*p == '"') in_double_quotes = !in_double_quotes;
+        else if (in_double_quotes) continue;
+        else if (*p == '\'') {
+            if ((p = strchr(p + 1, '\'')) == NULL) break;
+        }
+        else if (*p == '*' || *p == '?' || (*p == '[' && strchr(p + 1, ']') != NULL)) return true;
+    }
+    return false;
+}
+
+/*******************************************************************************
+ * HasGlobCharacters
+ * Check whether part of an expanded pattern has an unescaped *, ? or [...].
+ * @param const char* pattern
+ * @return true if it has to be matched against directory entries
+ ********************************************************************************/
+static bool HasGlobCharacters(const char *pattern) {
+    for (const char *p = pattern; *p != '\0'; p++) {
+        if (*p == '\\') {
+            if (p[1] == '\0') break;
+            p++;
+        }
+        else if (*p == '*' || *p == '?' || (*p == '[' && strchr(p + 1, ']') != NULL)) return true;
+    }
+    return false;
+}
+
+/*******************************************************************************
+ * GlobExpand
+ * Append the paths matching an expanded pattern to an argv, sorted.
+ * Each / separated part of the pattern is matched against the entries
+ * of the directories matched so far; ** matches any number of them.
+ * Names starting with . are only matched by a part that starts with one.
+ * @param const char* pattern - with quoted characters escaped
+ * @param char*** argv
+ * @param int* count
+ * @param int* cap
+ * @return the number of paths appended, -1 if error
+ ********************************************************************************/
+static int GlobExpand(const char *pattern, char ***argv, int *count, int *cap) {
+    char *copy = ArenaStrndup(pattern, strlen(pattern));
+    if (copy == NULL) return -1;
+    int component_count = 1;
+    for (const char *c = copy; *c != '\0'; c++) component_count += *c == '/';
+    char **components = ArenaAlloc(sizeof *components * component_count);
+    if (components == NULL) return -1;
+
+    // Split on runs of /, an absolute pattern starting from the root
+    char *c = copy;
+    const char *dir = "";
+    if (*c == '/') dir = "/";
+    while (*c == '/') c++;
+    component_count = 0;
+    for (;;) {
+        components[component_count++] = c;
+        char *slash = strchr(c, '/');
+        if (slash == NULL) break;
+        *slash = '\0';
+        for (c = slash + 1; *c == '/'; c++);
+    }
+
+    int first = *count;
+    if (GlobMatch(dir, components, component_count, argv, count, cap) < 0) return -1;
+    qsort(*argv + first, *count - first, sizeof **argv, CompareStrings);
+    return *count - first;
+}
+
+/*******************************************************************************
+ * GlobMatch
+ * Append the paths below dir that match the remaining parts of a pattern.
+ * A part without glob characters is taken as is and only the last one is
+ * checked for, and a part with a literal prefix only looks at the names
+ * with that prefix, found by binary search of the sorted entries.
+ * @param const char* dir - "" or ending in /
+ * @param char** components - parts of the pattern, at least one
+ * @param int component_count
+ * @param char*** argv
+ * @param int* count
+ * @param int* cap
+ * @return 0 if successful, -1 if error
+ ********************************************************************************/
+static int GlobMatch(const char *dir, char **components, int component_count, char ***argv, int *count, int *cap) {
+    const char *component = components[0];
+    bool last = component_count == 1;
+    if (last && component[0] == '\0') { // a trailing / only matches directories
+        return PushField(argv, count, cap, (char *) dir);
+    }
+
+    if (!HasGlobCharacters(component)) {
+        char *name = GlobUnescape(ArenaStrndup(component, strlen(component)));
+        char *path = name != NULL ? GlobPath(dir, name, !last) : NULL;
+        if (path == NULL) return -1;
+        struct stat st;
+        if (last) return lstat(path, &st) == 0 ? PushField(argv, count, cap, path) : 0;
+        return GlobMatch(path, components + 1, component_count - 1, argv, count, cap);
+    }
+
+    glob_dir *d = GlobReadDirectory(dir);
+    if (d == NULL) return 0; // unreadable, so nothing matches
+
+    if (strcmp(component, "**") == 0) {
+        // Zero directories, then each subdirectory, not following symbolic links
+        if (!last && GlobMatch(dir, components + 1, component_count - 1, argv, count, cap) < 0) return -1;
+        for (size_t i = 0; i < d->count; i++) {
+            if (d->entries[i].name[0] == '.') continue;
+            char *path = GlobPath(dir, d->entries[i].name, false);
+            if (path == NULL || (last && PushField(argv, count, cap, path) < 0)) return -1;
+            if (!GlobIsDirectory(path, d->entries[i].type, false)) continue;
+            char *sub = GlobPath(dir, d->entries[i].name, true);
+            if (sub == NULL || GlobMatch(sub, components, component_count, argv, count, cap) < 0) return -1;
+        }
+        return 0;
+    }
+
+    // Only names starting with the literal prefix can match
+    size_t literal_len = 0;
+    while (component[literal_len] != '\0' && strchr("*?[", component[literal_len]) == NULL) {
+        literal_len += component[literal_len] == '\\' && component[literal_len + 1] != '\0' ? 2 : 1;
+    }
+    char *prefix = ArenaStrndup(component, literal_len);
+    if (prefix == NULL) return -1;
+    size_t prefix_len = strlen(GlobUnescape(prefix));
+    size_t low = 0, high = d->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strcmp(d->entries[mid].name, prefix) < 0) low = mid + 1;
+        else high = mid;
+    }
+    for (size_t i = low; i < d->count && strncmp(d->entries[i].name, prefix, prefix_len) == 0; i++) {
+        const char *name = d->entries[i].name;
+        if (fnmatch(component, name, FNM_PERIOD) != 0) continue;
+        char *path = GlobPath(dir, name, !last);
+        if (path == NULL) return -1;
+        if (last) {
+            if (PushField(argv, count, cap, path) < 0) return -1;
+        }
+        else if (GlobIsDirectory(path, d->entries[i].type, true) &&
+                 GlobMatch(path, components + 1, component_count - 1, argv, count, cap) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * GlobPath
+ * Join a directory and a name in the line arena.
+ * @param const char* dir - "" or ending in /
+ * @param const char* name
+ * @param bool is_dir - end the path with a / to use it as a directory
+ * @return the path, NULL if out of memory
+ ********************************************************************************/
+static char *GlobPath(const char *dir, const char *name, bool is_dir) {
+    size_t dir_len = strlen(dir), name_len = strlen(name);
+    char *path = ArenaAlloc(dir_len + name_len + 2);
+    if (path == NULL) return NULL;
+    memcpy(path, dir, dir_len);
+    memcpy(path + dir_len, name, name_len);
+    if (is_dir) path[dir_len + name_len++] = '/';
+    path[dir_len + name_len] = '\0';
+    return path;
+}
+
+/*******************************************************************************
+ * GlobIsDirectory
+ * Check whether a matched entry is a directory, from its d_type when the
+ * file system gives one, so most entries need no stat.
+ * @param const char* path
+ * @param unsigned char type - d_type of the entry
+ * @param bool follow - count a symbolic link to a directory
+ * @return true if it is a directory
+ ********************************************************************************/
+static bool GlobIsDirectory(const char *path, unsigned char type, bool follow) {
+    if (type == DT_DIR) return true;
+    if (type != DT_UNKNOWN && (type != DT_LNK || !follow)) return false;
+    struct stat st;
+    return (follow ? stat(path, &st) : lstat(path, &st)) == 0 && S_ISDIR(st.st_mode);
+}
+
+/*******************************************************************************
+ * GlobReadDirectory
+ * Get the sorted entries of a directory, reading it with getdents64 a
+ * batch at a time the first time the command asks for it.
+ * @param const char* path - "" for the current directory, otherwise ending in /
+ * @return the directory, with no entries if it can't be read, NULL if out of memory
+ ********************************************************************************/
+static glob_dir *GlobReadDirectory(const char *path) {
+    if (glob_cache.buckets == NULL) {
+        glob_cache.buckets = ArenaAlloc(sizeof *glob_cache.buckets * GLOB_DIR_BUCKETS);
+        if (glob_cache.buckets == NULL) return NULL;
+        memset(glob_cache.buckets, 0, sizeof *glob_cache.buckets * GLOB_DIR_BUCKETS);
+    }
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (const char *c = path; *c != '\0'; c++) hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+    glob_dir **bucket = &glob_cache.buckets[hash % GLOB_DIR_BUCKETS];
+    for (glob_dir *d = *bucket; d != NULL; d = d->next) {
+        if (strcmp(d->path, path) == 0) return d;
+    }
+
+    glob_dir *d = ArenaAlloc(sizeof *d);
+    if (d == NULL) return NULL;
+    *d = (glob_dir) {.next = *bucket, .path = path};
+    *bucket = d;
+    int dir_fd = open(path[0] != '\0' ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) return d;
+
+    char *buf = malloc(DIRENT_BATCH);
+    size_t cap = 0;
+    ssize_t n;
+    while (buf != NULL && (n = ReadDirectoryBatch(dir_fd, buf, DIRENT_BATCH)) > 0) {
+        for (ssize_t offset = 0; offset < n;) {
+            dirent64_record *entry = (dirent64_record *) (buf + offset);
+            offset += entry->reclen;
+            const char *name = entry->name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+            if (d->count == cap) {
+                cap = cap ? cap * 2 : 64;
+                glob_entry *grown = ArenaAlloc(sizeof *grown * cap);
+                if (grown == NULL) break;
+                if (d->count > 0) memcpy(grown, d->entries, sizeof *grown * d->count);
+                d->entries = grown;
+            }
+            char *copy = ArenaStrndup(name, strlen(name));
+            if (copy == NULL) break;
+            d->entries[d->count++] = (glob_entry) {copy, entry->type};
+        }
+    }
+    free(buf);
+    close(dir_fd);
+    if (d->count > 1) qsort(d->entries, d->count, sizeof *d->entries, GlobCompareEntries);
+    return d;
+}
+
+/*******************************************************************************
+ * GlobCompareEntries
+ * qsort comparison for directory entries, by name.
+ ********************************************************************************/
+static int GlobCompareEntries(const void *a, const void *b) {
+    return strcmp(((const glob_entry *) a)->name, ((const glob_entry *) b)->name);
+}
+
+/*******************************************************************************
+ * GlobUnescape
+ * Remove the backslash escapes from a pattern in place.
+ * @param char* pattern - may be NULL
+ * @return the pattern
+ ********************************************************************************/
+static char *GlobUnescape(char *pattern) {
+    if (pattern == NULL) return NULL;
+    char *out = pattern;
+    for (const char *p = pattern; *p != '\0'; p++) {
+        if (*p == '\\' && p[1] != '\0') p++;
+        *out++ = *p;
+    }
+    *out = '\0';
+    return pattern;
+}
+
+/*******************************************************************************
+ * LookupVariable
+ * Look up an environment variable by a name that is not NUL terminated.
+ * $SMALLSH_REAL, $SMALLSH_RSS and the like come from the last job,
+ * and a number is a positional parameter.
+ * @param const char* name
+ * @param size_t name_len
+ * @return the value, "" if unset, NULL if the name is not valid
+ ********************************************************************************/
+static const char *LookupVariable(const char *name, size_t name_len) {
+    if (name_len > 0 && name_len < 10 && strspn(name, "0123456789") >= name_len) {
+        return PositionalParameter(strtol(name, NULL, 10));
+    }
+    if (!IsName(name, name_len)) return NULL;
+    if (name_len > 8 && memcmp(name, "SMALLSH_", 8) == 0) {
+        const char *usage = UsageVariable(name + 8, name_len - 8);
+        if (usage != NULL) return usage;
+    }
+    char small_name[64];
+    char *key = name_len < sizeof small_name ? small_name : malloc(name_len + 1);
+    if (key == NULL) return NULL;
+    memcpy(key, name, name_len);
+    key[name_len] = '\0';
+    const char *value = getenv(key);
+    if (key != small_name) free(key);
+    return value != NULL ? value : "";
+}
+
+/*******************************************************************************
+ * IsName
+ * Check that a name, not NUL terminated, is a valid variable name.
+ * @param const char* name
+ * @param size_t name_len
+ * @return true if it is
+ ********************************************************************************/
+static bool IsName(const char *name, size_t name_len) {
+    if (name_len == 0 || !(isalpha((unsigned char) name[0]) || name[0] == '_')) return false;
+    for (size_t i = 1; i < name_len; i++) {
+        if (!(isalnum((unsigned char) name[i]) || name[i] == '_')) return false;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ * ParseCommands
+ * Parse the commands in cmd.command_array into pipeline stages and handle
+ * redirection and background processes
+ * @param command* cmd
+ * @return 0 if successful, -1 if error
+ ********************************************************************************/
+static int ParseCommands(command *cmd) {
+
+    // Prefixes: time reports the resource usage of the rest of the line,
+    // limit runs it in a cgroup with resource limits
+    while (cmd->line_count > 0) {
+        if (strcmp(cmd->command_array[0], "time") == 0) {
+            cmd->is_timed = 1;
+            cmd->command_array++;
+            cmd->line_count--;
+        }
+        else if (strcmp(cmd->command_array[0], "limit") == 0) {
+            if (ParseLimits(cmd) < 0) return -1;
+        }
+        else break;
+    }
+    if (cmd->line_count == 0) return 0;
+    ssize_t i = cmd->line_count; // i is the index of the last valid token
+    // Parse background indicator
+    if (cmd->command_array[i - 1] != NULL && strcmp(cmd->command_array[i - 1], "&") == 0) {
+        cmd->is_background = 1;
+        cmd->command_array[i - 1] = NULL;
+        i--;
+        cmd->line_count--;
+    }
+    if (i == 0) return 0;
+
+    // Split the line into stages at each "|", each stage keeps its own redirection
+    int stage_capacity = 1;
+    for (ssize_t j = 0; j < i; j++) {
+        if (strcmp(cmd->command_array[j], "|") == 0) stage_capacity++;
+    }
+    cmd->stages = ArenaAlloc(sizeof *cmd->stages * stage_capacity);
+    if (cmd->stages == NULL) return -1;
+    ssize_t start = 0;
+    for (ssize_t j = 0; j <= i; j++) {
+        if (j < i && strcmp(cmd->command_array[j], "|") != 0) continue;
+        if (j < i) cmd->command_array[j] = NULL;
+        ParseRedirections(&cmd->stages[cmd->stage_count], cmd->command_array + start, j - start);
+        cmd->stage_count++;
+        start = j + 1;
+    }
+
+    // Every stage of a pipeline needs a command word
+    if (cmd->stage_count > 1) {
+        for (int j = 0; j < cmd->stage_count; j++) {
+            if (cmd->stages[j].argv[0] == NULL) {
+                fprintf(stderr, "smallsh: syntax error near unexpected token `|'\n");
+                dollar_question = 2;
+                cmd->stage_count = 0;
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * ParseRedirections
+ * Fill in one pipeline stage from its tokens, taking a trailing "< file"
+ * and/or "> file" off the end of its argument list
+ * @param stage* st
+ * @param char** argv - the stage's tokens, NULL terminated
+ * @param ssize_t argc - the number of tokens
+ ********************************************************************************/
+static void ParseRedirections(stage *st, char **argv, ssize_t argc) {
+    st->argv = argv;
+    st->is_input_redirection = 0;
+    st->is_output_redirection = 0;
+    st->in_file_name = NULL;
+    st->out_file_name = NULL;
+    st->group = NULL;
+
+    // Need to loop through these options twice to make sure either order works
+    for (int j = 0; j < 2 && argc >= 2; j++) {
+        // Check for input redirection
+        if (st->is_input_redirection == 0 && strcmp(argv[argc - 2], "<") == 0) { // Only set infile once
+            st->in_file_name = argv[argc - 1];
+            argv[argc - 2] = NULL;
+            argv[argc - 1] = NULL;
+            argc -= 2;
+            st->is_input_redirection = 1;
+        }
+        if (argc < 2) break;
+        // Check for output redirection
+        if (st->is_output_redirection == 0 && strcmp(argv[argc - 2], ">") == 0) { // Only set outfile once
+            st->out_file_name = argv[argc - 1];
+            argv[argc - 2] = NULL;
+            argv[argc - 1] = NULL;
+            argc -= 2;
+            st->is_output_redirection = 1;
+        }
+    }
+}
+
+/*******************************************************************************
+ * ParseLimits
+ * Take the limit prefix and its options off the front of the line:
+ * limit [-m bytes] [-c percent] [-p count] [--] command...
+ * Memory takes a K, M, G or T suffix and CPU is a percentage of one CPU,
+ * more than 100 for several. Each also takes max for no limit.
+ * @param command* cmd
+ * @return 0 if successful, -1 if error
+ ********************************************************************************/
+static int ParseLimits(command *cmd) {
+    job_limits *limits = cmd->limits;
+    if (limits == NULL) {
+        limits = ArenaAlloc(sizeof *limits);
+        if (limits == NULL) return -1;
+        *limits = (job_limits) {0};
+    }
+    int i = 1;
+    for (; i < cmd->line_count && cmd->command_array[i][0] == '-'; i++) {
+        const char *option = cmd->command_array[i];
+        if (strcmp(option, "--") == 0) {
+            i++;
+            break;
+        }
+        if (strlen(option) != 2 || strchr("mcp", option[1]) == NULL || i + 1 >= cmd->line_count) {
+            fprintf(stderr, "smallsh: limit: usage: limit [-m bytes] [-c percent] [-p count] command...\n");
+            goto error;
+        }
+        const char *value = cmd->command_array[++i];
+        char *end, text[64];
+        if (strcmp(value, "max") == 0) {
+            snprintf(text, sizeof text, option[1] == 'c' ? "max 100000" : "max");
+        }
+        else if (option[1] == 'c') {
+            // cpu.max is a quota per period, 1% of a CPU is 1000us per 100000us
+            double percent = strtod(value, &end);
+            if (end == value || (*end != '\0' && strcmp(end, "%") != 0) || percent < 1) goto invalid;
+            snprintf(text, sizeof text, "%.0f 100000", percent * 1000);
+        }
+        else {
+            errno = 0;
+            unsigned long long number = strtoull(value, &end, 10);
+            int shift = 0;
+            if (option[1] == 'm' && *end != '\0' && end[1] == '\0') {
+                const char *suffix = strchr("KMGT", toupper((unsigned char) *end));
+                if (suffix != NULL) {
+                    shift = 10 * (suffix - "KMGT" + 1);
+                    end++;
+                }
+            }
+            if (end == value || *end != '\0' || errno != 0 || !isdigit((unsigned char) value[0]) ||
+                number > (ULLONG_MAX >> shift)) {
+                goto invalid;
+            }
+            snprintf(text, sizeof text, "%llu", number << shift);
+        }
+        const char *copy = ArenaStrndup(text, strlen(text));
+        if (copy == NULL) return -1;
+        if (option[1] == 'm') limits->memory_max = copy;
+        else if (option[1] == 'c') limits->cpu_max = copy;
+        else limits->pids_max = copy;
+        continue;
+
+        invalid:
+        fprintf(stderr, "smallsh: limit: %s: invalid limit `%s'\n", option, value);
+        goto error;
+    }
+    cmd->limits = limits;
+    cmd->command_array += i;
+    cmd->line_count -= i;
+    return 0;
+
+    error:
+    dollar_question = 2;
+    return -1;
+}
+
+/*********************************************************************
+ * ExecuteCommands
+ * Execute the commands stored in cmd.command_array.
+ * Built-in commands are looked up in the builtins table and run inside
+ * the shell.
+ * Supports non-built in commands, pipelines, and background processes.
+ * Handles redirection. A line with the time prefix has its resource
+ * usage printed to stderr once it finishes.
+ * @param command* cmd
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int ExecuteCommands(command *cmd) {
+
+    int err_status = 0;
+    bool job_finished = false;
+
+    // A timed built-in only has the shell's own usage to report
+    struct timespec time_start;
+    struct rusage self_start;
+    if (cmd->is_timed) {
+        clock_gettime(CLOCK_MONOTONIC, &time_start);
+        getrusage(RUSAGE_SELF, &self_start);
+    }
+
+    // Built in commands
+    // Only a single stage can be empty: ExpandVariables fills pipeline stages
+    if (cmd->stage_count == 0 || cmd->command_array[0] == NULL) goto exit;
+
+    // Built-in commands and functions run inside the shell unless they are
+    // part of a pipeline, in the background or limited, which LaunchCommand forks for
+    if (cmd->stage_count == 1 && cmd->is_background == 0 && cmd->limits == NULL) {
+        const builtin *b = FindStageCommand(&cmd->stages[0]);
+        if (b != NULL) {
+            err_status = RunBuiltin(b, cmd);
+            job_finished = b->runs_jobs && err_status == 0;
+            goto exit;
+        }
+    }
+
+    // Non-Built-in commands
+    // Launch every stage, joined by close-on-exec pipes. File redirection
+    // is handed straight to the stage, so no data passes through the shell.
+    job *jb = NewJob(cmd);
+    if (jb == NULL) {
+        err_status = -1;
+        goto exit;
+    }
+    // Without a usable cgroup the job still runs, just without its limits
+    if (cmd->limits != NULL) CgroupCreate(jb, cmd->limits);
+    // A placed background job's processes inherit its CPUs from the shell
+    cpu_set_t shell_cpus;
+    bool placed = cmd->is_background && PlaceJob(jb, cmd->stage_count, &shell_cpus);
+    int in_fd = -1;
+    for (int i = 0; i < cmd->stage_count; i++) {
+        int pipe_fds[2] = {-1, -1};
+        if (i < cmd->stage_count - 1 && pipe2(pipe_fds, O_CLOEXEC) == -1) {
+            perror("pipe2()");
+            err_status = -1;
+            break;
+        }
+        // With job control the first stage starts a new process group and the rest join it
+        pid_t spawn_pid = LaunchCommand(&cmd->stages[i], in_fd, pipe_fds[1], job_control ? jb->pgid : -1);
+        if (spawn_pid == -1) err_status = -1;
+        AddJobProcess(jb, spawn_pid);
+        if (in_fd != -1) close(in_fd);
+        if (pipe_fds[1] != -1) close(pipe_fds[1]);
+        in_fd = pipe_fds[0];
+    }
+    if (in_fd != -1) close(in_fd);
+    if (launch_cgroup_fd != -1) {
+        close(launch_cgroup_fd);
+        launch_cgroup_fd = -1;
+    }
+    if (placed) sched_setaffinity(0, sizeof shell_cpus, &shell_cpus);
+    // Nothing was started if the first pipe couldn't be made
+    if (jb->proc_count == 0) {
+        RemoveJob(jb);
+        goto exit;
+    }
+
+    // If not background, wait for every stage's termination
+    if (cmd->is_background == 0){
+        uint64_t trace_start = TraceStart();
+        job_finished = WaitForJob(jb, true) == 0;
+        TraceEnd(TRACE_WAIT, trace_start);
+    }
+    else {
+        pid_t last_pid = jb->procs[jb->proc_count - 1].pid;
+        if (last_pid != -1) snprintf(dollar_exclamation, sizeof dollar_exclamation, "%jd", (intmax_t) last_pid);
+        if (jb->live_count == 0) RemoveJob(jb);
+    }
+    exit:
+    if (cmd->is_timed && !cmd->is_background) {
+        if (job_finished) PrintUsage(&last_usage);
+        else {
+            struct timespec time_end;
+            struct rusage self_end;
+            clock_gettime(CLOCK_MONOTONIC, &time_end);
+            getrusage(RUSAGE_SELF, &self_end);
+            resource_usage usage = {
+                .real = (time_end.tv_sec - time_start.tv_sec) + (time_end.tv_nsec - time_start.tv_nsec) / 1e9,
+                .user = (self_end.ru_utime.tv_sec - self_start.ru_utime.tv_sec)
+                        + (self_end.ru_utime.tv_usec - self_start.ru_utime.tv_usec) / 1e6,
+                .sys = (self_end.ru_stime.tv_sec - self_start.ru_stime.tv_sec)
+                       + (self_end.ru_stime.tv_usec - self_start.ru_stime.tv_usec) / 1e6,
+                .max_rss = self_end.ru_maxrss,
+                .major_faults = self_end.ru_majflt - self_start.ru_majflt,
+                .minor_faults = self_end.ru_minflt - self_start.ru_minflt,
+            };
+            PrintUsage(&usage);
+        }
+    }
+    return err_status;
+}
+
+/*********************************************************************
+ * LaunchCommand
+ * Start one pipeline stage as a child process.
+ * The posix_spawn engine is used unless SMALLSH_SPAWN=fork selects the
+ * fork engine, or the command needs something posix_spawn can't express:
+ * a built-in or function in a pipeline or the background runs in a forked child, and
+ * a limited job's processes join its cgroup from the child before exec.
+ * @param stage* st
+ * @param int in_fd - pipe to read stdin from, -1 to inherit
+ * @param int out_fd - pipe to write stdout to, -1 to inherit
+ * @param pid_t pgid - process group to join, 0 for a new one, -1 for smallsh's
+ * @return: PID of the child, -1 if error
+ *********************************************************************/
+static pid_t LaunchCommand(stage *st, int in_fd, int out_fd, pid_t pgid) {
+    if (spawn_engine == SPAWN_ENGINE_FORK || launch_cgroup_fd != -1 || FindStageCommand(st) != NULL) {
+        return ForkCommand(st, in_fd, out_fd, pgid);
+    }
+    return SpawnCommand(st, in_fd, out_fd, pgid);
+}
+
+/*********************************************************************
+ * SpawnCommand
+ * Launch a command with posix_spawn. glibc implements it with
+ * clone(CLONE_VM|CLONE_VFORK), so the shell's page tables are never
+ * copied. Redirection files are opened here in the parent so errors are
+ * reported exactly like the fork engine does, then handed to the child
+ * as dup2 file actions. A file redirection takes precedence over a pipe.
+ * Signal dispositions, the signal mask and the process group are set
+ * through the spawn attributes.
+ * @param stage* st
+ * @param int in_fd - pipe to read stdin from, -1 to inherit
+ * @param int out_fd - pipe to write stdout to, -1 to inherit
+ * @param pid_t pgid - process group to join, 0 for a new one, -1 for smallsh's
+ * @return: PID of the child, -1 if error
+ *********************************************************************/
+static pid_t SpawnCommand(stage *st, int in_fd, int out_fd, pid_t pgid) {
+    pid_t spawn_pid = -1;
+    int source_file = -1, target_file = -1;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t no_signals;
+
+    // File input
+    if (st->is_input_redirection == 1) {
+        source_file = open(st->in_file_name, O_RDONLY | O_CLOEXEC);
+        if (source_file == -1) {
+            fprintf(stderr, "open() failed on \"%s\"\n", st->in_file_name);
+            goto exit;
+        }
+        in_fd = source_file;
+    }
+    // File output
+    if (st->is_output_redirection == 1) {
+        target_file = open(st->out_file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0777);
+        if (target_file == -1) {
+            perror("target open()");
+            goto exit;
+        }
+        out_fd = target_file;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != -1) posix_spawn_file_actions_adddup2(&actions, in_fd, 0);
+    if (out_fd != -1) posix_spawn_file_actions_adddup2(&actions, out_fd, 1);
+
+    // All signals shall be reset to their original actions when smallsh was invoked.
+    posix_spawnattr_init(&attr);
+    sigemptyset(&no_signals);
+    posix_spawnattr_setsigdefault(&attr, &child_default_signals);
+    posix_spawnattr_setsigmask(&attr, &no_signals);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    if (pgid != -1) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    // Spawn the cached location; a stale entry is dropped and resolved once more
+    int result = ENOENT;
+    uint64_t trace_start = TraceStart();
+    for (int attempt = 0; attempt < 2 && result == ENOENT; attempt++) {
+        const char *path = HashLookup(st->argv[0]);
+        if (path == NULL) break;
+        result = posix_spawn(&spawn_pid, path, &actions, &attr, st->argv, environ);
+        if (result == ENOENT) HashForget(st->argv[0]);
+    }
+    TraceEnd(TRACE_SPAWN, trace_start);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (result != 0) {
+        errno = result;
+        perror("execve");
+        spawn_pid = -1;
+    }
+    exit:
+    if (source_file != -1) close(source_file);
+    if (target_file != -1) close(target_file);
+    return spawn_pid;
+}
+
+/*********************************************************************
+ * ForkCommand
+ * Launch a command with fork() and execv() of the cached location.
+ * Pipes, redirection and signal resets are set up in the child before
+ * exec. A file redirection takes precedence over a pipe.
+ * @param stage* st
+ * @param int in_fd - pipe to read stdin from, -1 to inherit
+ * @param int out_fd - pipe to write stdout to, -1 to inherit
+ * @param pid_t pgid - process group to join, 0 for a new one, -1 for smallsh's
+ * @return: PID of the child, -1 if error
+ *********************************************************************/
+static pid_t ForkCommand(stage *st, int in_fd, int out_fd, pid_t pgid) {
+    // Resolve the command in the parent so the location stays cached. A
+    // stale entry is dropped here, as SpawnCommand does, or every later
+    // child would fail the exec and walk PATH again.
+    const builtin *b = FindStageCommand(st);
+    const char *path = b == NULL ? HashLookup(st->argv[0]) : NULL;
+    if (path != NULL && access(path, X_OK) == -1 && errno == ENOENT) {
+        HashForget(st->argv[0]);
+        path = HashLookup(st->argv[0]);
+    }
+
+    // Fork a new process
+    fflush(stdout);
+    uint64_t trace_start = TraceStart();
+    pid_t spawn_pid = fork();
+    switch(spawn_pid){
+        case -1:
+            perror("fork()\n");
+            break;
+        case 0:
+            // This runs in the child process.
+            trace_start = TraceStart(); // the child's setup, until exec
+
+            // All signals shall be reset to their original actions when smallsh was invoked.
+            for (int sig = 1; sig < NSIG; sig++) {
+                if (sigismember(&child_default_signals, sig) == 1) sigaction(sig, &default_action, NULL);
+            }
+            sigset_t no_signals;
+            sigemptyset(&no_signals);
+            sigprocmask(SIG_SETMASK, &no_signals, NULL);
+            if (pgid != -1) setpgid(0, pgid);
+
+            // Join the job's cgroup so its limits apply from exec on
+            if (launch_cgroup_fd != -1 && write(launch_cgroup_fd, "0", 1) == -1) {
+                perror("smallsh: limit: cgroup.procs");
+            }
+
+            // Pipeline input and output, the pipe fds themselves are close-on-exec
+            if (in_fd != -1 && dup2(in_fd, 0) == -1) {
+                perror("source dup2()");
+                exit(-1);
+            }
+            if (out_fd != -1 && dup2(out_fd, 1) == -1) {
+                perror("target dup2()");
+                exit(-1);
+            }
+
+            // A built-in or function runs here and its status is the child's. Like a
+            // subshell, it has no jobs of its own and no prompt.
+            if (b != NULL) {
+                job_table = NULL;
+                job_table_size = 0;
+                interactive = false;
+                job_control = false;
+                // Built-ins that run jobs wait for them on signal_fd
+                sigset_t child_signals;
+                sigemptyset(&child_signals);
+                sigaddset(&child_signals, SIGCHLD);
+                sigprocmask(SIG_BLOCK, &child_signals, NULL);
+                command child = {.command_array = st->argv, .stages = st, .stage_count = 1};
+                RunBuiltin(b, &child);
+                exit(dollar_question);
+            }
+
+            // File input
+            if (st->is_input_redirection == 1){
+                // Open source file
+                int source_file = open(st->in_file_name, O_RDONLY);
+                if (source_file == -1){
+                    fprintf(stderr, "open() failed on \"%s\"\n", st->in_file_name);
+                    exit(-1);
+                }
+                // Redirect stdin to source file
+                int result = dup2(source_file , 0);
+                if (result == -1) {
+                    perror("source dup2()");
+                    exit(-1);
+                }
+                //Close source file
+                fcntl(source_file, F_SETFD, FD_CLOEXEC);
+            }
+
+            // File output
+            if (st->is_output_redirection == 1) {
+                // Open target file
+                int target_file = open(st->out_file_name, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+                if (target_file == -1) {
+                    perror("target open()");
+                    exit(-1);
+                }
+                // Redirect stdout to target file
+                int result = dup2(target_file, 1);
+                if (result == -1) {
+                    perror("target dup2()");
+                    exit(-1);
+                }
+            }
+
+            // Replace the current process image with a new process image,
+            // walking PATH again only if the cached location has gone away
+            TraceEnd(TRACE_SETUP, trace_start);
+            if (path != NULL) execv(path, st->argv);
+            if (path == NULL || errno == ENOENT) execvp(st->argv[0], st->argv);
+
+            // exec only returns if there is an error
+            perror("execve");
+            exit(-1);
+        default:
+            TraceEnd(TRACE_FORK, trace_start);
+            // Also set the group here so it exists before the parent relies on it
+            if (pgid != -1) setpgid(spawn_pid, pgid == 0 ? spawn_pid : pgid);
+            break;
+    }
+    return spawn_pid;
+}
+
+/*********************************************************************
+ * FindBuiltin()
+ * Look up a built-in command in the builtins table.
+ * @param const char* name - command word, may be NULL
+ * @return: the built-in, NULL if name is not one
+ *********************************************************************/
+static const builtin *FindBuiltin(const char *name){
+    if (name == NULL) return NULL;
+    size_t low = 0, high = sizeof builtins / sizeof builtins[0];
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        int order = strcmp(name, builtins[mid].name);
+        if (order == 0) return &builtins[mid];
+        if (order < 0) high = mid;
+        else low = mid + 1;
+    }
+    return NULL;
+}
+
+/*********************************************************************
+ * FindCommand()
+ * Look up a command that runs inside the shell: a function, or else a
+ * built-in.
+ * @param const char* name - command word, may be NULL
+ * @return: function_builtin, the built-in, or NULL if it is neither
+ *********************************************************************/
+static const builtin *FindCommand(const char *name){
+    if (function_count > 0 && FindFunction(name) != NULL) return &function_builtin;
+    return FindBuiltin(name);
+}
+
+/*********************************************************************
+ * FindStageCommand()
+ * Look up what runs a pipeline stage inside the shell: group_builtin
+ * for a compound command, otherwise as FindCommand.
+ * @param stage* st
+ * @return: the built-in, or NULL if the stage is an external command
+ *********************************************************************/
+static const builtin *FindStageCommand(stage *st){
+    if (st->group != NULL) return &group_builtin;
+    return FindCommand(st->argv[0]);
+}
+
+/*********************************************************************
+ * RunBuiltin()
+ * Run a built-in command inside the shell. Its < and > redirections
+ * are applied to the shell's own stdin and stdout, which are saved
+ * first and put back afterwards. Sets $? like an external command:
+ * built-ins that don't set it themselves give 1 on error and 0 if not,
+ * and any built-in whose output could not be written gives 1.
+ * @param const builtin* b
+ * @param command* cmd
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int RunBuiltin(const builtin *b, command *cmd){
+    int err_status = 0;
+    stage *st = &cmd->stages[0];
+    int saved_in = -1, saved_out = -1;
+
+    // File input
+    if (st->is_input_redirection == 1) {
+        int source_file = open(st->in_file_name, O_RDONLY | O_CLOEXEC);
+        if (source_file == -1) {
+            fprintf(stderr, "open() failed on \"%s\"\n", st->in_file_name);
+            err_status = -1;
+            goto exit;
+        }
+        saved_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(source_file, STDIN_FILENO);
+        close(source_file);
+    }
+    // File output
+    if (st->is_output_redirection == 1) {
+        int target_file = open(st->out_file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0777);
+        if (target_file == -1) {
+            perror("target open()");
+            err_status = -1;
+            goto exit;
+        }
+        fflush(stdout);
+        saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(target_file, STDOUT_FILENO);
+        close(target_file);
+    }
+
+    clearerr(stdout);
+    err_status = b->run(cmd) < 0 ? -1 : 0;
+    // Output that could not be written fails the command, as it would an external one
+    if (fflush(stdout) == EOF || ferror(stdout)) {
+        fprintf(stderr, "smallsh: %s: write error: %s\n", cmd->command_array[0], strerror(errno));
+        clearerr(stdout);
+        err_status = -1;
+        goto exit;
+    }
+    if (b->sets_status) goto restore;
+
+    exit:
+    dollar_question = err_status < 0 ? 1 : 0;
+    restore:
+    if (saved_in != -1) {
+        dup2(saved_in, STDIN_FILENO);
+        close(saved_in);
+    }
+    if (saved_out != -1) {
+        dup2(saved_out, STDOUT_FILENO);
+        close(saved_out);
+    }
+    return err_status;
+}
+
+/*********************************************************************
+ * TrueCommand()
+ * Handles true command.
+ * @param cmd: command struct
+ * @return: 0
+ *********************************************************************/
+static int TrueCommand(command *cmd){
+    (void) cmd;
+    return 0;
+}
+
+/*********************************************************************
+ * FalseCommand()
+ * Handles false command.
+ * @param cmd: command struct
+ * @return: -1, so $? is 1
+ *********************************************************************/
+static int FalseCommand(command *cmd){
+    (void) cmd;
+    return -1;
+}
+
+/*********************************************************************
+ * PrintEscape()
+ * Print the character a backslash escape stands for, as echo -e and
+ * printf do: \a \b \f \n \r \t \v \\, and \NNN or \0NNN in octal.
+ * An unknown escape is printed as it is.
+ * @param const char* p - the backslash
+ * @param bool* stop - set if the escape is \c, which ends all output
+ * @return: pointer to the last character of the escape
+ *********************************************************************/
+static const char *PrintEscape(const char *p, bool *stop){
+    const char *codes = "a\ab\bf\fn\nr\rt\tv\v\\\\";
+    p++;
+    if (*p == '\0') {
+        putchar('\\');
+        return p - 1;
+    }
+    if (*p == 'c') {
+        *stop = true;
+        return p;
+    }
+    if (*p >= '0' && *p <= '7') {
+        if (*p == '0') p++;
+        int value = 0, digits = 0;
+        for (; digits < 3 && *p >= '0' && *p <= '7'; digits++, p++) value = value * 8 + (*p - '0');
+        putchar(value);
+        return p - 1;
+    }
+    for (const char *code = codes; *code != '\0'; code += 2) {
+        if (*code == *p) {
+            putchar(code[1]);
+            return p;
+        }
+    }
+    putchar('\\');
+    putchar(*p);
+    return p;
+}
+
+/*********************************************************************
+ * EchoCommand()
+ * Handles echo command: echo [-neE] [args...]
+ * Prints the arguments separated by spaces. -n leaves off the newline,
+ * -e interprets backslash escapes and -E turns them off again.
+ * @param cmd: command struct
+ * @return: 0
+ *********************************************************************/
+static int EchoCommand(command *cmd){
+    char **argv = cmd->command_array;
+    bool newline = true, escapes = false, stop = false;
+    int i = 1;
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1)) break; // not an option
+        for (const char *p = argv[i] + 1; *p != '\0'; p++) {
+            if (*p == 'n') newline = false;
+            else escapes = *p == 'e';
+        }
+    }
+    for (int first = i; argv[i] != NULL && !stop; i++) {
+        if (i > first) putchar(' ');
+        if (!escapes) {
+            fputs(argv[i], stdout);
+            continue;
+        }
+        for (const char *p = argv[i]; *p != '\0' && !stop; p++) {
+            if (*p == '\\') p = PrintEscape(p, &stop);
+            else putchar(*p);
+        }
+    }
+    if (newline && !stop) putchar('\n');
+    return 0;
+}
+
+/*********************************************************************
+ * PrintWorkingDirectory()
+ * Handles pwd command.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int PrintWorkingDirectory(command *cmd){
+    (void) cmd;
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        perror("smallsh: pwd");
+        return -1;
+    }
+    puts(cwd);
+    free(cwd);
+    return 0;
+}
+
+/*********************************************************************
+ * PrintfCommand()
+ * Handles printf command: printf format [args...]
+ * Supports the %d %i %o %u %x %X %c %s %b %f %e %g %E %G %% conversions
+ * with flags, width and precision, and backslash escapes in the format.
+ * The format is reused while arguments are left.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int PrintfCommand(command *cmd){
+    int err_status = 0;
+    char **argv = cmd->command_array;
+    if (argv[1] == NULL) {
+        fprintf(stderr, "smallsh: printf: usage: printf format [arguments]\n");
+        return -1;
+    }
+    const char *format = argv[1];
+    char **args = argv + 2;
+    bool stop = false;
+    do {
+        char **start = args;
+        for (const char *p = format; *p != '\0' && !stop; p++) {
+            if (*p == '\\') {
+                p = PrintEscape(p, &stop);
+                continue;
+            }
+            if (*p != '%') {
+                putchar(*p);
+                continue;
+            }
+            if (p[1] == '%') {
+                putchar('%');
+                p++;
+                continue;
+            }
+
+            // Copy the conversion's flags, width and precision into a format for printf
+            char spec[32] = "%";
+            size_t spec_len = 1 + strspn(p + 1, "-+ #0");
+            spec_len += strspn(p + spec_len, "0123456789");
+            if (p[spec_len] == '.') spec_len += 1 + strspn(p + spec_len + 1, "0123456789");
+            char conversion = p[spec_len];
+            if (conversion == '\0' || strchr("diouxXcsbfeEgG", conversion) == NULL || spec_len + 3 > sizeof spec) {
+                fprintf(stderr, "smallsh: printf: %.*s: invalid format\n", (int) spec_len + 1, p);
+                return -1;
+            }
+            memcpy(spec + 1, p + 1, spec_len - 1);
+            p += spec_len;
+            const char *arg = *args != NULL ? *args++ : NULL;
+            char *end = NULL;
+
+            if (conversion == 'd' || conversion == 'i') {
+                strcpy(spec + spec_len, "lld");
+                long long value = arg != NULL ? strtoll(arg, &end, 0) : 0;
+                printf(spec, value);
+            }
+            else if (strchr("ouxX", conversion) != NULL) {
+                spec[spec_len] = 'l';
+                spec[spec_len + 1] = 'l';
+                spec[spec_len + 2] = conversion;
+                unsigned long long value = arg != NULL ? strtoull(arg, &end, 0) : 0;
+                printf(spec, value);
+            }
+            else if (strchr("feEgG", conversion) != NULL) {
+                spec[spec_len] = conversion;
+                double value = arg != NULL ? strtod(arg, &end) : 0;
+                printf(spec, value);
+            }
+            else if (conversion == 'c') {
+                spec[spec_len] = 'c';
+                printf(spec, arg != NULL ? arg[0] : '\0');
+            }
+            else if (conversion == 's') {
+                spec[spec_len] = 's';
+                printf(spec, arg != NULL ? arg : "");
+            }
+            else { // %b, the argument's escapes are interpreted
+                for (const char *q = arg != NULL ? arg : ""; *q != '\0' && !stop; q++) {
+                    if (*q == '\\') q = PrintEscape(q, &stop);
+                    else putchar(*q);
+                }
+            }
+            if (end != NULL && (end == arg || *end != '\0')) {
+                fprintf(stderr, "smallsh: printf: %s: invalid number\n", arg);
+                err_status = -1;
+            }
+        }
+        if (args == start) break; // format used no arguments
+    } while (*args != NULL && !stop);
+    return err_status;
+}
+
+/*********************************************************************
+ * TestCommand()
+ * Handles test and [ commands, following the POSIX rules for how
+ * many arguments there are. Sets $? to 0 if the expression is true,
+ * 1 if it is false and 2 if it is not valid.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int TestCommand(command *cmd){
+    char **argv = cmd->command_array;
+    int argc = 0;
+    while (argv[argc] != NULL) argc++;
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "smallsh: [: missing `]'\n");
+            dollar_question = 2;
+            return -1;
+        }
+        argc--;
+    }
+    dollar_question = TestExpression(argv + 1, argc - 1);
+    return dollar_question == 2 ? -1 : 0;
+}
+
+/*********************************************************************
+ * TestExpression()
+ * Evaluate the arguments of test.
+ * @param char** args
+ * @param int count - number of arguments, at most 4
+ * @return: 0 if true, 1 if false, 2 if not valid
+ *********************************************************************/
+static int TestExpression(char **args, int count){
+    const char *binary_ops[] = {"=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    switch (count) {
+        case 0:
+            return 1;
+        case 1:
+            return args[0][0] == '\0';
+        case 2: {
+            if (strcmp(args[0], "!") == 0) return TestExpression(args + 1, 1) == 0;
+            const char *op = args[0], *operand = args[1];
+            struct stat st;
+            if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') break;
+            switch (op[1]) {
+                case 'z': return operand[0] != '\0';
+                case 'n': return operand[0] == '\0';
+                case 'e': return stat(operand, &st) != 0;
+                case 'f': return stat(operand, &st) != 0 || !S_ISREG(st.st_mode);
+                case 'd': return stat(operand, &st) != 0 || !S_ISDIR(st.st_mode);
+                case 'p': return stat(operand, &st) != 0 || !S_ISFIFO(st.st_mode);
+                case 's': return stat(operand, &st) != 0 || st.st_size == 0;
+                case 'L':
+                case 'h': return lstat(operand, &st) != 0 || !S_ISLNK(st.st_mode);
+                case 'r': return access(operand, R_OK) != 0;
+                case 'w': return access(operand, W_OK) != 0;
+                case 'x': return access(operand, X_OK) != 0;
+                case 't': return !isatty(atoi(operand));
+            }
+            break;
+        }
+        case 3: {
+            int op = -1;
+            for (int i = 0; i < (int) (sizeof binary_ops / sizeof binary_ops[0]); i++) {
+                if (strcmp(args[1], binary_ops[i]) == 0) op = i;
+            }
+            if (op == -1) {
+                if (strcmp(args[0], "!") == 0) {
+                    int result = TestExpression(args + 1, 2);
+                    return result == 2 ? 2 : !result;
+                }
+                if (strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0) return TestExpression(args + 1, 1);
+                break;
+            }
+            if (op <= 2) return (strcmp(args[0], args[2]) == 0) == (op == 2);
+            // Integer comparison
+            long long values[2];
+            for (int i = 0; i < 2; i++) {
+                const char *operand = args[i * 2];
+                char *end;
+                values[i] = strtoll(operand, &end, 10);
+                if (end == operand || *end != '\0') {
+                    fprintf(stderr, "smallsh: test: %s: integer expression expected\n", operand);
+                    return 2;
+                }
+            }
+            bool result[] = {values[0] == values[1], values[0] != values[1], values[0] < values[1],
+                             values[0] <= values[1], values[0] > values[1], values[0] >= values[1]};
+            return !result[op - 3];
+        }
+        case 4:
+            if (strcmp(args[0], "!") == 0) {
+                int result = TestExpression(args + 1, 3);
+                return result == 2 ? 2 : !result;
+            }
+            if (strcmp(args[0], "(") == 0 && strcmp(args[3], ")") == 0) return TestExpression(args + 1, 2);
+            break;
+    }
+    fprintf(stderr, "smallsh: test: %s: unexpected operator\n", count > 1 ? args[count > 2 ? 1 : 0] : "");
+    return 2;
+}
+
+/*********************************************************************
+ * ExportCommand()
+ * Handles export command: export [name[=value]...]
+ * Sets environment variables, which is where smallsh keeps its
+ * variables. With no arguments, lists the environment.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int ExportCommand(command *cmd){
+    int err_status = 0;
+    if (cmd->command_array[1] == NULL) {
+        for (char **var = environ; *var != NULL; var++) printf("export %s\n", *var);
+        return 0;
+    }
+    for (int i = 1; cmd->command_array[i] != NULL; i++) {
+        const char *arg = cmd->command_array[i];
+        const char *equals = strchr(arg, '=');
+        size_t name_len = equals != NULL ? (size_t) (equals - arg) : strlen(arg);
+        if (!IsName(arg, name_len)) {
+            fprintf(stderr, "smallsh: export: `%s': not a valid identifier\n", arg);
+            err_status = -1;
+            continue;
+        }
+        if (equals == NULL) continue; // already in the environment if it is set
+        char *name = ArenaStrndup(arg, name_len);
+        if (name == NULL || setenv(name, equals + 1, 1) < 0) {
+            perror("smallsh: export");
+            err_status = -1;
+        }
+    }
+    return err_status;
+}
+
+/*********************************************************************
+ * UnsetCommand()
+ * Handles unset command: unset [-v] name...
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int UnsetCommand(command *cmd){
+    int err_status = 0;
+    int i = 1;
+    if (cmd->command_array[1] != NULL && strcmp(cmd->command_array[1], "-v") == 0) i++;
+    for (; cmd->command_array[i] != NULL; i++) {
+        const char *name = cmd->command_array[i];
+        if (!IsName(name, strlen(name))) {
+            fprintf(stderr, "smallsh: unset: `%s': not a valid identifier\n", name);
+            err_status = -1;
+            continue;
+        }
+        unsetenv(name);
+    }
+    return err_status;
+}
+
+/*********************************************************************
+ * UlimitCommand()
+ * Handles ulimit command.
+ * ulimit [-H|-S] [-a | -c|-d|-f|-l|-m|-n|-s|-t|-u|-v [value]] shows or
+ * sets one of the shell's resource limits, which every command it runs
+ * inherits; -f is the default. A new value sets both the soft and hard
+ * limit unless -S or -H picks one. Sizes are in KiB, -t in seconds.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int UlimitCommand(command *cmd){
+    static const struct {
+        char option;
+        int resource;
+        rlim_t unit;
+        const char *description;
+    } limits[] = {
+        {'c', RLIMIT_CORE, 1024, "core file size (KiB)"},
+        {'d', RLIMIT_DATA, 1024, "data seg size (KiB)"},
+        {'f', RLIMIT_FSIZE, 1024, "file size (KiB)"},
+        {'l', RLIMIT_MEMLOCK, 1024, "max locked memory (KiB)"},
+        {'m', RLIMIT_RSS, 1024, "max memory size (KiB)"},
+        {'n', RLIMIT_NOFILE, 1, "open files"},
+        {'s', RLIMIT_STACK, 1024, "stack size (KiB)"},
+        {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+        {'u', RLIMIT_NPROC, 1, "max user processes"},
+        {'v', RLIMIT_AS, 1024, "virtual memory (KiB)"},
+    };
+    size_t count = sizeof limits / sizeof limits[0];
+    bool hard = false, soft = false, all = false;
+    size_t which = 2; // -f
+    int i = 1;
+    for (; cmd->command_array[i] != NULL && cmd->command_array[i][0] == '-' && cmd->command_array[i][1] != '\0'; i++) {
+        for (const char *option = cmd->command_array[i] + 1; *option != '\0'; option++) {
+            if (*option == 'H') hard = true;
+            else if (*option == 'S') soft = true;
+            else if (*option == 'a') all = true;
+            else {
+                size_t j = 0;
+                while (j < count && limits[j].option != *option) j++;
+                if (j == count) {
+                    fprintf(stderr, "smallsh: ulimit: -%c: invalid option\n", *option);
+                    return -1;
+                }
+                which = j;
+            }
+        }
+    }
+
+    const char *value = cmd->command_array[i];
+    if (all || value == NULL) {
+        for (size_t j = all ? 0 : which; j < (all ? count : which + 1); j++) {
+            struct rlimit rl;
+            if (getrlimit(limits[j].resource, &rl) == -1) {
+                perror("smallsh: ulimit");
+                return -1;
+            }
+            rlim_t current = hard ? rl.rlim_max : rl.rlim_cur;
+            if (all) printf("%-26s(-%c) ", limits[j].description, limits[j].option);
+            if (current == RLIM_INFINITY) printf("unlimited\n");
+            else printf("%ju\n", (uintmax_t) (current / limits[j].unit));
+        }
+        fflush(stdout);
+        return 0;
+    }
+
+    // New value for the soft and/or hard limit
+    rlim_t new_limit;
+    if (strcmp(value, "unlimited") == 0) new_limit = RLIM_INFINITY;
+    else {
+        char *end;
+        errno = 0;
+        unsigned long long number = strtoull(value, &end, 10);
+        if (end == value || *end != '\0' || errno != 0 || !isdigit((unsigned char) value[0]) ||
+            number > RLIM_INFINITY / limits[which].unit) {
+            fprintf(stderr, "smallsh: ulimit: %s: invalid number\n", value);
+            return -1;
+        }
+        new_limit = number * limits[which].unit;
+    }
+    if (!hard && !soft) hard = soft = true;
+    struct rlimit rl;
+    if (getrlimit(limits[which].resource, &rl) == -1) {
+        perror("smallsh: ulimit");
+        return -1;
+    }
+    if (hard) rl.rlim_max = new_limit;
+    if (soft) rl.rlim_cur = new_limit;
+    if (setrlimit(limits[which].resource, &rl) == -1) {
+        fprintf(stderr, "smallsh: ulimit: -%c: %s\n", limits[which].option, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*********************************************************************
+ * PlacementLoad()
+ * Order the CPUs the shell may run on node by node, from the NUMA
+ * nodes in sysfs. CPUs of no node, or every CPU on a machine without
+ * NUMA information, form one last node.
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int PlacementLoad(void){
+    if (placement.cpus != NULL) return 0;
+    if (sched_getaffinity(0, sizeof placement.allowed, &placement.allowed) == -1) return -1;
+    int allowed = CPU_COUNT(&placement.allowed);
+    placement.cpus = malloc(sizeof *placement.cpus * (allowed + 1));
+    placement.node_start = malloc(sizeof *placement.node_start * (allowed + 2));
+    placement.node_ids = malloc(sizeof *placement.node_ids * (allowed + 1));
+    if (placement.cpus == NULL || placement.node_start == NULL || placement.node_ids == NULL) {
+        free(placement.cpus);
+        free(placement.node_start);
+        free(placement.node_ids);
+        placement.cpus = NULL;
+        return -1;
+    }
+
+    // The online node numbers are a CPU list too
+    cpu_set_t nodes, remaining = placement.allowed;
+    char line[4096];
+    CPU_ZERO(&nodes);
+    FILE *file = fopen("/sys/devices/system/node/online", "re");
+    if (file != NULL && fgets(line, sizeof line, file) != NULL) ParseCpuList(line, &nodes);
+    if (file != NULL) fclose(file);
+    int count = 0;
+    for (int node = 0; node < CPU_SETSIZE && CPU_COUNT(&remaining) > 0; node++) {
+        if (!CPU_ISSET(node, &nodes)) continue;
+        char path[64];
+        cpu_set_t node_cpus;
+        snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+        file = fopen(path, "re");
+        bool found = file != NULL && fgets(line, sizeof line, file) != NULL && ParseCpuList(line, &node_cpus) == 0;
+        if (file != NULL) fclose(file);
+        if (!found) continue;
+        CPU_AND(&node_cpus, &node_cpus, &remaining);
+        if (CPU_COUNT(&node_cpus) == 0) continue;
+        placement.node_ids[placement.node_count] = node;
+        placement.node_start[placement.node_count++] = count;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &node_cpus)) continue;
+            placement.cpus[count++] = cpu;
+            CPU_CLR(cpu, &remaining);
+        }
+    }
+    if (CPU_COUNT(&remaining) > 0) {
+        placement.node_ids[placement.node_count] = -1;
+        placement.node_start[placement.node_count++] = count;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &remaining)) placement.cpus[count++] = cpu;
+        }
+    }
+    placement.node_start[placement.node_count] = count;
+    return 0;
+}
+
+/*********************************************************************
+ * PlaceJob()
+ * With SMALLSH_PLACEMENT=core, give a job the next cpu_count CPUs in
+ * node order, moving on to the next node rather than straddling two.
+ * With SMALLSH_PLACEMENT=node, give it every CPU of the next node.
+ * The shell takes the job's affinity until its caller, ExecuteCommands
+ * or parallel, sets shell_cpus back once the job's processes are
+ * launched, so each of them inherits it, whichever engine starts it.
+ * @param job* jb - gets its CPUs and node
+ * @param int cpu_count - CPUs wanted, one per pipeline stage
+ * @param cpu_set_t* shell_cpus - gets the shell's own affinity
+ * @return: true if the job was placed
+ *********************************************************************/
+static bool PlaceJob(job *jb, int cpu_count, cpu_set_t *shell_cpus){
+    const char *mode = getenv("SMALLSH_PLACEMENT");
+    if (mode == NULL || (strcmp(mode, "core") != 0 && strcmp(mode, "node") != 0)) return false;
+    if (PlacementLoad() < 0 || placement.node_count == 0) return false;
+
+    int node = placement.next_node;
+    int size = placement.node_start[node + 1] - placement.node_start[node];
+    int offset = placement.next_offset;
+    if (strcmp(mode, "node") == 0) {
+        offset = 0;
+        cpu_count = size;
+    }
+    else if (offset + cpu_count > size && (offset > 0 || cpu_count > size)) {
+        if (offset > 0) {
+            node = (node + 1) % placement.node_count;
+            size = placement.node_start[node + 1] - placement.node_start[node];
+        }
+        offset = 0;
+        if (cpu_count > size) cpu_count = size;
+    }
+    CPU_ZERO(&jb->cpus);
+    for (int i = 0; i < cpu_count; i++) CPU_SET(placement.cpus[placement.node_start[node] + offset + i], &jb->cpus);
+    offset += cpu_count;
+    placement.next_node = offset < size ? node : (node + 1) % placement.node_count;
+    placement.next_offset = offset < size ? offset : 0;
+
+    if (sched_getaffinity(0, sizeof *shell_cpus, shell_cpus) == -1 ||
+        sched_setaffinity(0, sizeof jb->cpus, &jb->cpus) == -1) {
+        return false;
+    }
+    jb->node = placement.node_ids[node];
+    jb->placed = true;
+    return true;
+}
+
+/*********************************************************************
+ * ParseCpuList()
+ * Parse a CPU list such as 0-3,8,10-11.
+ * @param const char* list
+ * @param cpu_set_t* set - gets the CPUs
+ * @return: 0 if successful, -1 if the list is invalid
+ *********************************************************************/
+static int ParseCpuList(const char *list, cpu_set_t *set){
+    CPU_ZERO(set);
+    const char *p = list;
+    for (;;) {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p || first < 0) return -1;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) return -1;
+            p = end;
+        }
+        if (last >= CPU_SETSIZE) return -1;
+        for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, set);
+        if (*p != ',') break;
+        p++;
+    }
+    return *p == '\0' || *p == '\n' ? 0 : -1;
+}
+
+/*********************************************************************
+ * ParseCpuMask()
+ * Parse a hexadecimal CPU mask such as 0xf0, the lowest bit is CPU 0.
+ * @param const char* mask
+ * @param cpu_set_t* set - gets the CPUs
+ * @return: 0 if successful, -1 if the mask is invalid
+ *********************************************************************/
+static int ParseCpuMask(const char *mask, cpu_set_t *set){
+    CPU_ZERO(set);
+    if (mask[0] == '0' && (mask[1] == 'x' || mask[1] == 'X')) mask += 2;
+    size_t len = strlen(mask);
+    if (len == 0 || len * 4 > CPU_SETSIZE) return -1;
+    for (size_t i = 0; i < len; i++) {
+        char digit = mask[len - 1 - i];
+        if (!isxdigit((unsigned char) digit)) return -1;
+        int value = isdigit((unsigned char) digit) ? digit - '0' : tolower((unsigned char) digit) - 'a' + 10;
+        for (int bit = 0; bit < 4; bit++) {
+            if (value & (1 << bit)) CPU_SET(i * 4 + bit, set);
+        }
+    }
+    return 0;
+}
+
+/*********************************************************************
+ * FormatCpus()
+ * Format a CPU set as a list such as 0-3,8, or as a hexadecimal mask.
+ * @param const cpu_set_t* set
+ * @param bool as_list
+ * @param char* buf
+ * @param size_t size
+ * @return: buf
+ *********************************************************************/
+static char *FormatCpus(const cpu_set_t *set, bool as_list, char *buf, size_t size){
+    size_t len = 0;
+    buf[0] = '\0';
+    if (as_list) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+            if (!CPU_ISSET(cpu, set)) continue;
+            int last = cpu;
+            while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) last++;
+            if (last == cpu) len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", cpu);
+            else len += snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", cpu, last);
+            cpu = last;
+        }
+        return buf;
+    }
+    int top = CPU_SETSIZE - 1;
+    while (top > 0 && !CPU_ISSET(top, set)) top--;
+    for (int digit = top / 4; digit >= 0 && len + 1 < size; digit--) {
+        int value = 0;
+        for (int bit = 0; bit < 4; bit++) value |= CPU_ISSET(digit * 4 + bit, set) ? 1 << bit : 0;
+        buf[len++] = "0123456789abcdef"[value];
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+/*********************************************************************
+ * TasksetCommand()
+ * Handles taskset command.
+ * taskset [-c] mask|list command [args...] runs a command on the given
+ * CPUs. taskset -p [-c] [mask|list] pid|%job shows, or sets, the CPUs
+ * of a process, or of every process of a job. -c takes and shows CPU
+ * lists such as 0-3,8 instead of hexadecimal masks.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int TasksetCommand(command *cmd){
+    char **argv = cmd->command_array;
+    bool as_list = false, by_pid = false;
+    int i = 1;
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        for (const char *option = argv[i] + 1; *option != '\0'; option++) {
+            if (*option == 'c') as_list = true;
+            else if (*option == 'p') by_pid = true;
+            else goto usage;
+        }
+    }
+    int argc = 0;
+    while (argv[i + argc] != NULL) argc++;
+    if (argc == 0 || (by_pid && argc > 2) || (!by_pid && argc < 2)) goto usage;
+
+    cpu_set_t cpus;
+    bool set = !by_pid || argc == 2;
+    if (set && (as_list ? ParseCpuList(argv[i], &cpus) : ParseCpuMask(argv[i], &cpus)) < 0) {
+        fprintf(stderr, "smallsh: taskset: %s: invalid CPU %s\n", argv[i], as_list ? "list" : "mask");
+        dollar_question = 1;
+        return -1;
+    }
+
+    if (!by_pid) {
+        // The command inherits the shell's affinity at launch
+        cpu_set_t shell_cpus;
+        if (sched_getaffinity(0, sizeof shell_cpus, &shell_cpus) == -1 ||
+            sched_setaffinity(0, sizeof cpus, &cpus) == -1) {
+            perror("smallsh: taskset");
+            dollar_question = 1;
+            return -1;
+        }
+        stage child = {.argv = argv + i + 1};
+        command child_cmd = {.command_array = child.argv, .stages = &child, .stage_count = 1};
+        job *jb = NewJob(&child_cmd);
+        if (jb != NULL) AddJobProcess(jb, LaunchCommand(&child, -1, -1, job_control ? 0 : -1));
+        sched_setaffinity(0, sizeof shell_cpus, &shell_cpus);
+        if (jb == NULL) {
+            dollar_question = 1;
+            return -1;
+        }
+        jb->cpus = cpus;
+        jb->placed = true;
+        jb->node = -1;
+        return WaitForJob(jb, true) < 0 ? -1 : 0;
+    }
+
+    // Every process of a job, or the one pid
+    const char *target = argv[i + argc - 1];
+    pid_t single_pid;
+    pid_t *pids = &single_pid;
+    int pid_count = 1;
+    if (target[0] == '%') {
+        job *jb = FindJob(target, "taskset");
+        if (jb == NULL) {
+            dollar_question = 1;
+            return -1;
+        }
+        pids = malloc(sizeof *pids * jb->proc_count);
+        if (pids == NULL) {
+            dollar_question = 1;
+            return -1;
+        }
+        pid_count = 0;
+        for (int j = 0; j < jb->proc_count; j++) {
+            if (!jb->procs[j].done) pids[pid_count++] = jb->procs[j].pid;
+        }
+        if (set) {
+            jb->cpus = cpus;
+            jb->placed = true;
+            jb->node = -1;
+        }
+    }
+    else {
+        char *end;
+        single_pid = strtol(target, &end, 10);
+        if (*target == '\0' || *end != '\0' || single_pid < 0) {
+            fprintf(stderr, "smallsh: taskset: %s: invalid PID\n", target);
+            dollar_question = 1;
+            return -1;
+        }
+    }
+    int err_status = 0;
+    const char *kind = as_list ? "list" : "mask";
+    for (int j = 0; j < pid_count; j++) {
+        cpu_set_t current;
+        char text[1024];
+        if (sched_getaffinity(pids[j], sizeof current, &current) == -1) {
+            fprintf(stderr, "smallsh: taskset: %jd: %s\n", (intmax_t) pids[j], strerror(errno));
+            err_status = -1;
+            continue;
+        }
+        printf("pid %jd's current affinity %s: %s\n", (intmax_t) pids[j], kind,
+               FormatCpus(&current, as_list, text, sizeof text));
+        if (!set) continue;
+        if (sched_setaffinity(pids[j], sizeof cpus, &cpus) == -1 ||
+            sched_getaffinity(pids[j], sizeof current, &current) == -1) {
+            fprintf(stderr, "smallsh: taskset: %jd: %s\n", (intmax_t) pids[j], strerror(errno));
+            err_status = -1;
+            continue;
+        }
+        printf("pid %jd's new affinity %s: %s\n", (intmax_t) pids[j], kind,
+               FormatCpus(&current, as_list, text, sizeof text));
+    }
+    fflush(stdout);
+    if (pids != &single_pid) free(pids);
+    dollar_question = err_status < 0 ? 1 : 0;
+    return err_status;
+
+    usage:
+    fprintf(stderr, "smallsh: taskset: usage: taskset [-c] mask|list command [args...]\n"
+                    "       taskset -p [-c] [mask|list] pid|%%job\n");
+    dollar_question = 2;
+    return -1;
+}
+
+/*********************************************************************
+ * ExitShell()
+ * Handles exit command.
+ * If exit argument is an int, exits with that status.
+ * If exit argument is not an int, prints error message to stderr.
+ * If exit argument is not given, exits with status 0.
+ * Kills all child processes before exiting.
+ * @param: command *cmd - command struct
+ * @return: -1 if error, otherwise exits shell.
+ *********************************************************************/
+static int ExitShell(command *cmd){
+    if (cmd->command_array[1] != NULL && cmd->command_array[2] != NULL) { // too many arguments
+        fprintf(stderr, "exit: too many arguments\n");
+        goto exit;
+    }
+    if (cmd->command_array[1] != NULL) { // exit argument
+        // Check if exit argument is an int
+        for (size_t i = 0; i < strlen(cmd->command_array[1]); i++){
+            if (isdigit(cmd->command_array[1][i]) == 0){
+                fprintf(stderr, "exit: argument not an int\n");
+                goto exit;
+            }
+        }
+        // Convert exit argument to int
+        long exit_status = strtol(cmd->command_array[1], NULL, 10);
+        if (interactive) fprintf(stderr, "\nexit\n");
+        KillChildrenProcesses(SIGINT);
+        int err_status = (int) exit_status;
+        exit(err_status);
+    }
+    else { // no exit argument, exit with status of last foreground command
+        if (interactive) fprintf(stderr, "\nexit\n");
+        KillChildrenProcesses(SIGINT);
+        exit(dollar_question);
+    }
+    exit:
+    return -1;
+}
+
+/*********************************************************************
+ * ChangeDirectory()
+ * Handles cd command.
+ * If no argument, changes directory to home directory.
+ * If argument, changes directory to argument.
+ * If too many arguments, prints error message to stderr.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int ChangeDirectory(command *cmd){
+    int err_status = 0;
+    if (cmd->command_array[1] != NULL && cmd->command_array[2] != NULL) { // too many arguments
+        fprintf(stderr, "smallsh: cd: too many arguments\n");
+        err_status = -1;
+        goto exit;
     }
     else if (cmd->command_array[1] == NULL) { // no argument, go to home directory
         if (chdir(getenv("HOME")) < 0) {
@@ -511,62 +6262,1561 @@ static int ChangeDirectory(command *cmd){
             goto exit;
         }
     }
-    else { // argument, go to directory
-        if (chdir(cmd->command_array[1]) < 0) {
+    else { // argument, go to directory
+        if (chdir(cmd->command_array[1]) < 0) {
+            err_status = -1;
+            goto exit;
+        }
+    }
+    exit:
+    return err_status;
+}
+
+/*********************************************************************
+ * ManageBackgroundProcesses()
+ * Reaps every child that has terminated, stopped or continued since the
+ * last call and updates its job, keeping the resource usage wait4
+ * reports for each terminated child. Called whenever signal_fd reports a
+ * SIGCHLD, so finished children never linger as zombies.
+ * Prints message to stderr if a background process was stopped,
+ * signaled, or exited, and drops background jobs once they are done.
+ * @return: number of messages printed
+ *********************************************************************/
+static int ManageBackgroundProcesses(){
+    int messages = 0;
+    int child_status;
+    struct rusage child_usage;
+    pid_t child_pid;
+    while ((child_pid = wait4(-1, &child_status, WNOHANG | WUNTRACED | WCONTINUED, &child_usage)) > 0) {
+        pid_slot *slot = PidMapFind(child_pid);
+        if (slot == NULL) continue; // not started as part of a job
+        job *jb = slot->jb;
+        process *proc = &jb->procs[slot->index];
+
+        if (WIFCONTINUED(child_status)) {
+            if (proc->stopped) {
+                proc->stopped = false;
+                jb->stopped_count--;
+            }
+            continue;
+        }
+        if (WIFSTOPPED(child_status)) {
+            // A foreground job can touch the terminal before it has been handed over, let it retry
+            int stop_signal = WSTOPSIG(child_status);
+            if (job_control && !jb->is_background && (stop_signal == SIGTTIN || stop_signal == SIGTTOU)) {
+                kill(child_pid, SIGCONT);
+                continue;
+            }
+            if (!proc->stopped) {
+                proc->stopped = true;
+                jb->stopped_count++;
+            }
+            if (jb->is_background) {
+                fprintf(stderr, "Child process %jd stopped. Use fg %%%d or bg %%%d to continue.\n",
+                        (intmax_t) child_pid, jb->id, jb->id);
+                messages++;
+            }
+            continue;
+        }
+
+        // Terminated
+        proc->status = child_status;
+        proc->usage = child_usage;
+        clock_gettime(CLOCK_MONOTONIC, &proc->end);
+        proc->done = true;
+        if (proc->stopped) jb->stopped_count--;
+        proc->stopped = false;
+        jb->live_count--;
+        slot->pid = -1;
+        if (jb->is_background) {
+            if (WIFSIGNALED(child_status)) {
+                fprintf(stderr, "Child process %jd done. Signaled %d.\n", (intmax_t) child_pid,
+                        WTERMSIG(child_status));
+            }
+            else {
+                fprintf(stderr, "Child process %jd done. Exit status %d.\n", (intmax_t) child_pid,
+                        WEXITSTATUS(child_status));
+            }
+            messages++;
+            if (jb->live_count == 0) {
+                finished_jobs[finished_jobs_next].pid = jb->procs[jb->proc_count - 1].pid;
+                finished_jobs[finished_jobs_next].status = JobStatus(jb);
+                finished_jobs_next = (finished_jobs_next + 1) % FINISHED_JOBS;
+                RemoveJob(jb);
+            }
+        }
+    }
+    return messages;
+}
+
+/*********************************************************************
+ * KillChildrenProcesses()
+ * Sends signal to every live process in the job table. Stopped
+ * processes are continued so they receive it.
+ * Will not produce an error if there are no child processes.
+ * @param int Signal
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+int KillChildrenProcesses(int signal){
+    int err_status = 0;
+    for (int i = 0; i < job_table_size; i++) {
+        job *jb = job_table[i];
+        if (jb == NULL) continue;
+        for (int j = 0; j < jb->proc_count; j++) {
+            process *proc = &jb->procs[j];
+            if (proc->done) continue;
+            if (kill(proc->pid, signal) < 0) err_status = -1;
+            if (proc->stopped) kill(proc->pid, SIGCONT);
+        }
+    }
+    return err_status;
+}
+
+/*********************************************************************
+ * NewJob()
+ * Add an empty job for a command line to the job table, in the lowest
+ * free slot.
+ * @param command* cmd
+ * @return: the job, NULL if out of memory
+ *********************************************************************/
+static job *NewJob(command *cmd){
+    int slot = 0;
+    while (slot < job_table_size && job_table[slot] != NULL) slot++;
+    if (slot == job_table_size) {
+        int size = job_table_size ? job_table_size * 2 : 16;
+        job **table = realloc(job_table, sizeof *table * size);
+        if (table == NULL) return NULL;
+        memset(table + job_table_size, 0, sizeof *table * (size - job_table_size));
+        job_table = table;
+        job_table_size = size;
+    }
+
+    job *jb = calloc(1, sizeof *jb);
+    if (jb == NULL) return NULL;
+    jb->procs = calloc(cmd->stage_count, sizeof *jb->procs);
+
+    // Keep the command line for jobs, fg and bg
+    size_t text_len = 0;
+    for (int i = 0; i < cmd->stage_count; i++) {
+        stage *st = &cmd->stages[i];
+        for (int j = 0; st->argv[j] != NULL; j++) text_len += strlen(st->argv[j]) + 1;
+        if (st->in_file_name) text_len += strlen(st->in_file_name) + 3;
+        if (st->out_file_name) text_len += strlen(st->out_file_name) + 3;
+        text_len += 2;
+    }
+    jb->text = malloc(text_len + 1);
+    if (jb->procs == NULL || jb->text == NULL) {
+        free(jb->procs);
+        free(jb->text);
+        free(jb);
+        return NULL;
+    }
+    char *p = jb->text;
+    for (int i = 0; i < cmd->stage_count; i++) {
+        stage *st = &cmd->stages[i];
+        if (i > 0) p = stpcpy(p, "| ");
+        for (int j = 0; st->argv[j] != NULL; j++) p += sprintf(p, "%s ", st->argv[j]);
+        if (st->in_file_name) p += sprintf(p, "< %s ", st->in_file_name);
+        if (st->out_file_name) p += sprintf(p, "> %s ", st->out_file_name);
+    }
+    if (p > jb->text) p--;
+    *p = '\0';
+
+    jb->id = slot + 1;
+    jb->is_background = cmd->is_background;
+    clock_gettime(CLOCK_MONOTONIC, &jb->start);
+    job_table[slot] = jb;
+    return jb;
+}
+
+/*********************************************************************
+ * AddJobProcess()
+ * Record the next process of a job. With job control the first process
+ * started becomes the job's process group leader. A process that failed
+ * to start counts as done with status 255, like a child whose exec failed.
+ * @param job* jb
+ * @param pid_t pid - PID of the process, -1 if it could not be started
+ *********************************************************************/
+static void AddJobProcess(job *jb, pid_t pid){
+    process *proc = &jb->procs[jb->proc_count];
+    proc->pid = pid;
+    if (pid == -1 || PidMapInsert(pid, jb, jb->proc_count) < 0) {
+        proc->done = true;
+        clock_gettime(CLOCK_MONOTONIC, &proc->end);
+        proc->status = pid == -1 ? 255 << 8 : 0; // exit status 255
+    }
+    else {
+        jb->live_count++;
+        if (jb->pgid == 0) jb->pgid = pid;
+    }
+    jb->proc_count++;
+}
+
+/*********************************************************************
+ * RemoveJob()
+ * Take a job out of the job table and free it.
+ * @param job* jb
+ *********************************************************************/
+static void RemoveJob(job *jb){
+    for (int i = 0; i < jb->proc_count; i++) {
+        if (!jb->procs[i].done) {
+            pid_slot *slot = PidMapFind(jb->procs[i].pid);
+            if (slot != NULL) slot->pid = -1;
+        }
+    }
+    job_table[jb->id - 1] = NULL;
+    if (jb->cgroup != NULL) {
+        rmdir(jb->cgroup);
+        free(jb->cgroup);
+    }
+    free(jb->procs);
+    free(jb->text);
+    free(jb);
+}
+
+/*********************************************************************
+ * JobStatus()
+ * Exit status of a finished job: the status of the last process that
+ * failed, like pipefail, with 128 + signal number for signaled processes.
+ * @param job* jb
+ * @return: the status for $?
+ *********************************************************************/
+static int JobStatus(job *jb){
+    int job_status = 0;
+    for (int i = 0; i < jb->proc_count; i++) {
+        int child_status = jb->procs[i].status;
+        int process_status = 0;
+        if (WIFEXITED(child_status)){
+            process_status = WEXITSTATUS(child_status);
+        }
+            // If child process was terminated by a signal, set $? to 128 + signal number
+        else if (WIFSIGNALED(child_status)){
+            process_status = 128 + WTERMSIG(child_status);
+        }
+        if (process_status != 0) job_status = process_status;
+    }
+    return job_status;
+}
+
+/*********************************************************************
+ * WaitForJob()
+ * Wait until every process of a job has terminated, or the job has
+ * stopped, reaping other children as they exit. A foreground job gets
+ * the terminal while it runs. When the job is done $? is set to its
+ * status and last_usage to its resource usage, and it is removed; a
+ * stopped job stays in the table for fg or bg. Waiting for a job that
+ * is not in the foreground ends on SIGINT.
+ * @param job* jb
+ * @param bool foreground - give the job the terminal
+ * @return: 0 if the job finished, 1 if it stopped, -1 if the wait was interrupted
+ *********************************************************************/
+static int WaitForJob(job *jb, bool foreground){
+    bool was_background = jb->is_background;
+    bool interrupted = false;
+    jb->is_background = false;
+    if (foreground && job_control) tcsetpgrp(STDIN_FILENO, jb->pgid);
+
+    while (jb->live_count > 0 && jb->stopped_count < jb->live_count) {
+        int events = WaitForEvents(-1);
+        if (events & EVENT_CHILD) ManageBackgroundProcesses();
+        if ((events & EVENT_INTERRUPT) && !foreground) {
+            interrupted = true;
+            break;
+        }
+    }
+
+    if (foreground && job_control) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+    if (interrupted) {
+        jb->is_background = was_background;
+        dollar_question = 128 + SIGINT;
+        return -1;
+    }
+    if (jb->live_count > 0) {
+        // If a child process was stopped by a signal, keep the job for fg or bg,
+        // set $! to child process ID. Print message to stderr.
+        jb->is_background = true;
+        for (int i = 0; i < jb->proc_count; i++) {
+            if (!jb->procs[i].stopped) continue;
+            fprintf(stderr, "Child process %jd stopped. Use fg %%%d or bg %%%d to continue.\n",
+                    (intmax_t) jb->procs[i].pid, jb->id, jb->id);
+            snprintf(dollar_exclamation, sizeof dollar_exclamation, "%jd", (intmax_t) jb->procs[i].pid);
+            break;
+        }
+        return 1;
+    }
+    dollar_question = JobStatus(jb);
+    last_usage = JobUsage(jb);
+    // Move past the ^C the terminal echoed before printing the next prompt
+    if (foreground && interactive && dollar_question == 128 + SIGINT) putchar('\n');
+    RemoveJob(jb);
+    return 0;
+}
+
+/*********************************************************************
+ * JobUsage()
+ * Resource usage of a finished job: wall time from the job's start to
+ * its last process being reaped, CPU time and faults summed over its
+ * processes, and the largest max RSS of any of them.
+ * @param job* jb
+ * @return: the job's usage
+ *********************************************************************/
+static resource_usage JobUsage(job *jb){
+    resource_usage usage = {0};
+    for (int i = 0; i < jb->proc_count; i++) {
+        process *proc = &jb->procs[i];
+        double real = (proc->end.tv_sec - jb->start.tv_sec) + (proc->end.tv_nsec - jb->start.tv_nsec) / 1e9;
+        if (real > usage.real) usage.real = real;
+        usage.user += proc->usage.ru_utime.tv_sec + proc->usage.ru_utime.tv_usec / 1e6;
+        usage.sys += proc->usage.ru_stime.tv_sec + proc->usage.ru_stime.tv_usec / 1e6;
+        if (proc->usage.ru_maxrss > usage.max_rss) usage.max_rss = proc->usage.ru_maxrss;
+        usage.major_faults += proc->usage.ru_majflt;
+        usage.minor_faults += proc->usage.ru_minflt;
+    }
+    return usage;
+}
+
+/*********************************************************************
+ * PrintUsage()
+ * Print resource usage to stderr for time, in the format of the
+ * shell keyword with max RSS and page faults added.
+ * @param const resource_usage* usage
+ *********************************************************************/
+static void PrintUsage(const resource_usage *usage){
+    const char *labels[] = {"real", "user", "sys"};
+    double seconds[] = {usage->real, usage->user, usage->sys};
+    fputc('\n', stderr);
+    for (int i = 0; i < 3; i++) {
+        int minutes = (int) (seconds[i] / 60);
+        fprintf(stderr, "%s\t%dm%.3fs\n", labels[i], minutes, seconds[i] - minutes * 60);
+    }
+    fprintf(stderr, "maxrss\t%ldk\n", usage->max_rss);
+    fprintf(stderr, "faults\t%ld major, %ld minor\n", usage->major_faults, usage->minor_faults);
+}
+
+/*********************************************************************
+ * CgroupBase()
+ * Find the shell's own cgroup v2 directory the first time a limited
+ * job runs, and enable the memory, cpu and pids controllers for the
+ * leaves made under it. A cgroup with processes of its own can't hand
+ * out controllers, so if that fails the shell moves into a leaf first,
+ * which CgroupCleanup removes at exit.
+ * @return: the directory, "" if there is no usable cgroup v2 hierarchy
+ *********************************************************************/
+static const char *CgroupBase(void){
+    if (cgroup_base != NULL) return cgroup_base;
+    cgroup_base = "";
+
+    // The cgroup2 mount point, from the line whose type follows " - "
+    char line[4096], mount_point[PATH_MAX] = "", path[PATH_MAX] = "";
+    FILE *file = fopen("/proc/self/mountinfo", "re");
+    while (file != NULL && fgets(line, sizeof line, file) != NULL) {
+        char *type = strstr(line, " - ");
+        if (type == NULL || strncmp(type + 3, "cgroup2 ", 8) != 0) continue;
+        if (sscanf(line, "%*s %*s %*s %*s %4095s", mount_point) == 1) break;
+    }
+    if (file != NULL) fclose(file);
+    // The shell's cgroup under it, from the 0:: line
+    file = fopen("/proc/self/cgroup", "re");
+    while (file != NULL && fgets(line, sizeof line, file) != NULL) {
+        if (strncmp(line, "0::", 3) != 0) continue;
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(path, sizeof path, "%s", line + 3);
+        break;
+    }
+    if (file != NULL) fclose(file);
+    if (mount_point[0] == '\0' || path[0] == '\0') return cgroup_base;
+    char *base;
+    if (asprintf(&base, "%s%s", mount_point, strcmp(path, "/") == 0 ? "" : path) < 0) return cgroup_base;
+    cgroup_base = base;
+
+    char available[256] = "";
+    CgroupRead(base, "cgroup.controllers", NULL, available, sizeof available);
+    bool moved = false;
+    const char *controllers[] = {"+memory", "+cpu", "+pids"};
+    for (size_t i = 0; i < sizeof controllers / sizeof controllers[0]; i++) {
+        // Only the controllers this cgroup was given, as whole words
+        size_t len = strlen(controllers[i] + 1);
+        const char *found = available;
+        while ((found = strstr(found, controllers[i] + 1)) != NULL) {
+            if ((found == available || found[-1] == ' ') && (found[len] == ' ' || found[len] == '\0')) break;
+            found += len;
+        }
+        if (found == NULL) continue;
+        bool enabled = CgroupWrite(base, "cgroup.subtree_control", controllers[i]) == 0;
+        if (!enabled && errno == EBUSY && !moved) {
+            char *leaf;
+            if (asprintf(&leaf, "%s/smallsh.%jd", base, (intmax_t) getpid()) < 0) continue;
+            moved = true;
+            if ((mkdir(leaf, 0755) == 0 || errno == EEXIST) && CgroupWrite(leaf, "cgroup.procs", "0") == 0) {
+                cgroup_move.leaf = leaf;
+                cgroup_move.owner = getpid();
+                atexit(CgroupCleanup);
+                enabled = CgroupWrite(base, "cgroup.subtree_control", controllers[i]) == 0;
+            }
+            else {
+                rmdir(leaf);
+                free(leaf);
+            }
+        }
+        // Only what was enabled after moving is the shell's to undo
+        if (enabled && cgroup_move.leaf != NULL) {
+            size_t len = strlen(cgroup_move.enabled);
+            snprintf(cgroup_move.enabled + len, sizeof cgroup_move.enabled - len, "%s-%s", len ? " " : "",
+                     controllers[i] + 1);
+        }
+    }
+    return cgroup_base;
+}
+
+/*********************************************************************
+ * CgroupCleanup()
+ * At exit, move the shell back out of the leaf CgroupBase moved it into
+ * and remove the leaf. The shell's cgroup can only hold it again once
+ * the controllers the shell enabled are off, which would strip the
+ * limits of any other cgroup under it, so the leaf is only removed
+ * when no other cgroup is left there.
+ *********************************************************************/
+static void CgroupCleanup(void){
+    if (cgroup_move.leaf == NULL || getpid() != cgroup_move.owner) return;
+    int dir_fd = open(cgroup_base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) return;
+    const char *leaf_name = strrchr(cgroup_move.leaf, '/') + 1;
+    bool shared = false;
+    char buf[DIRENT_BATCH];
+    ssize_t n;
+    while (!shared && (n = ReadDirectoryBatch(dir_fd, buf, sizeof buf)) > 0) {
+        for (ssize_t offset = 0; offset < n && !shared;) {
+            dirent64_record *entry = (dirent64_record *) (buf + offset);
+            offset += entry->reclen;
+            if (entry->type != DT_DIR || strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) continue;
+            shared = strcmp(entry->name, leaf_name) != 0;
+        }
+    }
+    close(dir_fd);
+    if (shared) return;
+    if (cgroup_move.enabled[0] != '\0' && CgroupWrite(cgroup_base, "cgroup.subtree_control", cgroup_move.enabled) < 0) {
+        return;
+    }
+    if (CgroupWrite(cgroup_base, "cgroup.procs", "0") == 0) rmdir(cgroup_move.leaf);
+}
+
+/*********************************************************************
+ * CgroupCreate()
+ * Make the leaf cgroup of a limited job, write its limits and open
+ * its cgroup.procs for LaunchCommand. Limits a cgroup doesn't support
+ * are reported and skipped.
+ * @param job* jb
+ * @param const job_limits* limits
+ * @return: 0 if successful, -1 if the job runs without a cgroup
+ *********************************************************************/
+static int CgroupCreate(job *jb, const job_limits *limits){
+    const char *base = CgroupBase();
+    if (base[0] == '\0') {
+        fprintf(stderr, "smallsh: limit: no cgroup v2 hierarchy, running without limits\n");
+        return -1;
+    }
+    char *dir;
+    if (asprintf(&dir, "%s/smallsh.%jd.%lu", base, (intmax_t) getpid(), ++cgroup_serial) < 0) return -1;
+    if (mkdir(dir, 0755) == -1) {
+        fprintf(stderr, "smallsh: limit: %s: %s, running without limits\n", dir, strerror(errno));
+        free(dir);
+        return -1;
+    }
+
+    const char *files[] = {"memory.max", "cpu.max", "pids.max"};
+    const char *values[] = {limits->memory_max, limits->cpu_max, limits->pids_max};
+    for (int i = 0; i < 3; i++) {
+        if (values[i] != NULL && CgroupWrite(dir, files[i], values[i]) == -1) {
+            fprintf(stderr, "smallsh: limit: %s: %s, not limited\n", files[i], strerror(errno));
+        }
+    }
+    char *procs;
+    if (asprintf(&procs, "%s/cgroup.procs", dir) >= 0) {
+        launch_cgroup_fd = open(procs, O_WRONLY | O_CLOEXEC);
+        free(procs);
+    }
+    if (launch_cgroup_fd == -1) {
+        fprintf(stderr, "smallsh: limit: %s: %s, running without limits\n", dir, strerror(errno));
+        rmdir(dir);
+        free(dir);
+        return -1;
+    }
+    jb->cgroup = dir;
+    return 0;
+}
+
+/*********************************************************************
+ * CgroupWrite()
+ * Write a value to a cgroup file.
+ * @param const char* dir - the cgroup directory
+ * @param const char* file
+ * @param const char* value
+ * @return: 0 if successful, -1 with errno set if error
+ *********************************************************************/
+static int CgroupWrite(const char *dir, const char *file, const char *value){
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ssize_t n = write(fd, value, strlen(value));
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return n == -1 ? -1 : 0;
+}
+
+/*********************************************************************
+ * CgroupRead()
+ * Read a value from a cgroup file: its first line, or the value of a
+ * "key value" line.
+ * @param const char* dir - the cgroup directory
+ * @param const char* file
+ * @param const char* key - NULL for the first line
+ * @param char* value - gets the value
+ * @param size_t size
+ * @return: true if the value was found
+ *********************************************************************/
+static bool CgroupRead(const char *dir, const char *file, const char *key, char *value, size_t size){
+    char path[PATH_MAX], buf[4096];
+    snprintf(path, sizeof path, "%s/%s", dir, file);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    ssize_t n = read(fd, buf, sizeof buf - 1);
+    close(fd);
+    if (n <= 0) return false;
+    buf[n] = '\0';
+    const char *line = buf;
+    size_t key_len = key != NULL ? strlen(key) : 0;
+    while (key != NULL && (strncmp(line, key, key_len) != 0 || line[key_len] != ' ')) {
+        line = strchr(line, '\n');
+        if (line == NULL) return false;
+        line++;
+    }
+    line += key_len + (key != NULL);
+    snprintf(value, size, "%.*s", (int) strcspn(line, "\n"), line);
+    return true;
+}
+
+/*********************************************************************
+ * PrintJobUsage()
+ * Print the live memory, CPU time and process count of a job for
+ * jobs -v: from its cgroup's counters if it has one, otherwise added
+ * up from /proc for each of its processes still running.
+ * @param job* jb
+ *********************************************************************/
+static void PrintJobUsage(job *jb){
+    long long memory = -1, memory_max = -1, pids = 0, pids_max = -1;
+    double cpu = -1;
+    char value[64];
+    if (jb->cgroup != NULL) {
+        if (CgroupRead(jb->cgroup, "memory.current", NULL, value, sizeof value)) memory = atoll(value);
+        if (CgroupRead(jb->cgroup, "memory.max", NULL, value, sizeof value) && isdigit((unsigned char) value[0])) {
+            memory_max = atoll(value);
+        }
+        if (CgroupRead(jb->cgroup, "cpu.stat", "usage_usec", value, sizeof value)) cpu = atoll(value) / 1e6;
+        if (CgroupRead(jb->cgroup, "pids.current", NULL, value, sizeof value)) pids = atoll(value);
+        else pids = jb->live_count;
+        if (CgroupRead(jb->cgroup, "pids.max", NULL, value, sizeof value) && isdigit((unsigned char) value[0])) {
+            pids_max = atoll(value);
+        }
+    }
+    else {
+        long ticks = sysconf(_SC_CLK_TCK), page_size = sysconf(_SC_PAGESIZE);
+        memory = cpu = 0;
+        for (int i = 0; i < jb->proc_count; i++) {
+            if (jb->procs[i].done) continue;
+            char path[64], stat[1024];
+            snprintf(path, sizeof path, "/proc/%jd/stat", (intmax_t) jb->procs[i].pid);
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd == -1) continue;
+            ssize_t n = read(fd, stat, sizeof stat - 1);
+            close(fd);
+            if (n <= 0) continue;
+            stat[n] = '\0';
+            // Fields after the command name, which may itself contain spaces and parentheses
+            char *fields = strrchr(stat, ')');
+            unsigned long utime, stime;
+            long rss;
+            if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+                                         "%*d %*d %*d %*d %*d %*d %*u %*u %ld", &utime, &stime, &rss) != 3) {
+                continue;
+            }
+            cpu += (double) (utime + stime) / ticks;
+            memory += (long long) rss * page_size;
+            pids++;
+        }
+    }
+
+    printf("    %s: memory ", jb->cgroup != NULL ? strrchr(jb->cgroup, '/') + 1 : "proc");
+    if (memory >= 0) printf("%.1fM", memory / 1048576.0);
+    else printf("-");
+    if (memory_max >= 0) printf("/%.1fM", memory_max / 1048576.0);
+    printf("  cpu ");
+    if (cpu >= 0) printf("%.3fs", cpu);
+    else printf("-");
+    printf("  pids %lld", pids);
+    if (pids_max >= 0) printf("/%lld", pids_max);
+    printf("\n");
+}
+
+/*********************************************************************
+ * UsageVariable()
+ * Value of a $SMALLSH_* variable describing the last foreground job:
+ * REAL, USER and SYS in seconds, RSS in KiB, MAJFLT and MINFLT.
+ * @param const char* name - the name after SMALLSH_, not NUL terminated
+ * @param size_t name_len
+ * @return the value, NULL if name is not one of them
+ *********************************************************************/
+static const char *UsageVariable(const char *name, size_t name_len){
+    const struct { const char *name; const double *seconds; const long *count; } vars[] = {
+        {"REAL", &last_usage.real, NULL},
+        {"USER", &last_usage.user, NULL},
+        {"SYS", &last_usage.sys, NULL},
+        {"RSS", NULL, &last_usage.max_rss},
+        {"MAJFLT", NULL, &last_usage.major_faults},
+        {"MINFLT", NULL, &last_usage.minor_faults},
+    };
+    for (size_t i = 0; i < sizeof vars / sizeof vars[0]; i++) {
+        if (strlen(vars[i].name) != name_len || memcmp(vars[i].name, name, name_len) != 0) continue;
+        if (vars[i].seconds != NULL) snprintf(usage_value_str, sizeof usage_value_str, "%.3f", *vars[i].seconds);
+        else snprintf(usage_value_str, sizeof usage_value_str, "%ld", *vars[i].count);
+        return usage_value_str;
+    }
+    return NULL;
+}
+
+/*********************************************************************
+ * ContinueJob()
+ * Send SIGCONT to every stopped process of a job.
+ * @param job* jb
+ *********************************************************************/
+static void ContinueJob(job *jb){
+    if (job_control) kill(-jb->pgid, SIGCONT);
+    for (int i = 0; i < jb->proc_count; i++) {
+        process *proc = &jb->procs[i];
+        if (!proc->stopped) continue;
+        if (!job_control) kill(proc->pid, SIGCONT);
+        proc->stopped = false;
+    }
+    jb->stopped_count = 0;
+}
+
+/*********************************************************************
+ * FindJob()
+ * Look up a job by %id, or the most recent job if spec is NULL.
+ * Prints an error message to stderr if there is no such job.
+ * @param const char* spec
+ * @param const char* builtin - name of the calling built-in, for errors
+ * @return: the job, NULL if not found
+ *********************************************************************/
+static job *FindJob(const char *spec, const char *builtin){
+    if (spec == NULL) {
+        for (int i = job_table_size - 1; i >= 0; i--) {
+            if (job_table[i] != NULL) return job_table[i];
+        }
+        fprintf(stderr, "smallsh: %s: current: no such job\n", builtin);
+        return NULL;
+    }
+    const char *digits = spec[0] == '%' ? spec + 1 : spec;
+    char *end;
+    long id = strtol(digits, &end, 10);
+    if (*digits != '\0' && *end == '\0' && id > 0 && id <= job_table_size && job_table[id - 1] != NULL) {
+        return job_table[id - 1];
+    }
+    fprintf(stderr, "smallsh: %s: %s: no such job\n", builtin, spec);
+    return NULL;
+}
+
+/*********************************************************************
+ * JobsCommand()
+ * Handles jobs command.
+ * Lists every job that has not finished with its state, and with -v
+ * the live resource usage of each and the CPUs it was placed on.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int JobsCommand(command *cmd){
+    bool verbose = cmd->command_array[1] != NULL && strcmp(cmd->command_array[1], "-v") == 0;
+    for (int i = 0; i < job_table_size; i++) {
+        job *jb = job_table[i];
+        if (jb == NULL) continue;
+        bool stopped = jb->stopped_count > 0 && jb->stopped_count == jb->live_count;
+        printf("[%d] %-8s %s%s\n", jb->id, stopped ? "Stopped" : "Running", jb->text, stopped ? "" : " &");
+        if (verbose) PrintJobUsage(jb);
+        if (verbose && jb->placed) {
+            char cpus[1024];
+            printf("    cpus %s", FormatCpus(&jb->cpus, true, cpus, sizeof cpus));
+            if (jb->node >= 0) printf(" (node %d)", jb->node);
+            printf("\n");
+        }
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/*********************************************************************
+ * WaitCommand()
+ * Handles wait command.
+ * If no argument, waits for every background job that is running.
+ * Otherwise waits for each job given as %id or as the PID of one of
+ * its processes; a background job that already finished is found by
+ * the PID of its last process. Sets $? to the status of the last job
+ * waited for, or 127 if it was not found.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int WaitCommand(command *cmd){
+    int err_status = 0;
+    if (cmd->command_array[1] == NULL) { // no argument, wait for all running jobs
+        dollar_question = 0;
+        for (int i = 0; i < job_table_size; i++) {
+            job *jb = job_table[i];
+            if (jb == NULL || jb->stopped_count == jb->live_count) continue;
+            if (WaitForJob(jb, false) < 0) return -1;
+        }
+        dollar_question = 0;
+        return 0;
+    }
+    for (int i = 1; cmd->command_array[i] != NULL; i++) {
+        const char *spec = cmd->command_array[i];
+        job *jb = NULL;
+        if (spec[0] == '%') {
+            jb = FindJob(spec, "wait");
+        }
+        else {
+            pid_t pid = (pid_t) strtol(spec, NULL, 10);
+            pid_slot *slot = PidMapFind(pid);
+            if (slot != NULL) jb = slot->jb;
+            else if (FinishedJobStatus(pid, &dollar_question) == 0) continue;
+            else fprintf(stderr, "smallsh: wait: pid %s is not a child of this shell\n", spec);
+        }
+        if (jb == NULL) {
+            dollar_question = 127;
+            err_status = -1;
+            continue;
+        }
+        if (WaitForJob(jb, false) < 0) return -1;
+    }
+    return err_status;
+}
+
+/*********************************************************************
+ * FinishedJobStatus()
+ * Look up a background job that has finished and been removed from the
+ * job table by the PID of its last process.
+ * @param pid_t pid
+ * @param int* job_status - set to the job's status if found
+ * @return: 0 if found, -1 if not
+ *********************************************************************/
+static int FinishedJobStatus(pid_t pid, int *job_status){
+    for (int i = 0; i < FINISHED_JOBS; i++) {
+        if (finished_jobs[i].pid == pid && pid > 0) {
+            *job_status = finished_jobs[i].status;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*********************************************************************
+ * ForegroundCommand()
+ * Handles fg command.
+ * Continues a job, the most recent one if no argument, and waits for
+ * it in the foreground. $? is 1 if there is no such job.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int ForegroundCommand(command *cmd){
+    job *jb = FindJob(cmd->command_array[1], "fg");
+    if (jb == NULL) {
+        dollar_question = 1;
+        return -1;
+    }
+    printf("%s\n", jb->text);
+    fflush(stdout);
+    if (job_control) tcsetpgrp(STDIN_FILENO, jb->pgid);
+    ContinueJob(jb);
+    return WaitForJob(jb, true);
+}
+
+/*********************************************************************
+ * BackgroundCommand()
+ * Handles bg command.
+ * Continues a stopped job, the most recent one if no argument, in the
+ * background. $? is 1 if there is no such job.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int BackgroundCommand(command *cmd){
+    job *jb = FindJob(cmd->command_array[1], "bg");
+    if (jb == NULL) {
+        dollar_question = 1;
+        return -1;
+    }
+    jb->is_background = true;
+    ContinueJob(jb);
+    printf("[%d] %s &\n", jb->id, jb->text);
+    fflush(stdout);
+    dollar_question = 0;
+    return 0;
+}
+
+/*********************************************************************
+ * ParallelCommand()
+ * Handles parallel command: parallel [-j N] [-k] template...
+ * Runs the template once for each line read from stdin, or from the
+ * file given with <, replacing {} in each word with the line, or
+ * appending the line as the last argument if no word has {}. Exactly
+ * N children run at a time, the online CPU count by default, and a new
+ * one starts as soon as one exits. With -k each child's output is held
+ * in a memfd and copied out in input order; no new line is read while
+ * PARALLEL_HELD_SLOTS * N jobs are waiting behind the oldest, so a slow
+ * job can't run the shell out of descriptors. Prints the number of jobs,
+ * failures and throughput to stderr, sets last_usage to the total
+ * over every child and $? to the number of failed jobs, at most 101.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int ParallelCommand(command *cmd){
+    int err_status = 0;
+    stage *st = &cmd->stages[0];
+    char **argv = st->argv;
+    long slots = sysconf(_SC_NPROCESSORS_ONLN);
+    bool keep_order = false;
+    int i = 1;
+    for (; argv[i] != NULL && argv[i][0] == '-'; i++) {
+        const char *count = NULL;
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(argv[i], "-k") == 0) keep_order = true;
+        else if (strcmp(argv[i], "-j") == 0) count = argv[++i];
+        else if (strncmp(argv[i], "-j", 2) == 0) count = argv[i] + 2;
+        else break;
+        if (argv[i] == NULL) break;
+        if (count != NULL) {
+            char *end;
+            slots = strtol(count, &end, 10);
+            if (*count == '\0' || *end != '\0') slots = 0;
+        }
+    }
+    if (argv[i] == NULL || argv[i][0] == '-' || slots < 1) {
+        fprintf(stderr, "smallsh: parallel: usage: parallel [-j N] [-k] command [args...]\n");
+        dollar_question = 2;
+        return -1;
+    }
+    char **template = argv + i;
+    int template_count = 0;
+    bool has_placeholder = false;
+    for (; template[template_count] != NULL; template_count++) {
+        if (strstr(template[template_count], "{}") != NULL) has_placeholder = true;
+    }
+
+    // Children read /dev/null so they can't eat the input lines
+    line_reader input = {.fd = STDIN_FILENO};
+    int out_fd = STDOUT_FILENO;
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    char **child_argv = calloc(template_count + 2, sizeof *child_argv);
+    struct { job *jb; long seq; } *running = calloc(slots, sizeof *running);
+    struct { int fd; bool done; } *order = NULL;
+    long order_cap = 0;
+    if (child_argv == NULL || running == NULL) {
+        err_status = -1;
+        goto exit;
+    }
+    if (st->is_input_redirection == 1) {
+        input.fd = open(st->in_file_name, O_RDONLY | O_CLOEXEC);
+        if (input.fd == -1) {
+            fprintf(stderr, "open() failed on \"%s\"\n", st->in_file_name);
+            err_status = -1;
+            goto exit;
+        }
+    }
+    if (st->is_output_redirection == 1) {
+        out_fd = open(st->out_file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0777);
+        if (out_fd == -1) {
+            perror("target open()");
             err_status = -1;
             goto exit;
         }
     }
+    fflush(stdout);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    resource_usage total = {0};
+    long running_count = 0, seq = 0, failed = 0, next_print = 0;
+    long held_max = slots * PARALLEL_HELD_SLOTS;
+    bool input_done = false, interrupted = false;
+    for (;;) {
+        // Fill every free slot, unless too much output is held waiting for its turn
+        while (!input_done && !interrupted && running_count < slots && (!keep_order || seq - next_print < held_max)) {
+            size_t line_length;
+            char *line = ReadScriptLine(&input, &line_length);
+            if (line == NULL) {
+                input_done = true;
+                break;
+            }
+            int argc = 0;
+            for (int j = 0; j < template_count; j++) {
+                const char *word = template[j];
+                const char *placeholder = strstr(word, "{}");
+                if (placeholder == NULL) {
+                    child_argv[argc++] = (char *) word;
+                    continue;
+                }
+                // Replace every {} in the word
+                size_t size = strlen(word) + 1;
+                for (const char *p = placeholder; p != NULL; p = strstr(p + 2, "{}")) size += line_length;
+                char *arg = malloc(size), *q = arg;
+                if (arg == NULL) break;
+                for (const char *p = word; placeholder != NULL; placeholder = strstr(p, "{}")) {
+                    q = mempcpy(q, p, placeholder - p);
+                    q = mempcpy(q, line, line_length);
+                    p = placeholder + 2;
+                    word = p;
+                }
+                strcpy(q, word);
+                child_argv[argc++] = arg;
+            }
+            if (argc < template_count) { // out of memory part way through
+                for (int j = 0; j < argc; j++) {
+                    if (child_argv[j] != template[j]) free(child_argv[j]);
+                }
+                perror("malloc()");
+                err_status = -1;
+                interrupted = true;
+                break;
+            }
+            if (!has_placeholder) child_argv[argc++] = line;
+            child_argv[argc] = NULL;
+
+            stage child = {.argv = child_argv};
+            command child_cmd = {.command_array = child_argv, .stages = &child, .stage_count = 1};
+            job *jb = NewJob(&child_cmd);
+            int child_out = out_fd == STDOUT_FILENO ? -1 : out_fd;
+            if (keep_order) {
+                if (seq == order_cap) {
+                    long cap = order_cap ? order_cap * 2 : 64;
+                    void *grown = realloc(order, sizeof *order * cap);
+                    if (grown == NULL) jb = NULL;
+                    else {
+                        order = grown;
+                        order_cap = cap;
+                    }
+                }
+                child_out = jb != NULL ? memfd_create("parallel", MFD_CLOEXEC) : -1;
+                if (child_out == -1 && jb != NULL) {
+                    perror("memfd_create()");
+                    RemoveJob(jb);
+                    jb = NULL;
+                }
+            }
+            if (jb != NULL) {
+                cpu_set_t shell_cpus;
+                bool placed = PlaceJob(jb, 1, &shell_cpus);
+                AddJobProcess(jb, LaunchCommand(&child, null_fd, child_out, -1));
+                if (placed) sched_setaffinity(0, sizeof shell_cpus, &shell_cpus);
+                if (keep_order) {
+                    order[seq].fd = child_out;
+                    order[seq].done = false;
+                }
+                running[running_count].jb = jb;
+                running[running_count].seq = seq++;
+                running_count++;
+            }
+            for (int j = 0; j < argc; j++) {
+                if (child_argv[j] != line && (j >= template_count || child_argv[j] != template[j])) free(child_argv[j]);
+            }
+            if (jb == NULL) {
+                err_status = -1;
+                interrupted = true;
+            }
+        }
+
+        // Collect every finished child, including ones that never started
+        for (long j = 0; j < running_count;) {
+            job *jb = running[j].jb;
+            if (jb->live_count > 0) {
+                j++;
+                continue;
+            }
+            if (JobStatus(jb) != 0) failed++;
+            resource_usage usage = JobUsage(jb);
+            total.user += usage.user;
+            total.sys += usage.sys;
+            if (usage.max_rss > total.max_rss) total.max_rss = usage.max_rss;
+            total.major_faults += usage.major_faults;
+            total.minor_faults += usage.minor_faults;
+            if (keep_order) order[running[j].seq].done = true;
+            RemoveJob(jb);
+            running[j] = running[--running_count];
+        }
+        // Copy out held output that is next in input order
+        while (keep_order && next_print < seq && order[next_print].done) {
+            int fd = order[next_print++].fd;
+            off_t offset = 0, size = lseek(fd, 0, SEEK_END);
+            ssize_t sent = 0;
+            while (offset < size && (sent = sendfile(out_fd, fd, &offset, size - offset)) > 0);
+            if (sent == -1) { // sendfile can't write to an O_APPEND file, copy it instead
+                char buf[8192];
+                ssize_t n;
+                while ((n = pread(fd, buf, sizeof buf, offset)) > 0 && write(out_fd, buf, n) == n) offset += n;
+            }
+            close(fd);
+        }
+
+        if (running_count == 0 && (input_done || interrupted)) break;
+        if (running_count < slots && !input_done && !interrupted && (!keep_order || seq - next_print < held_max)) {
+            continue;
+        }
+        int events = WaitForEvents(-1);
+        if (events & EVENT_CHILD) ManageBackgroundProcesses();
+        if (events & EVENT_INTERRUPT) interrupted = true;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    total.real = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    last_usage = total;
+    if (interrupted && interactive) fputc('\n', stderr); // past the echoed ^C
+    fprintf(stderr, "parallel: %ld jobs, %ld failed, %.3fs, %.1f jobs/s\n", seq, failed, total.real,
+            total.real > 0 ? seq / total.real : 0.0);
+    if (interrupted && err_status == 0) dollar_question = 128 + SIGINT;
+    else dollar_question = failed > 101 ? 101 : (int) failed;
+
     exit:
+    if (input.fd != -1 && input.fd != STDIN_FILENO) close(input.fd);
+    if (out_fd != STDOUT_FILENO && out_fd != -1) close(out_fd);
+    if (null_fd != -1) close(null_fd);
+    free(input.buf);
+    free(child_argv);
+    free(running);
+    free(order);
     return err_status;
 }
 
 /*********************************************************************
- * ManageBackgroundProcesses()
- * Waits for any child processes to terminate or stop.
- * Prints message to stderr if child process was stopped, signaled, or exited.
+ * PidMapFind()
+ * Find the slot for a live child process in pid_map.
+ * @param pid_t pid
+ * @return: the slot, NULL if pid is not a live child
+ *********************************************************************/
+static pid_slot *PidMapFind(pid_t pid){
+    if (pid_map_cap == 0 || pid <= 0) return NULL;
+    for (size_t i = (size_t) pid & (pid_map_cap - 1);; i = (i + 1) & (pid_map_cap - 1)) {
+        if (pid_map[i].pid == pid) return &pid_map[i];
+        if (pid_map[i].pid == 0) return NULL;
+    }
+}
+
+/*********************************************************************
+ * PidMapInsert()
+ * Add a child process to pid_map, rebuilding it without deleted slots
+ * once they and the live ones fill half of it. The rebuild keeps the
+ * size while live children use a quarter of it or less, so a long
+ * session of short-lived children doesn't grow the map.
+ * @param pid_t pid
+ * @param job* jb - the job the process belongs to
+ * @param int index - the process's index in the job
+ * @return: 0 if successful, -1 if out of memory
+ *********************************************************************/
+static int PidMapInsert(pid_t pid, job *jb, int index){
+    if ((pid_map_used + 1) * 2 > pid_map_cap) {
+        size_t live = 0;
+        for (size_t i = 0; i < pid_map_cap; i++) live += pid_map[i].pid > 0;
+        size_t cap = pid_map_cap ? pid_map_cap : 64;
+        if (live * 4 > cap) {
+            while ((live + 1) * 2 > cap) cap *= 2;
+            if (cap == pid_map_cap) cap *= 2;
+        }
+        pid_slot *map = calloc(cap, sizeof *map);
+        if (map == NULL) return -1;
+        pid_map_used = 0;
+        for (size_t i = 0; i < pid_map_cap; i++) {
+            if (pid_map[i].pid <= 0) continue;
+            size_t j = (size_t) pid_map[i].pid & (cap - 1);
+            while (map[j].pid != 0) j = (j + 1) & (cap - 1);
+            map[j] = pid_map[i];
+            pid_map_used++;
+        }
+        free(pid_map);
+        pid_map = map;
+        pid_map_cap = cap;
+    }
+    size_t i = (size_t) pid & (pid_map_cap - 1);
+    while (pid_map[i].pid > 0) i = (i + 1) & (pid_map_cap - 1);
+    if (pid_map[i].pid == 0) pid_map_used++;
+    pid_map[i].pid = pid;
+    pid_map[i].jb = jb;
+    pid_map[i].index = index;
+    return 0;
+}
+
+/*********************************************************************
+ * HashIndex()
+ * FNV-1a hash of a command name, reduced to a command_hash bucket.
+ * @param const char* name
+ * @return: bucket index
+ *********************************************************************/
+static size_t HashIndex(const char *name){
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
+    }
+    return hash % HASH_BUCKETS;
+}
+
+/*********************************************************************
+ * SearchPath()
+ * Walk PATH the way execvp does and return the first executable
+ * regular file named name. An empty PATH element means the current
+ * directory.
+ * @param const char* name
+ * @param const char* path_value - PATH to search
+ * @return: malloc'd path, NULL if not found
+ *********************************************************************/
+static char *SearchPath(const char *name, const char *path_value){
+    size_t name_len = strlen(name);
+    const char *dir = path_value;
+    for (;;) {
+        const char *end = strchr(dir, ':');
+        size_t dir_len = end ? (size_t) (end - dir) : strlen(dir);
+        char *candidate = malloc(dir_len + name_len + 2);
+        if (candidate == NULL) return NULL;
+        if (dir_len == 0) {
+            memcpy(candidate, name, name_len + 1);
+        } else {
+            memcpy(candidate, dir, dir_len);
+            candidate[dir_len] = '/';
+            memcpy(candidate + dir_len + 1, name, name_len + 1);
+        }
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+        if (end == NULL) return NULL;
+        dir = end + 1;
+    }
+}
+
+/*********************************************************************
+ * HashLookup()
+ * Return the location of a command, resolving and caching it on a miss.
+ * Names containing a slash are used as given. The whole cache is
+ * dropped when PATH no longer matches the value it was built for.
+ * @param const char* name
+ * @return: path to execute, NULL if the command was not found
+ *********************************************************************/
+static const char *HashLookup(const char *name){
+    if (strchr(name, '/') != NULL) return name;
+
+    const char *path_value = getenv("PATH");
+    if (path_value == NULL) path_value = "/bin:/usr/bin";
+    if (hash_path_value == NULL || strcmp(hash_path_value, path_value) != 0) {
+        HashClear();
+        hash_path_value = strdup(path_value);
+    }
+
+    size_t index = HashIndex(name);
+    for (hash_entry *entry = command_hash[index]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            entry->hits++;
+            hash_hits++;
+            return entry->path;
+        }
+    }
+
+    hash_misses++;
+    char *path = SearchPath(name, path_value);
+    if (path == NULL) return NULL;
+    hash_entry *entry = malloc(sizeof *entry);
+    if (entry == NULL) {
+        free(path);
+        return NULL;
+    }
+    entry->name = strdup(name);
+    entry->path = path;
+    entry->hits = 0;
+    entry->next = command_hash[index];
+    command_hash[index] = entry;
+    return entry->path;
+}
+
+/*********************************************************************
+ * HashForget()
+ * Drop the cached location of a command, e.g. after exec reports ENOENT.
+ * @param const char* name
+ *********************************************************************/
+static void HashForget(const char *name){
+    hash_entry **link = &command_hash[HashIndex(name)];
+    for (; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) == 0) {
+            hash_entry *entry = *link;
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+    }
+}
+
+/*********************************************************************
+ * HashClear()
+ * Drop every cached command location.
+ *********************************************************************/
+static void HashClear(void){
+    for (size_t i = 0; i < HASH_BUCKETS; i++) {
+        while (command_hash[i] != NULL) {
+            hash_entry *entry = command_hash[i];
+            command_hash[i] = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+    }
+    free(hash_path_value);
+    hash_path_value = NULL;
+}
+
+/*********************************************************************
+ * HashCommand()
+ * Handles hash command.
+ * If no argument, lists cached command locations and their hits.
+ * -r clears the cache, -s prints the hit/miss counters.
+ * Any other argument is looked up and cached ahead of time.
+ * @param cmd: command struct
  * @return: 0 if successful, -1 if error
  *********************************************************************/
-static int ManageBackgroundProcesses(){
-    int child_status; pid_t my_pid = getpid();
-    pid_t child_pid = waitpid(-my_pid, &child_status, WNOHANG | WUNTRACED); // Get any child with same group PID as smallsh.
-    while (child_pid > 0) {
-        if (WIFSTOPPED(child_status)) {
-            if (kill(child_pid, SIGCONT) < 0) goto exit;
-            if (fprintf(stderr, "Child process %jd stopped. Continuing.\n", (intmax_t) child_pid)) goto exit;
+static int HashCommand(command *cmd){
+    int err_status = 0;
+    if (cmd->command_array[1] == NULL) { // no argument, list the cache
+        printf("hits\tcommand\n");
+        for (size_t i = 0; i < HASH_BUCKETS; i++) {
+            for (hash_entry *entry = command_hash[i]; entry != NULL; entry = entry->next) {
+                printf("%4lu\t%s\n", entry->hits, entry->path);
+            }
         }
-        else if (WIFSIGNALED(child_status)) {
-            if (fprintf(stderr, "Child process %jd done. Signaled %d.\n", (intmax_t) child_pid,
-                        WTERMSIG(child_status)) < 0)
-                goto exit;
+        goto exit;
+    }
+    for (int i = 1; cmd->command_array[i] != NULL; i++) {
+        if (strcmp(cmd->command_array[i], "-r") == 0) {
+            HashClear();
+            hash_hits = 0;
+            hash_misses = 0;
+        }
+        else if (strcmp(cmd->command_array[i], "-s") == 0) {
+            printf("hash: %lu hits, %lu misses\n", hash_hits, hash_misses);
         }
-        else if (WIFEXITED(child_status)) {
-            if (fprintf(stderr, "Child process %jd done. Exit status %d.\n", (intmax_t) child_pid,
-                        WEXITSTATUS(child_status)) < 0) goto exit;
+        else if (strchr(cmd->command_array[i], '/') == NULL) {
+            // Pre-warm without counting the lookup as a use
+            unsigned long hits = hash_hits, misses = hash_misses;
+            if (HashLookup(cmd->command_array[i]) == NULL) {
+                fprintf(stderr, "smallsh: hash: %s: not found\n", cmd->command_array[i]);
+                err_status = -1;
+            }
+            hash_hits = hits;
+            hash_misses = misses;
         }
-        // Get next child
-        child_pid = waitpid(-my_pid, &child_status, WNOHANG | WUNTRACED);
     }
     exit:
-    return errno ? -1 : 0;
+    fflush(stdout);
+    return err_status;
 }
 
 /*********************************************************************
- * KillChildrenProcesses()
- * Kills all child processes of parent_pid using Signal.
- * Will not produce an error if there are no child processes.
- * @param pid_t parent_pid
- * @param int Signal
+ * TraceStart()
+ * Start timing a stage. With tracing off this is a single test.
+ * @return: the time in ns, 0 if tracing is off
+ *********************************************************************/
+static uint64_t TraceStart(void){
+    if (!trace.enabled) return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*********************************************************************
+ * TraceEnd()
+ * Record a stage that started at start: claim the next ring slot,
+ * write it under its sequence number, and count it in the stage's
+ * histogram. Safe to call from forked children, which share the ring.
+ * @param trace_stage stage
+ * @param uint64_t start - from TraceStart, 0 to record nothing
+ *********************************************************************/
+static void TraceEnd(trace_stage stage, uint64_t start){
+    if (start == 0) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t duration = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec - start;
+    trace_ring *ring = trace.ring;
+
+    uint64_t index = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    trace_event *event = &ring->events[index & (TRACE_EVENTS - 1)];
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event->start = start;
+    event->duration = duration;
+    event->pid = getpid();
+    event->stage = stage;
+    __atomic_store_n(&event->seq, index + 1, __ATOMIC_RELEASE);
+
+    int bucket = 63 - __builtin_clzll(duration | 1);
+    __atomic_fetch_add(&ring->counts[stage][bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ring->total[stage], duration, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&ring->max[stage], __ATOMIC_RELAXED);
+    while (duration > max && !__atomic_compare_exchange_n(&ring->max[stage], &max, duration, true,
+                                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*********************************************************************
+ * TraceEnable()
+ * Turn tracing on, mapping the ring the first time.
  * @return: 0 if successful, -1 if error
  *********************************************************************/
-int KillChildrenProcesses(pid_t parent_pid, int signal){
-    int child_status;
-    pid_t child_pid = waitpid(-parent_pid, &child_status, WNOHANG); // Get any child with same group PID as smallsh.
-    while (child_pid > 0) {
-        if (kill(child_pid, signal) < 0) goto exit;
-        // Get next child
-        child_pid = waitpid(-parent_pid, &child_status, WNOHANG);
+static int TraceEnable(void){
+    if (trace.ring == NULL) {
+        trace_ring *ring = mmap(NULL, sizeof *ring, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) {
+            perror("smallsh: trace: mmap()");
+            return -1;
+        }
+        trace.ring = ring;
     }
-    exit:
-    return errno ? -1 : 0;
+    trace.enabled = true;
+    return 0;
+}
+
+/*********************************************************************
+ * TraceRead()
+ * Copy an event out of the ring, unless it is being written or has
+ * been overwritten since.
+ * @param uint64_t index - event number
+ * @param trace_event* event
+ * @return: true if the copy is that event, whole
+ *********************************************************************/
+static bool TraceRead(uint64_t index, trace_event *event){
+    trace_event *slot = &trace.ring->events[index & (TRACE_EVENTS - 1)];
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    *event = *slot;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return seq == index + 1 && __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/*********************************************************************
+ * TraceOpenStream()
+ * Turn tracing on and stream its events to a file in the Chrome trace
+ * event format, which Perfetto and chrome://tracing open. The array is
+ * left unclosed, which the format allows, so the file is valid at any
+ * point.
+ * @param const char* path
+ *********************************************************************/
+static void TraceOpenStream(const char *path){
+    trace.stream = fopen(path, "w");
+    if (trace.stream == NULL) {
+        fprintf(stderr, "smallsh: SMALLSH_TRACE: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if (TraceEnable() < 0) {
+        fclose(trace.stream);
+        trace.stream = NULL;
+        return;
+    }
+    fcntl(fileno(trace.stream), F_SETFD, FD_CLOEXEC);
+    fprintf(trace.stream, "[\n");
+    trace.owner = getpid();
+    trace.flushed = __atomic_load_n(&trace.ring->head, __ATOMIC_ACQUIRE);
+    atexit(TraceFlush);
+}
+
+/*********************************************************************
+ * TraceFlush()
+ * Write the events recorded since the last flush to the SMALLSH_TRACE
+ * file. Runs once per command line, so events overwritten in the ring
+ * before then are counted as dropped instead.
+ *********************************************************************/
+static void TraceFlush(void){
+    if (trace.stream == NULL || getpid() != trace.owner) return;
+    uint64_t head = __atomic_load_n(&trace.ring->head, __ATOMIC_ACQUIRE);
+    if (head - trace.flushed > TRACE_EVENTS) {
+        fprintf(trace.stream, "{\"name\":\"dropped\",\"ph\":\"i\",\"s\":\"g\",\"ts\":0,\"pid\":%d,\"args\":{\"events\":%llu}},\n",
+                (int) trace.owner, (unsigned long long) (head - trace.flushed - TRACE_EVENTS));
+        trace.flushed = head - TRACE_EVENTS;
+    }
+    for (; trace.flushed < head; trace.flushed++) {
+        trace_event event;
+        if (!TraceRead(trace.flushed, &event)) continue;
+        fprintf(trace.stream, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d},\n",
+                trace_stage_names[event.stage], event.start / 1e3, event.duration / 1e3, (int) trace.owner, event.pid);
+    }
+    fflush(trace.stream);
+}
+
+/*********************************************************************
+ * TraceCommand()
+ * Handles trace command.
+ * trace on and trace off start and stop recording, trace -r clears
+ * what has been recorded, and trace prints each stage's count, mean
+ * and maximum with a histogram of its latencies.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int TraceCommand(command *cmd){
+    const char *arg = cmd->command_array[1];
+    if (arg != NULL && cmd->command_array[2] == NULL) {
+        if (strcmp(arg, "on") == 0) return TraceEnable();
+        if (strcmp(arg, "off") == 0) {
+            trace.enabled = false;
+            return 0;
+        }
+        if (strcmp(arg, "-r") == 0) {
+            if (trace.ring == NULL) return 0;
+            TraceFlush();
+            memset(trace.ring->counts, 0, sizeof trace.ring->counts);
+            memset(trace.ring->total, 0, sizeof trace.ring->total);
+            memset(trace.ring->max, 0, sizeof trace.ring->max);
+            return 0;
+        }
+    }
+    if (arg != NULL) {
+        fprintf(stderr, "smallsh: trace: usage: trace [on|off|-r]\n");
+        return -1;
+    }
+    if (trace.ring == NULL) {
+        printf("trace: off, nothing recorded\n");
+        fflush(stdout);
+        return 0;
+    }
+
+    printf("trace: %s, %llu events\n", trace.enabled ? "on" : "off",
+           (unsigned long long) __atomic_load_n(&trace.ring->head, __ATOMIC_ACQUIRE));
+    for (int stage = 0; stage < TRACE_STAGES; stage++) {
+        uint64_t count = 0, most = 0;
+        for (int i = 0; i < TRACE_BUCKETS; i++) {
+            uint64_t n = __atomic_load_n(&trace.ring->counts[stage][i], __ATOMIC_RELAXED);
+            count += n;
+            if (n > most) most = n;
+        }
+        if (count == 0) continue;
+        printf("%-9s %8llu   mean %10.3fus   max %10.3fus\n", trace_stage_names[stage], (unsigned long long) count,
+               trace.ring->total[stage] / 1e3 / count, trace.ring->max[stage] / 1e3);
+        for (int i = 0; i < TRACE_BUCKETS; i++) {
+            uint64_t n = trace.ring->counts[stage][i];
+            if (n == 0) continue;
+            char bar[41];
+            int width = (int) ((n * 40 + most - 1) / most);
+            memset(bar, '#', width);
+            bar[width] = '\0';
+            printf("  %12.3fus .. %12.3fus %8llu %s\n", ((uint64_t) 1 << i) / 1e3, 2.0 * ((uint64_t) 1 << i) / 1e3,
+                   (unsigned long long) n, bar);
+        }
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/*********************************************************************
+ * ArenaAlloc()
+ * Allocate from the line arena. Memory is only released, all at once,
+ * by ArenaReset. Blocks are kept and reused, so once the arena has grown
+ * to fit the largest line it stops calling malloc.
+ * @param size_t size
+ * @return: 16 byte aligned memory, NULL if out of memory
+ *********************************************************************/
+static void *ArenaAlloc(size_t size){
+    size = (size + 15) & ~(size_t) 15;
+    arena_block *block = line_arena.current;
+    if (block == NULL || block->size - block->used < size) {
+        // Move on to the next kept block, or add one big enough
+        arena_block *next = block ? block->next : line_arena.first;
+        if (next == NULL || next->size < size) {
+            size_t block_size = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+            arena_block *new_block = malloc(sizeof *new_block + block_size);
+            if (new_block == NULL) return NULL;
+            new_block->size = block_size;
+            new_block->next = next;
+            if (block) block->next = new_block;
+            else line_arena.first = new_block;
+            line_arena.capacity += block_size;
+            next = new_block;
+        }
+        next->used = 0;
+        line_arena.current = block = next;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    line_arena.in_use += size;
+    if (line_arena.in_use > line_arena.peak) line_arena.peak = line_arena.in_use;
+    return ptr;
+}
+
+/*********************************************************************
+ * ArenaStrndup()
+ * Copy len bytes of str into the line arena and NUL terminate it.
+ * @param const char* str
+ * @param size_t len
+ * @return: the copy, NULL if out of memory
+ *********************************************************************/
+static char *ArenaStrndup(const char *str, size_t len){
+    char *copy = ArenaAlloc(len + 1);
+    if (copy == NULL) return NULL;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/*********************************************************************
+ * ArenaReset()
+ * Release everything allocated from the line arena in O(1).
+ *********************************************************************/
+static void ArenaReset(void){
+    line_arena.current = line_arena.first;
+    if (line_arena.first) line_arena.first->used = 0;
+    line_arena.in_use = 0;
+}
+
+/*********************************************************************
+ * ArenaMark()
+ * Remember how much of the line arena is in use.
+ * @return: the mark to pass to ArenaRelease
+ *********************************************************************/
+static arena_mark ArenaMark(void){
+    arena_block *block = line_arena.current;
+    return (arena_mark) {.block = block, .used = block ? block->used : 0, .in_use = line_arena.in_use};
+}
+
+/*********************************************************************
+ * ArenaRelease()
+ * Release everything allocated from the line arena since a mark. The
+ * blocks after it are kept for reuse, like ArenaReset does.
+ * @param arena_mark mark
+ *********************************************************************/
+static void ArenaRelease(arena_mark mark){
+    line_arena.current = mark.block;
+    if (mark.block) mark.block->used = mark.used;
+    line_arena.in_use = mark.in_use;
+}
+
+/*********************************************************************
+ * ArenaCommand()
+ * Handles arena command.
+ * Prints the line arena's current and peak usage and its capacity.
+ * @param cmd: command struct
+ * @return: 0 if successful, -1 if error
+ *********************************************************************/
+static int ArenaCommand(command *cmd){
+    if (cmd->command_array[1] != NULL) { // too many arguments
+        fprintf(stderr, "smallsh: arena: too many arguments\n");
+        return -1;
+    }
+    printf("arena: %zu bytes in use, %zu peak, %zu capacity\n",
+           line_arena.in_use, line_arena.peak, line_arena.capacity);
+    fflush(stdout);
+    return 0;
 }
@@ -0,0 +1,40 @@
+# in-process built-ins: output, status and redirection of the shell's own fds
+echo plain words
+echo -n no-newline; echo
+echo -e 'tab\there' '\101\0102'
+echo -E 'raw\t' -n
+echo -x
+printf '%s=%d %5.2f|%-4s|%x %c%%\n' n 42 3.14159 ab 255 xyz
+printf '%s\n' a b c
+printf '%b\n' 'esc\tape'
+printf '%d\n' 12abc
+echo status $?
+printf
+echo status $?
+echo redirected > out
+printf 'more\n' > out2
+pwd > out3
+cat out out2
+test "$(cat out3)" = "$(pwd)"; echo pwd-status $?
+echo after redirect
+test abc = abc; echo test $?
+test abc = abd; echo test $?
+[ 3 -lt 10 ]; echo bracket $?
+[ 3 -lt 10; echo bracket $?
+test ! -f .; echo test $?
+true; echo true $?
+false; echo false $?
+:; echo colon $?
+true < nosuchfile
+echo status $?
+mkdir d
+cd d; pwd > ../here; cd ..
+cat here > /dev/null; echo cd $?
+cd nosuchdir
+echo status $?
+echo full > /dev/full
+echo status $?
+pwd > /dev/full
+echo status $?
+echo piped | tr a-z A-Z
+echo status $?
@@ -0,0 +1,24 @@
+# parsed-line cache: repeated lines hit, their expansions are redone,
+# and a new IFS or cache -r drops it
+cache
+export N=1
+echo n is $N
+export N=2
+echo n is $N
+echo n is $N > out
+echo n is $N > out
+cat out
+cache
+for i in 1 2 3; do echo loop $i; done
+for i in 1 2 3; do echo loop $i; done
+cache
+echo a:b
+export IFS=:
+echo:a b
+cache
+unset:IFS
+echo a:b
+cache -r
+cache
+cache -x
+echo status $?
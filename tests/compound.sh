@@ -0,0 +1,29 @@
+# compound commands as pipeline stages, redirected and in the background
+for x in c a b; do echo $x; done > out
+cat out
+for x in c a b; do echo $x; done | sort
+if true; then echo yes; fi > f2; cat f2
+{ echo one; echo two; } | cat
+printf 'l1\nl2\n' | { cat; echo end; }
+echo hi | if true; then cat; fi | tr a-z A-Z
+{ echo in; } < out > o3; cat o3
+{ cat; } < out
+for y in 1 2; do
+  echo y$y
+done > multi
+cat multi
+: | while false; do :; done; echo while-status $?
+{ false; } | cat; echo pipe-status $?
+if true; then echo $1 $2; fi > pos; cat pos
+f() { for a in 1 2 3; do echo $a; done | sort -r; }
+f
+for x in 1 2; do
+  for y in a b; do echo $x$y; done | tr a-z A-Z
+done > nested
+cat nested
+{ echo background; } > bg & wait
+cat bg
+while true; do break; done > empty; echo break $?
+{ echo x; } >
+f() { :; } > g
+echo done
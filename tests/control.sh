@@ -0,0 +1,62 @@
+# if/elif/else, nested loops, break and continue with levels
+if true; then echo if-then; else echo wrong; fi
+if false; then echo wrong; elif test 1 = 1; then echo elif; else echo wrong; fi
+if false; then echo wrong; elif false; then echo wrong; else echo else; fi
+if false
+then
+  echo wrong
+else
+  if true; then echo nested-if; fi
+fi
+if false; then echo wrong; fi
+echo if-none $?
+
+for x in a b c; do
+  for y in 1 2 3; do
+    if test $y = 2; then continue; fi
+    if test $x = c; then break 2; fi
+    echo $x$y
+  done
+done
+echo after-break $?
+
+for x in a b; do
+  for y in 1 2; do
+    if test $y = 1; then continue 2; fi
+    echo never $x$y
+  done
+  echo never-outer $x
+done
+echo continue-2 done
+
+export N=x
+while test $N != xxxx; do
+  export N=${N}x
+  until true; do echo never-until; done
+  echo while n=$N
+done
+while false; do echo never; done
+echo while-false $?
+
+export STOP=
+until test -n "$STOP"; do
+  for i in 1 2; do echo until $i; done
+  export STOP=1
+done
+
+export N=
+while true; do
+  export N=${N}x
+  for i in 1 2 3; do
+    if test $i = 2; then break; fi
+    echo inner $N $i
+  done
+  if test $N = xx; then break; fi
+done
+echo loops done
+
+for w; do echo positional $w; done
+for w in; do echo never; done
+{ echo group1; echo group2; }
+break
+echo stray-break $?
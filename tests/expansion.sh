@@ -0,0 +1,22 @@
+# variable expansion in one pass: $NAME, ${NAME}, $?, $$, $!, ~/ and
+# values that contain $ are not expanded again
+export A=apple B='$A' EMPTY=
+echo $A ${A}s $A$A x${A}y
+echo $B
+echo [$EMPTY] [$UNSET] [${UNSET}]
+echo ${A
+echo $ lone$ $1x
+false
+echo $? $?
+true
+echo $?
+test $$ -gt 1; echo pid $?
+echo [$!]
+sleep 0 & wait
+test -n "$!"; echo bang $?
+echo ~ x~/sub
+test ~/sub = $HOME/sub; echo tilde $?
+echo $A > $A.txt
+cat apple.txt
+export PATHLIKE=$HOME/bin:$A
+test $PATHLIKE = $HOME/bin:apple; echo nested $?
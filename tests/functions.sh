@@ -0,0 +1,49 @@
+# functions, return, shift and positional parameters
+echo script $0 args $@ count $#
+greet() {
+  echo hello $1 from $0 count $#
+  return 3
+}
+greet world
+echo ret $?
+greet world | cat
+echo piped-ret $?
+
+count () { for a; do echo arg $a; done; }
+count p q r
+echo outer args $@ count $#
+
+fact() {
+  if test $1 = xxx; then echo base; return 0; fi
+  echo depth $1
+  fact ${1}x
+}
+fact x
+
+early() {
+  for i in 1 2 3; do
+    if test $i = 2; then return 7; fi
+    echo early $i
+  done
+  echo never
+}
+early
+echo early-ret $?
+
+shifter() {
+  shift
+  echo after-shift $@ count $#
+  shift 2
+  echo after-shift-2 $@ count $#
+}
+shifter 1 2 3 4
+
+pwd() { printf 'shadowed pwd %s\n' "$@"; }
+pwd -P
+f() { printf 'redefined %s\n' once; }
+f() { printf 'redefined %s\n' twice; }
+f
+
+shift
+printf 'script shifted %s %s\n' "$@" "$#"
+return 5
@@ -0,0 +1,27 @@
+# glob expansion
+mkdir -p src/sub/deep .hidden empty
+touch a.c b.c c.h .dot.c 'x*y' 'q?' src/m.c src/n.h src/sub/s.c src/sub/deep/d.c .hidden/h.c '[ab]'
+echo *.c
+echo *
+echo .*
+echo ?.c
+echo [ab].c
+echo [!a].c
+echo src/*
+echo */*.c
+echo **/*.c
+echo src/**
+echo */
+echo nomatch*.zz
+echo "*.c" '*.c' \*.c
+echo x\*y x'*'*
+echo '[ab]' [[]ab]
+echo q? q\?
+echo empty/*
+echo src/../s*/m.?
+export V='*.c'
+echo $V
+echo $(echo '*.c')
+for f in src/*.?; do echo loop $f; done
+touch new.c
+echo *.c
@@ -0,0 +1,27 @@
+# cached command locations: hits, -s, -r, stale entries and PATH changes
+hash
+ls > /dev/null
+ls > /dev/null
+cat < /dev/null
+hash
+hash -s
+hash -r
+hash
+hash -s
+mkdir b1 b2
+printf '#!/bin/sh\necho tool one\n' > b1/tool
+printf '#!/bin/sh\necho tool two\n' > b2/tool
+chmod +x b1/tool b2/tool
+export PATH=b1:b2:/usr/bin:/bin
+tool
+hash tool
+hash
+rm b1/tool
+tool
+hash
+export PATH=b1:/usr/bin:/bin
+tool
+echo status $?
+hash
+hash nosuch
+echo status $?
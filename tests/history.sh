@@ -0,0 +1,15 @@
+# history at a terminal prompt, run under script(1) for a pty: the log,
+# !!, !N and !prefix with the rest of the line appended, across sessions
+export SMALLSH_HISTFILE=$HOME/log
+printf 'echo one\necho two\n!echo three\n!1 four\n!!\n!nosuch\nhistory > list\nexit\n' > session1
+printf '!echo five\nhistory 2 > last\nhistory -s four > found\nexit\n' > session2
+script -qec $SMALLSH /dev/null < session1 > /dev/null
+echo log:
+cat log
+echo list:
+cat list
+script -qec $SMALLSH /dev/null < session2 > /dev/null
+echo last:
+cat last
+echo found:
+cat found
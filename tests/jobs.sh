@@ -0,0 +1,18 @@
+# job table: jobs, wait for one job or all, $! and statuses of
+# background jobs, and a finished job reported before the next line,
+# with its pid replaced by N
+sleep 0.3 & jobs
+sh -c 'exit 5' & wait $!; echo wait-pid $?
+sh -c 'exit 6' & wait %2; echo wait-job $?
+jobs
+wait; echo wait-all $?
+jobs
+wait %9
+echo status $?
+fg
+echo status $?
+sh -c 'sleep 0.1; kill -TERM $$' & wait $!; echo killed $?
+sleep 0.1 | sleep 0.1 & jobs
+wait
+printf 'sleep 0.1 &\nsleep 0.3\necho reported\n' > finish
+sh -c '$SMALLSH finish 2>&1 | sed "s/[0-9][0-9]*/N/g"'
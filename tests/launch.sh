@@ -0,0 +1,14 @@
+# both launch engines: exit statuses, redirections, a missing command,
+# and signals ignored when smallsh starts stay ignored in its children
+printf '/bin/echo spawned\n/bin/sh -c "exit 7"\necho status $?\nnosuchcommand\necho status $?\n/bin/cat < in > out\n/bin/cat out\nsh -c "kill -INT \\$\\$; echo survived"\necho status $?\n' > lines
+echo hello > in
+echo default engine:
+$SMALLSH lines
+echo fork engine:
+export SMALLSH_SPAWN=fork
+$SMALLSH lines
+unset SMALLSH_SPAWN
+echo with SIGINT ignored:
+sh -c 'trap "" INT; exec $SMALLSH lines'
+export SMALLSH_SPAWN=fork
+sh -c 'trap "" INT; exec $SMALLSH lines'
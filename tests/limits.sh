@@ -0,0 +1,22 @@
+# ulimit and the limit prefix's option checking; cgroup placement itself
+# depends on the host, so only what happens before it is checked
+ulimit -S -n 32
+ulimit -n
+ulimit -S -n
+sh -c 'ulimit -n'
+ulimit -n 48
+ulimit -H -n
+ulimit -n 49
+echo status $?
+ulimit -n abc
+echo status $?
+ulimit -q
+echo status $?
+limit -m 10Q true
+echo status $?
+limit -c 0 true
+echo status $?
+limit -p
+echo status $?
+limit -x true
+echo status $?
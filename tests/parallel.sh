@@ -0,0 +1,13 @@
+# parallel: {} substitution, appended lines, -k ordering, failure count
+# and input from a file; the timing summary is reduced to its counts
+seq 1 6 > lines
+sh -c '$SMALLSH -c "parallel -k -j 3 echo item {} {}x < lines; echo status \$?" 2>&1 | sed "s/, [0-9.]*s, .*//"'
+sh -c '$SMALLSH -c "parallel -j 2 echo appended < lines" 2>/dev/null | sort'
+printf '0\n3\n0\n1\n' > codes
+sh -c '$SMALLSH -c "parallel -k -j 4 sh -c \"exit {}\" < codes; echo status \$?" 2>&1 | sed "s/, [0-9.]*s, .*//"'
+printf '0.3\n0.1\n0.2\n' > delays
+sh -c '$SMALLSH -c "parallel -k -j 3 sh -c \"sleep {}; echo slept {}\" < delays" 2>/dev/null'
+parallel -j 0 echo x < lines
+echo status $?
+parallel
+echo status $?
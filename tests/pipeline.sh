@@ -0,0 +1,23 @@
+# pipelines: data flow, per-stage redirection and the pipefail status
+printf 'b\na\nc\na\na\nb\n' | sort | uniq -c | sort -rn
+echo one two three | tr ' ' '\n' | wc -l
+printf 'x\ny\n' > in
+cat < in | tr a-z A-Z > out
+cat out
+sort -r < in | head -n 1
+true | true; echo status $?
+false | true; echo status $?
+true | false; echo status $?
+sh -c 'exit 3' | sh -c 'exit 4' | true; echo status $?
+sh -c 'exit 3' | true | true; echo status $?
+sh -c 'kill -TERM $$' | true; echo status $?
+yes | head -n 2
+echo status $?
+cat in | nosuchcommand | cat; echo status $?
+echo a | | cat
+echo status $?
+echo a |
+echo status $?
+printf 'p\nq\n' | cat | cat | cat | cat | cat | cat | cat | cat
+seq 1 5 | tail -n 2 & wait
+echo background status $?
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Regression tests: runs each tests/NAME.sh with smallsh, with the
+# arguments A B C, in an empty scratch directory, and diffs its stdout
+# and stderr together against tests/NAME.out. $SMALLSH is the shell
+# under test, for scripts that start another one.
+# Usage: tests/run.sh [path/to/smallsh]   (make check builds and runs it)
+# Set UPDATE=1 to rewrite the .out files from the current output.
+
+dir=$(cd "$(dirname "$0")" && pwd)
+shell=$(cd "$(dirname "${1:-./smallsh}")" && pwd)/$(basename "${1:-./smallsh}")
+failed=0
+total=0
+for script in "$dir"/*.sh; do
+    name=$(basename "$script" .sh)
+    [ "$name" = run ] && continue
+    total=$((total + 1))
+    scratch=$(mktemp -d)
+    actual=$(mktemp)
+    # $0 is shown relative to the repository
+    (cd "$scratch" && HOME="$scratch" PATH=/usr/bin:/bin SMALLSH="$shell" "$shell" "$script" A B C 2>&1; echo "exit $?") |
+        sed "s|$dir/|tests/|g" >"$actual"
+    if [ -n "$UPDATE" ]; then
+        cp "$actual" "$dir/$name.out"
+    elif ! diff -u "$dir/$name.out" "$actual" >"$actual.diff"; then
+        echo "FAIL $name"
+        sed 's/^/    /' "$actual.diff"
+        failed=$((failed + 1))
+    else
+        echo "ok   $name"
+    fi
+    rm -rf "$scratch" "$actual" "$actual.diff"
+done
+echo "$((total - failed))/$total passed"
+[ "$failed" -eq 0 ]
@@ -0,0 +1,22 @@
+# script and -c modes: arguments, #! lines, a last line with no newline,
+# scripts on stdin and long scripts read from a mapping
+echo args $# $1 $2 $3
+echo name $0
+printf '#!/bin/false\necho from $0 $1\necho no newline' > s
+$SMALLSH s x
+echo
+$SMALLSH -c 'echo dash-c $0 $1 $#' name one two
+$SMALLSH -c 'echo dash-c
+echo second line'
+$SMALLSH -c
+echo status $?
+$SMALLSH nosuchscript
+echo status $?
+printf 'echo piped script\n' | $SMALLSH /dev/stdin
+seq 1 100000 | sed 's/^/# comment /' > comments
+echo 'echo end of long script' > last
+cat comments last > long
+$SMALLSH long
+printf 'exit 3\necho not reached\n' > e
+$SMALLSH e
+echo status $?
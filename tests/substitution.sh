@@ -0,0 +1,34 @@
+# command substitution in every stage position, with IFS splitting
+echo [$(echo a b)]
+echo "[$(printf 'a\n\n')]"
+echo x$(echo $(echo nested))y
+echo "$(echo "quoted )")"
+printf '<%s>' $(printf '  a  b  ') "$(printf '  a  b  ')" $(true) "" ; echo
+
+$(echo echo) first-stage
+echo one | $(echo cat)
+echo one | $(echo tr o O) | $(echo cat)
+$(echo echo) piped | tr a-z A-Z
+echo to-file > $(echo out).txt
+cat < $(echo out).txt
+
+echo hi | $(true)
+echo empty-last $?
+$(true) | echo empty-first
+echo mid | $(true) | cat
+$(true)
+echo only-empty $?
+$(false)
+echo only-false $?
+
+export "IFS= :"
+printf '<%s>' $(printf '%s' 'a:b::c:') ; printf '\n'
+printf '<%s>' $(printf '%s' ' : a :: b') ; printf '\n'
+printf '<%s>' x$(printf '%s' 'a:b')y ; printf '\n'
+unset IFS
+
+for n in $(printf '1\n2\n3\n'); do echo item $n; done
+count() { echo count $#; }
+count $(printf 'a b\nc')
+count "$(printf 'a b\nc')"
+echo $(echo $(echo $(echo deep)))
@@ -0,0 +1,11 @@
+# a syntax error is reported, sets $? to 2 and the script carries on
+echo before
+fi
+echo status $?
+if true; then echo x; done
+echo status $?
+for; do echo x; done
+echo status $?
+echo )
+echo status $?
+echo after
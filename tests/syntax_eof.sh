@@ -0,0 +1,4 @@
+# the script ends inside a while loop
+echo before
+while true; do
+  echo never
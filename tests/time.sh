@@ -0,0 +1,11 @@
+# time prefix and the usage variables: the report's layout and the
+# status it keeps, with the figures replaced by N
+sh -c '$SMALLSH -c "time sleep 0.1; echo status \$?; time false; echo status \$?; time echo built-in | cat" 2>&1 | sed "/^\(real\|user\|sys\|maxrss\|faults\)/s/[0-9][0-9.]*/N/g"'
+sleep 0.2
+echo $SMALLSH_REAL | grep -q '^0\.[2-9]'; echo real $?
+sh -c 'exit 0'
+test -n "$SMALLSH_USER"; echo user $?
+test -n "$SMALLSH_SYS"; echo sys $?
+test $SMALLSH_RSS -gt 0; echo rss $?
+test $SMALLSH_MINFLT -ge 0; echo minflt $?
+test $SMALLSH_MAJFLT -ge 0; echo majflt $?
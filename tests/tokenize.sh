@@ -0,0 +1,15 @@
+# tokenizer: quotes, escapes, operator characters inside words, and
+# lines and words far longer than the old fixed buffers
+echo 'single  quoted' "double  quoted" mixed'  'parts"  "here
+echo "a \"quote\" and \$A" 'it''s' back\ slash\\ end
+echo "" '' x
+echo a|b x>y
+echo '|' '>' '<' '&' ';' "#"
+echo semi; echo colon
+echo word # a comment
+echo 'unterminated
+echo status $?
+seq 1 5000 | tr '\n' ' ' | sed 's/^/echo /' > manywords
+$SMALLSH manywords | wc -w
+head -c 200000 /dev/zero | tr '\0' x | sed 's/^/echo /' > longword
+$SMALLSH longword | wc -c
@@ -0,0 +1,11 @@
+# stage tracing: which stages are recorded under each engine and how
+# often, with the timings dropped; -r, off and usage errors
+printf 'trace on\n/bin/true\necho x | cat\ntrace\ntrace -r\ntrace\ntrace off\n/bin/true\ntrace\ntrace bogus\necho status $?\n' > traced
+echo default engine:
+sh -c 'env -u SMALLSH_SPAWN $SMALLSH traced 2>&1 | grep -v "\.\." | sed "s/ *mean.*//"'
+echo fork engine:
+sh -c 'SMALLSH_SPAWN=fork $SMALLSH traced 2>&1 | grep -v "\.\." | sed "s/ *mean.*//"'
+printf 'echo traced to a file\n' > one
+sh -c 'SMALLSH_TRACE=events.json $SMALLSH one'
+head -c 1 events.json; echo
+grep -c '"name":"read"' events.json